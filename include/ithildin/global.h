@@ -66,7 +66,7 @@ extern struct me_t {
     conf_list_t *confhead;        /* head of configuration data */
 
     LIST_HEAD(, module) modules;
-    LIST_HEAD(, timer_event) timers;
+    LIST_HEAD(, heap) heaps;        /* all block heaps, see heap.c */
 
     /* static events */
     struct {
@@ -12,20 +12,31 @@
 
 typedef struct hashtable hashtable_t;
 
-SLIST_HEAD(hashbucket, hashent);
+/* a slot in a table.  tables are open-addressed (with linear probing), so
+ * entries live right in the slot array.  'ent' is NULL for an empty slot. */
 struct hashent {
     void    *ent;
-    unsigned int hv;        /* full hash value (i.e. no modulus).  makes for
+    uint32_t hv;            /* full hash value (i.e. no modulus).  makes for
                                quick compares. */
-    SLIST_ENTRY(hashent) lp;
 };
 
 struct hashtable {
-    uint32_t size;          /* thte size of the hash table */
+    uint32_t size;          /* the (nominal) size of the hash table.  there
+                               are HASH_SLOTS times this many slots. */
 #define hashtable_size(x) ((x)->size)
     uint32_t entries;       /* number of entries in the hash table */
 #define hashtable_count(x) ((x)->entries)
-    struct hashbucket *table;   /* our table */
+    struct hashent *table;  /* our slots */
+    uint32_t mask;          /* the number of slots, less one */
+
+    /* when a table grows, entries are moved from the old slots a few at a
+     * time by later calls, instead of all at once.  'old' is NULL unless
+     * this is going on. */
+    struct hashent *old;    /* the old slots */
+    uint32_t oldmask;       /* the number of old slots, less one */
+    uint32_t oldentries;    /* entries still in the old slots */
+    uint32_t migrate;       /* the next old slot to move */
+
     size_t  keyoffset;      /* this stores the offset of the key from the
                                given structure */
     size_t  keylen;         /* the length of the key.  this CANNOT be 0.  If
@@ -34,23 +45,32 @@ struct hashtable {
 
     /* these are useful for debugging the state of the hash system */
 #ifdef DEBUG_CODE
-    int     max_per_bucket; /* most entries in a single bucket */
-    uint32_t empty_buckets; /* number of empty buckets */
+    int     max_per_bucket; /* longest probe made to insert an entry */
+    uint32_t empty_buckets; /* number of empty slots */
 #endif
-#define HASH_FL_NOCASE 0x1      /* ignore case (tolower before hash) */
+#define HASH_FL_NOCASE 0x1      /* ignore case (the fold map starts out as
+                                   tolower(), see 'fold' below) */
 #define HASH_FL_STRING 0x2      /* key is a nul-terminated string, treat len
                                    as a maximum length to hash */
-#define HASH_FL_INSERTHEAD 0x4  /* insert values at the head of their
-                                   respective buckets (default) */
-#define HASH_FL_INSERTTAIL 0x8  /* insert values at the tail of their bucket */
+#define HASH_FL_INSERTHEAD 0x4  /* hash_find() returns the newest of several
+                                   entries with the same key (default) */
+#define HASH_FL_INSERTTAIL 0x8  /* hash_find() returns the oldest of them */
     int            flags;
-    /* the symbol for our comparison function, used in hash_find_ent().  This
-     * behaves much like the compare function used in qsort().  This means that
-     * a return of 0 (ZERO) means success!  (this lets you use stuff like
-     * strncmp easily).  We expect a symbol with a type of:
-     * int (*)(void *, void *, size_t).  If the value is NULL then the memcmp
-     * function is used instead (with a little kludge-work ;) */
+    /* the symbol for our comparison function.  hash_find() calls it on
+     * each entry in the probe run whose full hash value matches the key's,
+     * and hash_insert() does the same (unless the table is
+     * HASH_FL_INSERTTAIL) to put a new entry ahead of older ones with the
+     * same key.  This behaves much like the compare function used in
+     * qsort().  This means that a return of 0 (ZERO) means success!  (this
+     * lets you use stuff like strncmp easily).  We expect a symbol with a
+     * type of: int (*)(void *, void *, size_t).  If no name is given when
+     * the table is created memcmp is used instead. */
     struct msymbol *cmpsym;
+    /* every byte of a key is passed through this before it is hashed.  for
+     * HASH_FL_NOCASE tables it starts out as tolower(), for others it
+     * leaves bytes as they are.  whatever makes two keys compare equal
+     * must also make them fold the same way (see hash_set_foldmap()). */
+    unsigned char fold[256];
 };
 
 /* table management functions */
@@ -59,5 +79,9 @@ void destroy_hash_table(hashtable_t *);
 int hash_insert(hashtable_t *, void *);
 int hash_delete(hashtable_t *, void *);
 void *hash_find(hashtable_t *, void *);
+/* set the fold map for a table (say, to match the character map used by
+ * its compare function).  the map is copied, and if it changes anything
+ * already in the table is rehashed. */
+void hash_set_foldmap(hashtable_t *, const unsigned char *);
 #endif
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */
@@ -0,0 +1,47 @@
+/*
+ * heap.h: block heap allocator structures and prototypes
+ *
+ * Copyright 2002 the Ithildin Project.
+ * See the COPYING file for more information on licensing and use.
+ *
+ * $Id$
+ */
+
+#ifndef HEAP_H
+#define HEAP_H
+
+typedef struct heap heap_t;
+
+/* each block is a header followed by 'count' items of 'size' bytes.  the
+ * header is only kept so that the blocks can be given back when the heap is
+ * destroyed. */
+struct heap_block {
+    SLIST_ENTRY(heap_block) lp;
+};
+
+struct heap {
+    char    name[32];       /* a name for the heap (shown in stats) */
+    size_t  size;           /* the size of each item in the heap */
+    int     count;          /* the number of items allocated per block */
+
+    void    *free;          /* the first free item in the heap.  each free
+                               item points to the next (see heaps.txt) */
+    SLIST_HEAD(, heap_block) blocks;
+
+    struct {
+        int     blocks;     /* blocks allocated */
+        int     used;       /* items currently handed out */
+        int     peak;       /* the most items ever handed out at once */
+        uint64_t allocs;    /* total number of allocations */
+    } stats;
+
+    LIST_ENTRY(heap) lp;
+};
+
+heap_t *create_heap(size_t, int, const char *);
+void destroy_heap(heap_t *);
+void *heap_alloc(heap_t *);
+void heap_free(heap_t *, void *);
+
+#endif
+/* vi:set ts=8 sts=4 sw=4 tw=76 et: */
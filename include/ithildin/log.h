@@ -28,6 +28,15 @@ struct log_event_data {
     const char *msg;
 };
 
+/* a hook on the log events may also register a filter, which tells
+ * log_vmsg() ahead of time whether the hook would do anything with a
+ * message of the given level from the given module.  if every hook on a
+ * message's event has a filter and none of them want the message it is
+ * never formatted. */
+typedef bool (*log_filter_t)(enum logtypes, const char *);
+void log_add_filter(hook_function_t, log_filter_t);
+void log_remove_filter(hook_function_t);
+
 /* these shouldn't actually be called by anyone, in theory. */
 void log_msg(enum logtypes, const char *, const char *, ...) __PRINTF(3);
 void log_vmsg(enum logtypes, const char *, const char *, va_list);
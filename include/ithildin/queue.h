@@ -10,6 +10,11 @@
 #ifndef QUEUE_H
 #define        QUEUE_H
 
+/* STAILQ_LAST needs this, and not every system provides it. */
+#ifndef __offsetof
+# define __offsetof(type, field) offsetof(type, field)
+#endif
+
 /* a shim struct for the *_ALLOC calls. */
 struct queue__shim__struct__ {
     char c;
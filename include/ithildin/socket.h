@@ -51,6 +51,10 @@ struct isocket {
     void    *udata;            /* user data...useful for when sockets are
                                hooked */
 
+#ifdef POLLER_EPOLL
+    uint32_t pollmask;            /* events currently registered with epoll */
+#endif
+
     int            err;            /* last errno on this socket. */
     uint32_t state;            /* state is set from one of the below */
 #define SOCKET_FL_OPEN                0x0001
@@ -64,6 +68,7 @@ struct isocket {
 #define SOCKET_FL_WANT_WRITE        0x0080
 #define SOCKET_FL_INTERNAL        0x0100
 #define SOCKET_FL_EOF                0x0200
+#define SOCKET_FL_DEFERRED        0x0400
 
 #ifdef HAVE_OPENSSL
 #define SOCKET_FL_SSL                (0x0001 << 16)
@@ -106,6 +111,7 @@ isocket_t *socket_accept(isocket_t *);
 int socket_connect(isocket_t *, char *, char *, int);
 int socket_read(isocket_t *, char *, size_t);
 int socket_write(isocket_t *, char *, size_t);
+int socket_writev(isocket_t *, struct iovec *, int);
 const char *socket_strerror(isocket_t *);
 void socket_monitor(isocket_t *, int);
 void socket_unmonitor(isocket_t *, int);
@@ -116,13 +122,18 @@ void socket_unmonitor(isocket_t *, int);
 void reap_dead_sockets(void);
 
 /* the one external poller function, poll_sockets() will continue to handle
- * socket data input (probably forever) unless something evil happens */
+ * socket data input (probably forever) unless something evil happens.  the
+ * argument is the longest time (in milliseconds) to wait for something to
+ * happen, or 0 to wait indefinitely. */
 int poll_sockets(time_t);
 
 #if defined(POLLER_SELECT)
 extern fd_set select_rfds, select_wfds;
 #elif defined(POLLER_POLL)
 extern struct pollfd *pollfds;
+#elif defined(POLLER_EPOLL)
+extern int epollfd;
+extern struct epoll_event *epoll_events;
 #elif defined(POLLER_KQUEUE)
 extern int kqueuefd;
 extern struct kevent *kev_list;
@@ -132,6 +143,13 @@ extern int kev_num_changes;
 
 extern unsigned int cursockets, maxsockets;
 extern struct isocket_list allsockets;
+#if defined(POLLER_SELECT) || defined(POLLER_POLL)
+extern isocket_t **fdsockets;
+extern int highsocket;
+#endif
+#ifndef POLLER_EPOLL
+extern isocket_t **readysockets;
+#endif
 
 /* these are some ssl-specific functions which we provide for others.  in the
  * non-SSL case these are defined as macros which result in failure. */
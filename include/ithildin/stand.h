@@ -80,12 +80,18 @@ typedef int _Bool;
 #ifdef POLLER_KQUEUE
 # include <sys/event.h>
 #endif
+#ifdef POLLER_EPOLL
+# include <sys/epoll.h>
+#endif
 #ifdef HAVE_SYS_SOCKET_H
 # include <sys/socket.h>
 #endif
 #ifdef HAVE_SYS_STAT_H
 # include <sys/stat.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
 #if TIME_WITH_SYS_TIME
 # include <sys/time.h>
 # include <time.h>
@@ -149,6 +155,7 @@ typedef int _Bool;
 #include <ithildin/event.h>
 #include <ithildin/global.h>
 #include <ithildin/hash.h>
+#include <ithildin/heap.h>
 #include <ithildin/log.h>
 #include <ithildin/malloc.h>
 #include <ithildin/md5.h>
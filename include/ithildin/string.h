@@ -98,6 +98,19 @@ int match(const char *wild, const char *string);
 int hostmatch(const char *wild, const char *string);
 int ipmatch(const char *wild, const char *string);
 
+/* compiled patterns, for patterns which are used over and over.  a matcher
+ * made with no flags matches like match(), MATCH_FL_HOST makes it match like
+ * hostmatch(), and with MATCH_FL_IP it can also be used with
+ * matcher_ipmatch() like ipmatch(). */
+typedef struct matcher matcher_t;
+#define MATCH_FL_HOST 0x1
+#define MATCH_FL_IP 0x2
+matcher_t *create_matcher(const char *wild, int flags);
+void destroy_matcher(matcher_t *);
+const char *matcher_pattern(const matcher_t *);
+int matcher_match(const matcher_t *, const char *string);
+int matcher_ipmatch(const matcher_t *, const char *string);
+
 /* string conversion functions */
 bool str_conv_bool(char *, bool);
 const char *bool_conv_str(bool, const char *, const char *);
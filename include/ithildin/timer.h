@@ -15,24 +15,32 @@ typedef uint64_t timer_ref_t;
 #define TIMER_INVALID (uint64_t)0xffffffffffffffffLL
 
 /* The timer structure.  This contains the function to call back, and various
- * data values pertaining to execution time. */
+ * data values pertaining to execution time.  Times here are kept in
+ * milliseconds, see timer_now() below. */
 struct timer_event {
     timer_ref_t ref;                /* timer reference number */
     int            reps;                /* number of times to repeat this call.  a
                                    negative value indicates indefinite
                                    repetition. */
-    time_t  interval;                /* interval between calls. */
-    time_t  next;                /* the (absolute) next time this call should be
-                                   made. */
+    uint64_t interval;                /* interval between calls (msec). */
+    uint64_t next;                /* the (absolute) next time this call should be
+                                   made (msec). */
     void    *udata;                /* data value passed with the callback */
     hook_function_t callback;        /* the callback function */
 
-    LIST_ENTRY(timer_event) lp;
+    unsigned int heapidx;        /* our position in the timer heap */
+    int            flags;
+#define TIMER_FL_RUNNING        0x1        /* callback is being called */
+#define TIMER_FL_ADJUSTED        0x2        /* adjusted from within callback */
+#define TIMER_FL_DESTROYED        0x4        /* destroyed from within callback */
 };
 
 timer_ref_t create_timer(int, time_t, hook_function_t, void *);
+timer_ref_t create_timer_ms(int, uint64_t, hook_function_t, void *);
 void destroy_timer(timer_ref_t);
 void adjust_timer(timer_ref_t, int, time_t);
+void adjust_timer_ms(timer_ref_t, int, uint64_t);
+uint64_t timer_now(void);
 time_t exec_timers(void);
 
 #endif
@@ -23,11 +23,14 @@ struct dns_data_struct dns;
 HOOK_FUNCTION(dns_socket_hook);
 HOOK_FUNCTION(dns_reload_hook);
 int dns_parse_conf(conf_list_t *conf);
+static int dns_add_nameserver(char *);
+static void dns_resolv_conf(void);
 
 HOOK_FUNCTION(dns_socket_hook) {
     static unsigned char pkt[DNS_MAX_PACKET_SIZE];
     int size = 0;
     isocket_t *sock = (isocket_t *)data;
+    struct dns_nameserver *nsp = (struct dns_nameserver *)sock->udata;
         
     /* first send off any queries we might have */
     while (dns_lookup_send())
@@ -36,33 +39,94 @@ HOOK_FUNCTION(dns_socket_hook) {
 
     if (SOCKET_READ(sock)) {
         do {
-            size = socket_read(dns.sock, pkt, DNS_MAX_PACKET_SIZE);
+            size = socket_read(sock, pkt, DNS_MAX_PACKET_SIZE);
             if (size < 0) {
                 /* XXX this is probably a big problem and should be handled 
                  * better */
-                log_error("socket_read(dns_sock): %s",
-                        socket_strerror(dns.sock));
+                log_error("socket_read(dns_sock %s): %s", nsp->address,
+                        socket_strerror(sock));
                 return NULL;
             }
             if (size)
-                dns_packet_parse(pkt, size);
+                dns_packet_parse(nsp - dns.servers, pkt, size);
         } while (size > 0);
     }
 
     return NULL;
 }
 
-/* examine a lookup to see if it should be expired, or retried */
+/* pick the nameserver to send a query to: the one with the lowest
+ * round-trip time which isn't marked down, skipping 'skip'.  if 'any' is
+ * set and every nameserver is down, the one due back first is used. */
+int dns_nameserver_pick(int skip, bool any) {
+    int i, best = -1, down = -1;
+
+    for (i = 0;i < dns.nservers;i++) {
+        if (i == skip)
+            continue;
+        if (dns.servers[i].down > me.now) {
+            if (down == -1 || dns.servers[i].down < dns.servers[down].down)
+                down = i;
+        } else if (best == -1 || dns.servers[i].srtt < dns.servers[best].srtt)
+            best = i;
+    }
+
+    return (best == -1 && any ? down : best);
+}
+
+/* fold a new round-trip time into a nameserver's average, the same way TCP
+ * does.  an answer also clears any failures the nameserver had. */
+void dns_nameserver_rtt(int ns, int rtt) {
+    struct dns_nameserver *nsp;
+    int delta;
+
+    if (ns < 0 || ns >= dns.nservers)
+        return;
+    nsp = &dns.servers[ns];
+
+    delta = rtt - nsp->srtt;
+    nsp->srtt += delta / 8;
+    if (delta < 0)
+        delta = -delta;
+    nsp->rttvar += (delta - nsp->rttvar) / 4;
+    nsp->fails = 0;
+    nsp->down = 0;
+}
+
+/* note that a nameserver left a query unanswered.  its round-trip time is
+ * backed off, and if this keeps happening it is marked down for a while. */
+void dns_nameserver_failed(int ns) {
+    struct dns_nameserver *nsp;
+
+    if (ns < 0 || ns >= dns.nservers)
+        return;
+    nsp = &dns.servers[ns];
+
+    nsp->srtt *= 2;
+    if (nsp->srtt > dns.pending.timeout * 1000)
+        nsp->srtt = dns.pending.timeout * 1000;
+    if (++nsp->fails >= DNS_NAMESERVER_FAILS && nsp->down <= me.now) {
+        nsp->down = me.now + dns.pending.timeout;
+        log_notice("nameserver %s is not answering, ignoring it for %s",
+                nsp->address, time_conv_str(dns.pending.timeout));
+    }
+}
+
+/* examine a pending lookup to see if it should be retried, or given up on */
 HOOK_FUNCTION(dns_timer_hook) {
     dns_lookup_t *dlp = (dns_lookup_t *)data;
 
     dlp->timer = TIMER_INVALID;
-    if (dlp->flags & DNS_LOOKUP_FL_CACHE) {
-        destroy_dns_lookup(dlp);
+    assert(dlp->retry >= 0 && dlp->retry <= dns.pending.retries);
+
+    /* lookups which went over to tcp are timed out by the tcp query. */
+    if (dlp->flags & DNS_LOOKUP_FL_TCP)
         return NULL;
-    }
 
-    assert(dlp->retry >= 0 && dlp->retry <= dns.pending.retries);
+    /* whoever we asked didn't answer. */
+    dns_nameserver_failed(dlp->ns);
+    if (dlp->hns != -1)
+        dns_nameserver_failed(dlp->hns);
 
     /* if it's not a cached entry (darn) we need to figure out if it needs a
      * retry or not.. */
@@ -85,6 +149,23 @@ HOOK_FUNCTION(dns_timer_hook) {
     return NULL;
 }
 
+/* expire everything at the head of the cache's expiry list whose time has
+ * come, and set the timer again for whatever is left first. */
+HOOK_FUNCTION(dns_cache_timer_hook) {
+    dns_lookup_t *dlp;
+
+    dns.cache.timer = TIMER_INVALID;
+    while ((dlp = TAILQ_FIRST(&dns.cache.expiry)) != NULL &&
+            dlp->expire <= me.now)
+        destroy_dns_lookup(dlp);
+
+    if (dlp != NULL)
+        dns.cache.timer = create_timer(0, dlp->expire - me.now,
+                dns_cache_timer_hook, NULL);
+
+    return NULL;
+}
+
 HOOK_FUNCTION(dns_reload_hook) {
 
     /* if the parser fails, there *may* be trouble. :/ */
@@ -96,7 +177,7 @@ HOOK_FUNCTION(dns_reload_hook) {
 }
 
 int dns_parse_conf(conf_list_t *conf) {
-    char *s, *nameserver;
+    char *s;
     char *addr = "0.0.0.0"; /* IPv4 INADDR_ANY by default. */
     char *qport = NULL;
     int i;
@@ -104,34 +185,11 @@ int dns_parse_conf(conf_list_t *conf) {
     qport = conf_find_entry("queryport", conf, 1);
     if (qport == NULL)
         qport = int_conv_str(DNS_DEFAULT_PORT);
+    strlcpy(dns.port, qport, sizeof(dns.port));
     s = conf_find_entry("bind", conf, 1);
     if (s != NULL)
         addr = s;
-    s = conf_find_entry("nameserver", conf, 1);
-    if (s == NULL)
-        s = "auto";
-
-    if (!strcasecmp(s, "auto")) {
-        FILE *fp = fopen("/etc/resolv.conf", "r");
-        char buf[1024], *s2;
-        if (fp != NULL) {
-            while ((fgets(buf, 1024, fp)) != NULL) {
-                if (!strncasecmp(buf, "nameserver", 10)) {
-                    s = buf + 10;
-                    while (isspace(*s))
-                        s++;
-                    s2 = s;
-                    while (!isspace(*s2))
-                        s2++;
-                    *s2 = '\0';
-
-                    break;
-                }
-            }
-            fclose(fp);
-        }
-    }
-    nameserver = s;
+    strlcpy(dns.bind, addr, FQDN_MAXLEN + 1);
 
     dns.pending.timeout = str_conv_time(
             conf_find_entry("lookup-timeout", conf, 1), 10);
@@ -148,6 +206,8 @@ int dns_parse_conf(conf_list_t *conf) {
             conf_find_entry("cache-expire", conf, 1), 3600);
     dns.cache.failure = str_conv_bool(
             conf_find_entry("cache-failures", conf, 1), 1);
+    dns.hedge = str_conv_bool(
+            conf_find_entry("hedge-queries", conf, 1), 1);
     dns.cache.max = str_conv_int(
             conf_find_entry("cache-size", conf, 1), 256);
     if (dns.cache.max < 0) {
@@ -167,42 +227,104 @@ int dns_parse_conf(conf_list_t *conf) {
     for (i = dns.pending.retries - 1;i >= 0;i--)
         dns.pending.retry_times[i] = dns.pending.retry_times[i + 1] * 2;
 
-    /* set up our socket.  if we already had a socket, bomb it and create a new
-     * one. */
-    if (dns.sock != NULL)
-        destroy_socket(dns.sock);
-    if ((dns.sock = create_socket()) == NULL) {
-        log_error("couldn't create dns socket, dns won't work");
+    /* set up our nameservers.  if we already had some, bomb them and
+     * create them anew.  each 'nameserver' entry may name one, or be
+     * 'auto' to use those in /etc/resolv.conf (the default). */
+    for (i = 0;i < dns.nservers;i++)
+        destroy_socket(dns.servers[i].sock);
+    dns.nservers = 0;
+    s = NULL;
+    while ((s = conf_find_entry_next("nameserver", s, conf, 1)) != NULL) {
+        if (!strcasecmp(s, "auto"))
+            dns_resolv_conf();
+        else
+            dns_add_nameserver(s);
+    }
+    if (conf_find_entry("nameserver", conf, 1) == NULL)
+        dns_resolv_conf();
+    if (dns.nservers == 0) {
+        log_error("no usable nameservers, dns won't work.");
         return 0;
     }
-    if (!set_socket_address(isock_laddr(dns.sock), addr, NULL,
+
+    /* flush the cache too */
+    while (!TAILQ_EMPTY(&dns.cache.list))
+        destroy_dns_lookup(TAILQ_FIRST(&dns.cache.list));
+
+    return 1;
+}
+
+/* add every nameserver listed in /etc/resolv.conf */
+static void dns_resolv_conf(void) {
+    FILE *fp = fopen("/etc/resolv.conf", "r");
+    char buf[1024], *s, *s2;
+
+    if (fp == NULL) {
+        log_warn("couldn't open /etc/resolv.conf: %s", strerror(errno));
+        return;
+    }
+    while ((fgets(buf, 1024, fp)) != NULL) {
+        if (!strncasecmp(buf, "nameserver", 10)) {
+            s = buf + 10;
+            while (isspace(*s))
+                s++;
+            s2 = s;
+            while (*s2 != '\0' && !isspace(*s2))
+                s2++;
+            *s2 = '\0';
+            if (*s != '\0')
+                dns_add_nameserver(s);
+        }
+    }
+    fclose(fp);
+}
+
+/* set up a socket to query the given nameserver with, and add it to our
+ * list. */
+static int dns_add_nameserver(char *address) {
+    struct dns_nameserver *nsp;
+
+    if (dns.nservers == DNS_MAX_NAMESERVERS) {
+        log_warn("too many nameservers, not using %s", address);
+        return 0;
+    }
+    nsp = &dns.servers[dns.nservers];
+    memset(nsp, 0, sizeof(struct dns_nameserver));
+    strlcpy(nsp->address, address, FQDN_MAXLEN + 1);
+    nsp->srtt = DNS_NAMESERVER_RTT;
+    nsp->rttvar = DNS_NAMESERVER_RTT / 2;
+
+    if ((nsp->sock = create_socket()) == NULL) {
+        log_error("couldn't create dns socket for %s", address);
+        return 0;
+    }
+    if (!set_socket_address(isock_laddr(nsp->sock), dns.bind, NULL,
                 SOCK_DGRAM)) {
-        log_error("couldn't set socket address of dns socket to %s", addr);
+        log_error("couldn't set socket address of dns socket to %s",
+                dns.bind);
+        destroy_socket(nsp->sock);
         return 0;
     }
-    if (!open_socket(dns.sock)) {
-        log_error("couldn't open dns socket, dns won't work.");
+    if (!open_socket(nsp->sock)) {
+        log_error("couldn't open dns socket for %s", address);
+        destroy_socket(nsp->sock);
         return 0;
     }
 
-    /* setup our socket.  connect to our chosen nameserver (as such), add our
-     * data hook, and set our monitoring for I/O */
-    if (!socket_connect(dns.sock, nameserver, qport, SOCK_DGRAM)) {
-        log_error("couldn't bind dns socket packets to %s/%s", nameserver,
-                qport);
+    /* setup our socket.  connect to the nameserver (as such), add our data
+     * hook, and set our monitoring for I/O */
+    if (!socket_connect(nsp->sock, address, dns.port, SOCK_DGRAM)) {
+        log_error("couldn't bind dns socket packets to %s/%s", address,
+                dns.port);
+        destroy_socket(nsp->sock);
         return 0;
     }
-        
-    /* now add a hook for our socket and keep an eye on it */
-    socket_monitor(dns.sock, SOCKET_FL_READ | SOCKET_FL_WRITE);
-    add_hook(dns.sock->datahook, dns_socket_hook);
-
-    log_notice("dns module using nameserver %s/%s", nameserver, qport);
-
-    /* flush the cache too */
-    while (!TAILQ_EMPTY(&dns.cache.list))
-        destroy_dns_lookup(TAILQ_FIRST(&dns.cache.list));
+    nsp->sock->udata = nsp;
+    socket_monitor(nsp->sock, SOCKET_FL_READ | SOCKET_FL_WRITE);
+    add_hook(nsp->sock->datahook, dns_socket_hook);
 
+    log_notice("dns module using nameserver %s/%s", address, dns.port);
+    dns.nservers++;
     return 1;
 }
 
@@ -294,14 +416,28 @@ dns_type_t dns_str_conv_type(const char *str) {
 MODULE_LOADER(dns) {
 
     dns.confdata = confdata;
-    if (!dns_parse_conf(*confdata))
+    EXPORT_SYM(dns_lookup_cmp);
+    dns.table = create_hash_table(1024, offsetof(dns_lookup_t, data),
+            DNS_MAX_NAMELEN, HASH_FL_NOCASE | HASH_FL_STRING,
+            "dns_lookup_cmp");
+    dns.pending.ids = create_hash_table(256, offsetof(dns_lookup_t, id),
+            sizeof(uint16_t), 0, NULL);
+    TAILQ_INIT(&dns.cache.expiry);
+    LIST_INIT(&dns.tcp);
+    dns.cache.timer = TIMER_INVALID;
+
+    if (!dns_parse_conf(*confdata)) {
+        destroy_hash_table(dns.table);
+        destroy_hash_table(dns.pending.ids);
         return 0; /* conf parser failure! */
+    }
 
     add_hook(me.events.read_conf, dns_reload_hook);
     return 1;
 }
 
 MODULE_UNLOADER(dns) {
+    int i;
     
     while (!TAILQ_EMPTY(&dns.pending.alist))
         destroy_dns_lookup(TAILQ_FIRST(&dns.pending.alist));
@@ -309,8 +445,15 @@ MODULE_UNLOADER(dns) {
         destroy_dns_lookup(TAILQ_FIRST(&dns.pending.wlist));
     while (!TAILQ_EMPTY(&dns.cache.list))
         destroy_dns_lookup(TAILQ_FIRST(&dns.cache.list));
-
-    destroy_socket(dns.sock);
+    if (dns.cache.timer != TIMER_INVALID)
+        destroy_timer(dns.cache.timer);
+    destroy_hash_table(dns.table);
+    destroy_hash_table(dns.pending.ids);
+
+    while (!LIST_EMPTY(&dns.tcp))
+        destroy_dns_tcp_query(LIST_FIRST(&dns.tcp));
+    for (i = 0;i < dns.nservers;i++)
+        destroy_socket(dns.servers[i].sock);
     remove_hook(me.events.read_conf, dns_reload_hook);
 }
 
@@ -27,6 +27,7 @@
 #define DNS_MAX_SEGLEN      63      /* maximum length of an FQDN segment. */
 #define DNS_HEADER_LEN      12      /* size of a query/answer header. */
 #define DNS_DEFAULT_PORT    53      /* default DNS server port */
+#define DNS_MAX_TCP_PACKET_SIZE 65535 /* maximum size of a packet over tcp */
 
 /* various query classes available.  I've never seen a use for anything but the
  * 'IN' class, but we include these for completeness. */
@@ -196,6 +197,40 @@ struct dns_rr_wks {
     unsigned char map[8192];                    /* bit map of available ports */
 };
 
+/*
+ * Each configured nameserver gets one of these.  Queries are sent to the
+ * fastest nameserver which is not marked down, going by a smoothed
+ * round-trip time kept much the way TCP keeps one.  Servers which leave
+ * several queries in a row unanswered are marked down for a while.
+ */
+#define DNS_MAX_NAMESERVERS 8       /* most nameservers we will use */
+#define DNS_NAMESERVER_RTT  100     /* round-trip time assumed at first (ms) */
+#define DNS_NAMESERVER_FAILS 3      /* unanswered queries to mark one down */
+#define DNS_HEDGE_MIN       20      /* shortest wait before hedging (ms) */
+struct dns_nameserver {
+    char    address[FQDN_MAXLEN + 1]; /* address of the server */
+    isocket_t *sock;                /* (connected) udp socket */
+    int     srtt;                   /* smoothed round-trip time (ms) */
+    int     rttvar;                 /* and its mean deviation (ms) */
+    int     fails;                  /* queries unanswered in a row */
+    time_t  down;                   /* marked down until this time */
+};
+
+/* a query retried over tcp after a truncated reply.  the reply is parsed
+ * just like one which came over udp. */
+struct dns_tcp_query {
+    isocket_t *sock;                /* our socket */
+    char    address[FQDN_MAXLEN + 1]; /* the nameserver it was sent to */
+    uint16_t id;                    /* id of the lookup */
+    bool    sent;                   /* has the query been sent yet? */
+    unsigned char *buf;             /* query going out, then reply coming in */
+    size_t  len;                    /* length of the data in 'buf' */
+    size_t  want;                   /* and how much of it there should be */
+    timer_ref_t timer;              /* timeout for the whole exchange */
+
+    LIST_ENTRY(dns_tcp_query) lp;
+};
+
 /*
  * Here is the module's global data.  This is declared in dns.c and used to
  * hold a variety of settings.
@@ -204,7 +239,14 @@ struct dns_lookup;                    /* forward declarations */
 TAILQ_HEAD(dns_lookup_tailq, dns_lookup);
 extern struct dns_data_struct {
     conf_list_t **confdata;         /* configuration data */
-    isocket_t *sock;                /* server socket */
+    char    bind[FQDN_MAXLEN + 1];  /* address to send queries from */
+    char    port[32];               /* port to send queries to */
+    struct dns_nameserver servers[DNS_MAX_NAMESERVERS]; /* nameservers */
+    int     nservers;               /* and how many of them there are */
+    bool    hedge;                  /* send hedged queries? */
+    LIST_HEAD(, dns_tcp_query) tcp; /* queries over tcp */
+    hashtable_t *table;             /* every lookup (pending or cached),
+                                       keyed on class, type, and data */
     /* this sub structure holds pending lookups. */
     struct {
         time_t timeout;             /* timeout for lookups */
@@ -216,6 +258,7 @@ extern struct dns_data_struct {
         int acount;                 /* count of active lookups */
         struct dns_lookup_tailq alist; /* list of active lookups */
         struct dns_lookup_tailq wlist; /* list of waiting lookups */
+        hashtable_t *ids;           /* pending lookups keyed on id */
     } pending;
     /* and this is the sub structure for cached lookups */
     struct {
@@ -224,6 +267,9 @@ extern struct dns_data_struct {
         int max;                    /* maximum number of cached entries */
         int count;                  /* current number of cached entries */
         struct dns_lookup_tailq list; /* list of lookups */
+        struct dns_lookup_tailq expiry; /* the same lookups, soonest to
+                                           expire first */
+        timer_ref_t timer;          /* timer for the head of 'expiry' */
     } cache;
 } dns;
 
@@ -235,9 +281,20 @@ int dn_comp(unsigned char *exp_dn, unsigned char *comp_dn, int length,
 int dn_skipname(unsigned char *comp_dn, unsigned char *eom);
 
 /* and the external functions from packet.c */
-void dns_packet_parse(unsigned char *, size_t);
+void dns_packet_parse(int, unsigned char *, size_t);
 int dns_lookup_send(void);
 HOOK_FUNCTION(dns_timer_hook);
+HOOK_FUNCTION(dns_hedge_timer_hook);
+HOOK_FUNCTION(dns_cache_timer_hook);
+
+/* dns.c */
+int dns_nameserver_pick(int, bool);
+void dns_nameserver_rtt(int, int);
+void dns_nameserver_failed(int);
+
+/* tcp.c */
+int dns_tcp_query(int, struct dns_lookup *);
+void destroy_dns_tcp_query(struct dns_tcp_query *);
 
 /* set the logging name.. */
 #undef LOG_MODULENAME
@@ -16,6 +16,7 @@
 IDSTRING(rcsid, "$Id: lookup.c 611 2005-11-22 10:32:23Z wd $");
 
 static dns_lookup_t *find_dns_lookup(dns_class_t, dns_type_t, unsigned char *);
+static void dns_cache_expiry_insert(dns_lookup_t *);
 
 /* this function constructs a dns_lookup item and places it on the queue of
  * pending lookups.  if the pending queue is empty it tries to send the lookup
@@ -70,10 +71,18 @@ dns_lookup_t *dns_lookup(dns_class_t class, dns_type_t type,
     dlp->type = type;
     strlcpy(dlp->data, data, DNS_MAX_NAMELEN + 1);
 
+    /* pick the next id, but skip over any that still belong to a pending
+     * lookup so that a reply can only ever be matched to one of them. */
     dlp->id = dns.pending.idn++;
+    while (hashtable_count(dns.pending.ids) < 0x10000 &&
+            find_dns_lookup_id(dlp->id) != NULL)
+        dlp->id = dns.pending.idn++;
     dlp->last = me.now;
     dlp->retry = dns.pending.retries;
     dlp->timer = TIMER_INVALID;
+    dlp->ns = dlp->hns = -1;
+    dlp->hedge = TIMER_INVALID;
+    hash_insert(dns.table, dlp);
 
     /* now add it to the waiting lookup list.  if our dns socket is writeable,
      * try doing a send here too.  If the socket is writeable and acount is not
@@ -110,14 +119,28 @@ void dns_lookup_cancel(hook_function_t callback) {
  * are here. :) */
 void dns_lookup_move(dns_lookup_t *dlp, int list, bool head) {
     struct dns_lookup_tailq *dltp;
+    int pending = DNS_LOOKUP_FL_WAITING | DNS_LOOKUP_FL_PENDING;
     
+    /* pending lookups (waiting or active) are also kept in the id table so
+     * that replies can be matched to them. */
+    if (dlp->flags & pending && !(list & pending))
+        hash_delete(dns.pending.ids, dlp);
+    else if (!(dlp->flags & pending) && list & pending)
+        hash_insert(dns.pending.ids, dlp);
+
     if (dlp->flags & DNS_LOOKUP_FL_WAITING)
         TAILQ_REMOVE(&dns.pending.wlist, dlp, lp);
     else if (dlp->flags & DNS_LOOKUP_FL_PENDING) {
         TAILQ_REMOVE(&dns.pending.alist, dlp, lp);
         dns.pending.acount--;
+        /* a hedged query is only sent for an active lookup */
+        if (dlp->hedge != TIMER_INVALID) {
+            destroy_timer(dlp->hedge);
+            dlp->hedge = TIMER_INVALID;
+        }
     } else if (dlp->flags & DNS_LOOKUP_FL_CACHE) {
         TAILQ_REMOVE(&dns.cache.list, dlp, lp);
+        TAILQ_REMOVE(&dns.cache.expiry, dlp, elp);
         dns.cache.count--;
     }
 
@@ -133,6 +156,7 @@ void dns_lookup_move(dns_lookup_t *dlp, int list, bool head) {
     } else if (list == DNS_LOOKUP_FL_CACHE) {
         dltp = &dns.cache.list;
         dns.cache.count++;
+        dns_cache_expiry_insert(dlp);
     } else
         return;
 
@@ -142,6 +166,30 @@ void dns_lookup_move(dns_lookup_t *dlp, int list, bool head) {
         TAILQ_INSERT_TAIL(dltp, dlp, lp);
 }
 
+/* this places a newly cached lookup on the expiry list, which is kept in
+ * order of expiry time.  most lookups are cached for the same (configured)
+ * time, so the right spot is almost always at or very near the tail.  the
+ * single cache timer is only moved when the new lookup ends up first. */
+static void dns_cache_expiry_insert(dns_lookup_t *dlp) {
+    dns_lookup_t *dlp2;
+
+    dlp->expire = me.now + dlp->ttl;
+    dlp2 = TAILQ_LAST(&dns.cache.expiry, dns_lookup_tailq);
+    while (dlp2 != NULL && dlp2->expire > dlp->expire)
+        dlp2 = TAILQ_PREV(dlp2, dns_lookup_tailq, elp);
+    if (dlp2 != NULL) {
+        TAILQ_INSERT_AFTER(&dns.cache.expiry, dlp2, dlp, elp);
+        return;
+    }
+
+    TAILQ_INSERT_HEAD(&dns.cache.expiry, dlp, elp);
+    if (dns.cache.timer == TIMER_INVALID)
+        dns.cache.timer = create_timer(0, dlp->ttl, dns_cache_timer_hook,
+                NULL);
+    else
+        adjust_timer(dns.cache.timer, 0, dlp->ttl);
+}
+
 /* This completely obliterates a lookup, returns all memory from it and any RRs
  * it contains. */
 void destroy_dns_lookup(dns_lookup_t *dlp) {
@@ -149,6 +197,7 @@ void destroy_dns_lookup(dns_lookup_t *dlp) {
     
     /* remove it from whatever list it's on .. */
     dns_lookup_move(dlp, 0, false);
+    hash_delete(dns.table, dlp);
     destroy_event(dlp->finished);
 
     /* Clear out all the RRs it might have .. */
@@ -226,24 +275,38 @@ const char *dns_lookup_pretty_rr(struct dns_rr *drp) {
     return str;
 }
 
-/* search for a dns lookup.  try the cache, then the active, then the waiting
- * pending lists. */
+/* search for a dns lookup.  every lookup, cached or pending, is kept in
+ * one table keyed on its data.  the key handed to the table is the data of a
+ * scratch lookup holding the class and type as well, so that
+ * dns_lookup_cmp() can check all three. */
 static dns_lookup_t *find_dns_lookup(dns_class_t class, dns_type_t type,
         unsigned char *data) {
-    dns_lookup_t *dlp;
+    static dns_lookup_t key;
+
+    key.class = class;
+    key.type = type;
+    strlcpy(key.data, data, DNS_MAX_NAMELEN + 1);
+
+    return hash_find(dns.table, key.data);
+}
+
+/* find the pending lookup (waiting or active) with the given id. */
+dns_lookup_t *find_dns_lookup_id(uint16_t id) {
+
+    return hash_find(dns.pending.ids, &id);
+}
 
-#define FIND_LOOKUP(_list) do {                                                 \
-    TAILQ_FOREACH(dlp, _list, lp) {                                             \
-        if (dlp->class == class && dlp->type == type &&                         \
-                !strcasecmp(data, dlp->data))                                   \
-            return dlp;                                                         \
-    }                                                                           \
-} while (0)
-    FIND_LOOKUP(&dns.cache.list);
-    FIND_LOOKUP(&dns.pending.alist);
-    FIND_LOOKUP(&dns.pending.wlist);
-
-    return NULL;
+/* the comparison function for dns.table.  'one' and 'two' are the data of
+ * two lookups, the lookups themselves are found from those. */
+int dns_lookup_cmp(void *one, void *two, size_t len) {
+    dns_lookup_t *dlp1 = (dns_lookup_t *)((char *)one -
+            offsetof(dns_lookup_t, data));
+    dns_lookup_t *dlp2 = (dns_lookup_t *)((char *)two -
+            offsetof(dns_lookup_t, data));
+
+    if (dlp1->class != dlp2->class || dlp1->type != dlp2->type)
+        return 1;
+    return strcasecmp(one, two);
 }
 
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */
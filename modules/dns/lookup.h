@@ -35,17 +35,29 @@ typedef struct dns_lookup {
 #define DNS_LOOKUP_FL_FAILED    0x0010
 #define DNS_LOOKUP_FL_TIMEOUT   0x0020
 #define DNS_LOOKUP_FL_NXDOMAIN  0x0040
+#define DNS_LOOKUP_FL_TCP       0x0080
 #define DNS_LOOKUP_FL_CACHE     0x8000
     uint16_t flags;                     /* lookup flags */
     uint16_t id;                        /* lookup id */
     time_t last;                        /* last time this lookup was active */
     time_t ttl;                         /* maximum time to keep this lookup (in the
                                            cache */
+    time_t expire;                      /* time the cached lookup expires */
 
     unsigned int retry;                 /* retry count for the lookup */
-    timer_ref_t timer;                  /* expiration timer */
+    timer_ref_t timer;                  /* retry timer (while pending) */
+
+    unsigned char query[DNS_MAX_PACKET_SIZE]; /* the query as last sent */
+    int qlen;                           /* and its length */
+    int ns;                             /* nameserver it was sent to */
+    uint64_t sent;                      /* and when (in ms) */
+    int hns;                            /* nameserver of the hedged query
+                                           (or -1 if there wasn't one) */
+    uint64_t hsent;                     /* and when that was sent */
+    timer_ref_t hedge;                  /* timer to send the hedged query */
 
     TAILQ_ENTRY(dns_lookup) lp;
+    TAILQ_ENTRY(dns_lookup) elp;        /* entry on the cache expiry list */
 } dns_lookup_t;
 
 dns_lookup_t *dns_lookup(dns_class_t, dns_type_t, unsigned char *,
@@ -53,6 +65,8 @@ dns_lookup_t *dns_lookup(dns_class_t, dns_type_t, unsigned char *,
 void dns_lookup_cancel(hook_function_t);
 void dns_lookup_move(dns_lookup_t *, int, bool);
 void destroy_dns_lookup(dns_lookup_t *);
+dns_lookup_t *find_dns_lookup_id(uint16_t);
+int dns_lookup_cmp(void *, void *, size_t);
 
 const char *dns_lookup_pretty_rr(struct dns_rr *);
 
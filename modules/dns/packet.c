@@ -29,6 +29,7 @@ int dns_lookup_send(void) {
     dns_lookup_t *dlp;
     char pkt[DNS_MAX_PACKET_SIZE + DNS_MAX_NAMELEN];
     int nlen, plen;
+    int ns, delay;
 
     if (dns.pending.acount == dns.pending.max ||
             (dlp = TAILQ_FIRST(&dns.pending.wlist)) == NULL)
@@ -36,6 +37,15 @@ int dns_lookup_send(void) {
 
     /* first move it to the active list .. */
     dns_lookup_move(dlp, DNS_LOOKUP_FL_PENDING, false);
+    dlp->flags &= ~DNS_LOOKUP_FL_TCP;
+
+    /* and figure out who to ask.  if we have no nameservers at all (which
+     * can happen after a bad reload) there's nothing to do but fail. */
+    if ((ns = dns_nameserver_pick(-1, true)) == -1) {
+        dlp->flags |= DNS_LOOKUP_FL_FAILED;
+        dns_lookup_finish(dlp);
+        return 1;
+    }
 
     /* set up our header */
     memset(&hdr, 0, sizeof(hdr));
@@ -122,8 +132,10 @@ int dns_lookup_send(void) {
         return 1;
     }
 
-    /* and send the packet */
-    if ((nlen = socket_write(dns.sock, pkt, plen)) != plen) {
+    /* keep a copy for hedged queries and tcp, and send the packet */
+    memcpy(dlp->query, pkt, plen);
+    dlp->qlen = plen;
+    if ((nlen = socket_write(dns.servers[ns].sock, pkt, plen)) != plen) {
         /* this is silly.. let's try and dtrt here.  if the query didn't send
          * correctly then push it back on to the wait list and return 0. */
         dns_lookup_move(dlp, DNS_LOOKUP_FL_WAITING, true);
@@ -143,14 +155,54 @@ int dns_lookup_send(void) {
     assert(dlp->retry >= 0 && dlp->retry <= dns.pending.retries);
     dlp->timer = create_timer(0, dns.pending.retry_times[dlp->retry],
             dns_timer_hook, dlp);
+    dlp->ns = ns;
+    dlp->sent = timer_now();
+    dlp->hns = -1;
+
+    /* if the nameserver takes noticeably longer to answer than it usually
+     * does, ask another one too.  'noticeably' is the same margin TCP gives
+     * before a retransmit. */
+    if (dns.hedge && dns.nservers > 1) {
+        delay = dns.servers[ns].srtt + 4 * dns.servers[ns].rttvar;
+        if (delay < DNS_HEDGE_MIN)
+            delay = DNS_HEDGE_MIN;
+        if (delay < dns.pending.retry_times[dlp->retry] * 1000)
+            dlp->hedge = create_timer_ms(0, delay, dns_hedge_timer_hook,
+                    dlp);
+    }
 
     return 1; /* oookay */
 }
 
+/* this sends the hedged query for a lookup to the next best nameserver.  it
+ * goes out with the same id, and whichever reply comes back first is the
+ * one that is used. */
+HOOK_FUNCTION(dns_hedge_timer_hook) {
+    dns_lookup_t *dlp = (dns_lookup_t *)data;
+    int ns;
+
+    dlp->hedge = TIMER_INVALID;
+    if (!(dlp->flags & DNS_LOOKUP_FL_PENDING) ||
+            dlp->flags & DNS_LOOKUP_FL_TCP)
+        return NULL;
+    if ((ns = dns_nameserver_pick(dlp->ns, false)) == -1)
+        return NULL; /* nobody else healthy to ask */
+
+    if (socket_write(dns.servers[ns].sock, (char *)dlp->query, dlp->qlen) ==
+            dlp->qlen) {
+        dlp->hns = ns;
+        dlp->hsent = timer_now();
+    }
+
+    return NULL;
+}
+
 /* parse a packet returned from the server.  we assume the packet is complete
  * (so underlying routines will have to make sure that is the case) and do
- * (hopefully) careful checks on it before returning the result. */
-void dns_packet_parse(unsigned char *pkt, size_t plen) {
+ * (hopefully) careful checks on it before returning the result.  'ns' is
+ * the nameserver the packet came from over udp, or -1 for replies which
+ * came over tcp. */
+void dns_packet_parse(int ns, unsigned char *pkt, size_t plen) {
     struct dns_packet_header hdr;
     struct dns_query qry;
     int pidx = 0; /* index into the packet.  basically a count of how many
@@ -172,18 +224,13 @@ void dns_packet_parse(unsigned char *pkt, size_t plen) {
     hdr.nscount = ntohs(hdr.nscount);
     hdr.adcount = ntohs(hdr.adcount);
 
-    /* search for our lookup */
-    TAILQ_FOREACH(dlp, &dns.pending.alist, lp) {
-        if (dlp->id == hdr.id)
-            break;
-    }
-    /* try our waiting list too, sometimes replies will come late */
-    if (dlp == NULL) {
-        TAILQ_FOREACH(dlp, &dns.pending.wlist, lp) {
-            if (dlp->id == hdr.id && dlp->retry < dns.pending.retries)
-                break;
-        }
-    }
+    /* search for our lookup.  replies to lookups on the waiting list are
+     * accepted too (sometimes they come late), but only if the lookup was
+     * actually sent before. */
+    dlp = find_dns_lookup_id(hdr.id);
+    if (dlp != NULL && dlp->flags & DNS_LOOKUP_FL_WAITING &&
+            dlp->retry >= dns.pending.retries)
+        dlp = NULL;
     /* if we didn't find it send a debug notice (since we don't want to warn
      * and allow a DoS from people flooding in fake dns packets) and return */
     if (dlp == NULL) {
@@ -196,9 +243,32 @@ void dns_packet_parse(unsigned char *pkt, size_t plen) {
                 hdr.qdcount, hdr.qr, hdr.opcode);
         return;
     }
+    /* the nameserver answered, so note how long it took (if we can tell
+     * which query it was answering).  if the hedged query won, the first
+     * nameserver gets the blame for being slow, the same as if it had not
+     * answered at all. */
+    if (ns != -1 && ns == dlp->ns)
+        dns_nameserver_rtt(ns, timer_now() - dlp->sent);
+    else if (ns != -1 && ns == dlp->hns) {
+        dns_nameserver_rtt(ns, timer_now() - dlp->hsent);
+        dns_nameserver_failed(dlp->ns);
+        dlp->hns = -1;
+    }
+    /* once a lookup has gone over to tcp the answer comes from there.  a
+     * udp reply to the other of a hedged pair can still turn up late, and
+     * it must not finish the lookup while the tcp query is out. */
+    if (ns != -1 && dlp->flags & DNS_LOOKUP_FL_TCP) {
+        log_debug("ignoring udp dns reply for %s, waiting on tcp",
+                dlp->data);
+        return;
+    }
     if (hdr.tc) {
-        /* XXX: we should do TCP lookups in the case of truncated replies.
-         * will do that in the future.. */
+        /* the answer didn't fit, so ask the same nameserver again over
+         * tcp.  if that can't be done (or the tcp answer was truncated
+         * too, somehow), give up on the lookup. */
+        if (ns != -1 && dlp->flags & DNS_LOOKUP_FL_PENDING &&
+                dns_tcp_query(ns, dlp))
+            return;
         log_debug("got truncated dns reply for %s", dlp->data);
         dlp->flags |= DNS_LOOKUP_FL_FAILED;
         dns_lookup_finish(dlp);
@@ -509,12 +579,12 @@ void dns_lookup_finish(dns_lookup_t *dlp) {
         return;
     }
 
-    /* lastly, adjust the timer. */
-    if (dlp->timer == TIMER_INVALID)
-        /* hmm.. */
-        dlp->timer = create_timer(0, dlp->ttl, dns_timer_hook, dlp);
-    else
-        adjust_timer(dlp->timer, 0, dlp->ttl);
+    /* lastly, drop the retry timer.  expiry from the cache is handled by
+     * the expiry list from here on. */
+    if (dlp->timer != TIMER_INVALID) {
+        destroy_timer(dlp->timer);
+        dlp->timer = TIMER_INVALID;
+    }
 }
 
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */
@@ -0,0 +1,170 @@
+/*
+ * tcp.c: dns queries over tcp
+ * 
+ * Copyright 2003 the Ithildin Project.
+ * See the COPYING file for more information on licensing and use.
+ * 
+ * When an answer is too large for a udp packet the nameserver sends back as
+ * much as will fit and sets the 'truncated' flag.  The code here asks the
+ * same nameserver again over tcp, where each message is prefixed by its
+ * length in two bytes, and hands the answer off to dns_packet_parse().
+ */
+
+#include <ithildin/stand.h>
+
+#include "dns.h"
+#include "lookup.h"
+
+IDSTRING(rcsid, "$Id$");
+
+static void dns_tcp_error(struct dns_tcp_query *, const char *);
+HOOK_FUNCTION(dns_tcp_socket_hook);
+HOOK_FUNCTION(dns_tcp_timer_hook);
+
+/* start a query over tcp to nameserver 'ns' for the given (active) lookup.
+ * returns 1 if the query is on its way, 0 if it couldn't be sent. */
+int dns_tcp_query(int ns, dns_lookup_t *dlp) {
+    struct dns_tcp_query *dtp = calloc(1, sizeof(struct dns_tcp_query));
+
+    strlcpy(dtp->address, dns.servers[ns].address, FQDN_MAXLEN + 1);
+    dtp->id = dlp->id;
+    dtp->timer = TIMER_INVALID;
+    LIST_INSERT_HEAD(&dns.tcp, dtp, lp);
+
+    /* the query is the one we sent over udp, with its length in front */
+    dtp->buf = malloc(dlp->qlen + 2);
+    dtp->buf[0] = (dlp->qlen >> 8) & 0xff;
+    dtp->buf[1] = dlp->qlen & 0xff;
+    memcpy(dtp->buf + 2, dlp->query, dlp->qlen);
+    dtp->want = dlp->qlen + 2;
+
+    if ((dtp->sock = create_socket()) == NULL) {
+        log_error("couldn't create dns tcp socket");
+        destroy_dns_tcp_query(dtp);
+        return 0;
+    }
+    if (!set_socket_address(isock_laddr(dtp->sock), dns.bind, NULL,
+                SOCK_STREAM) || !open_socket(dtp->sock) ||
+            !socket_connect(dtp->sock, dtp->address, dns.port,
+                SOCK_STREAM)) {
+        log_debug("couldn't connect to nameserver %s/%s over tcp",
+                dtp->address, dns.port);
+        destroy_dns_tcp_query(dtp);
+        return 0;
+    }
+    dtp->sock->udata = dtp;
+    socket_monitor(dtp->sock, SOCKET_FL_READ | SOCKET_FL_WRITE);
+    add_hook(dtp->sock->datahook, dns_tcp_socket_hook);
+    dtp->timer = create_timer(0, dns.pending.timeout, dns_tcp_timer_hook,
+            dtp);
+
+    /* the lookup waits on this now, there's no sense in hedging it, and the
+     * udp retry timer must not go off either (the nameserver did answer,
+     * and a retry would send the query again).  the tcp query has its own
+     * timeout. */
+    dlp->flags |= DNS_LOOKUP_FL_TCP;
+    if (dlp->hedge != TIMER_INVALID) {
+        destroy_timer(dlp->hedge);
+        dlp->hedge = TIMER_INVALID;
+    }
+    if (dlp->timer != TIMER_INVALID) {
+        destroy_timer(dlp->timer);
+        dlp->timer = TIMER_INVALID;
+    }
+
+    return 1;
+}
+
+void destroy_dns_tcp_query(struct dns_tcp_query *dtp) {
+
+    if (dtp->timer != TIMER_INVALID)
+        destroy_timer(dtp->timer);
+    if (dtp->sock != NULL)
+        destroy_socket(dtp->sock);
+    LIST_REMOVE(dtp, lp);
+    free(dtp->buf);
+    free(dtp);
+}
+
+/* the query went wrong somehow.  if the lookup is still waiting on it, fail
+ * the lookup, just as it would have failed without tcp. */
+static void dns_tcp_error(struct dns_tcp_query *dtp, const char *why) {
+    dns_lookup_t *dlp = find_dns_lookup_id(dtp->id);
+
+    log_debug("dns query over tcp to %s failed: %s", dtp->address, why);
+    destroy_dns_tcp_query(dtp);
+    if (dlp != NULL && dlp->flags & DNS_LOOKUP_FL_PENDING &&
+            dlp->flags & DNS_LOOKUP_FL_TCP) {
+        dlp->flags |= DNS_LOOKUP_FL_FAILED;
+        dns_lookup_finish(dlp);
+    }
+}
+
+HOOK_FUNCTION(dns_tcp_socket_hook) {
+    isocket_t *sock = (isocket_t *)data;
+    struct dns_tcp_query *dtp = (struct dns_tcp_query *)sock->udata;
+    int len;
+
+    if (SOCKET_ERROR(sock)) {
+        dns_tcp_error(dtp, socket_strerror(sock));
+        return NULL;
+    }
+
+    /* send off the query first.  once that's done, 'buf' is used for the
+     * reply, which comes back with its length in front of it as well. */
+    if (!dtp->sent && SOCKET_WRITE(sock)) {
+        len = socket_write(sock, (char *)dtp->buf + dtp->len,
+                dtp->want - dtp->len);
+        if (len < 0) {
+            dns_tcp_error(dtp, socket_strerror(sock));
+            return NULL;
+        }
+        dtp->len += len;
+        if (dtp->len < dtp->want)
+            return NULL;
+
+        dtp->sent = true;
+        socket_unmonitor(sock, SOCKET_FL_WRITE);
+        dtp->buf = realloc(dtp->buf, 2);
+        dtp->len = 0;
+        dtp->want = 2;
+    }
+
+    if (dtp->sent && SOCKET_READ(sock)) {
+        while (dtp->len < dtp->want) {
+            len = socket_read(sock, (char *)dtp->buf + dtp->len,
+                    dtp->want - dtp->len);
+            if (len < 0) {
+                dns_tcp_error(dtp, socket_strerror(sock));
+                return NULL;
+            } else if (len == 0)
+                return NULL; /* wait for the rest */
+            dtp->len += len;
+
+            if (dtp->want == 2 && dtp->len == 2) {
+                /* now we know how long the reply is */
+                dtp->want += (dtp->buf[0] << 8) | dtp->buf[1];
+                if (dtp->want == 2) {
+                    dns_tcp_error(dtp, "empty reply");
+                    return NULL;
+                }
+                dtp->buf = realloc(dtp->buf, dtp->want);
+            }
+        }
+
+        dns_packet_parse(-1, dtp->buf + 2, dtp->want - 2);
+        destroy_dns_tcp_query(dtp);
+    }
+
+    return NULL;
+}
+
+HOOK_FUNCTION(dns_tcp_timer_hook) {
+    struct dns_tcp_query *dtp = (struct dns_tcp_query *)data;
+
+    dtp->timer = TIMER_INVALID;
+    dns_tcp_error(dtp, "timed out");
+    return NULL;
+}
+
+/* vi:set ts=8 sts=4 sw=4 tw=76 et: */
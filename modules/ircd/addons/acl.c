@@ -22,16 +22,32 @@ MODULE_REGISTER("$Rev: 830 $");
 
 struct acl_module_data acl;
 
-/* this is the entry we give to 'default' hashes of ACLs (if the ACL is an IP,
- * CIDR mask, or something else) */
-#define ACL_DEFAULT_HASH 0
+/* the index for a given stage */
+#define ACL_INDEX(stg)                                                        \
+    (&acl.index[((stg) == ACL_STAGE_CONNECT ? 0 :                             \
+                 ((stg) == ACL_STAGE_PREREG ? 1 : 2))])
 
 /* function prototypes */
 HOOK_FUNCTION(acl_timer_hook);
 HOOK_FUNCTION(acl_conf_hook);
-static uint32_t get_acl_hash(const char *);
+HOOK_FUNCTION(acl_client_hook);
+static void acl_index_add(acl_t *);
+static void acl_index_remove(acl_t *);
+static struct acl_list *acl_index_list(struct acl_index *, const char *,
+        bool);
+static int acl_candidates(int, const char *, const char *);
 XINFO_FUNC(xinfo_acl_handler);
 
+/* acls turned up by acl_candidates() */
+static acl_t **acl_cand = NULL;
+static int acl_ncand = 0;
+static int acl_candsize = 0;
+
+/* and clients turned up by acl_client_candidates() */
+static connection_t **acl_ccand = NULL;
+static int acl_nccand = 0;
+static int acl_ccandsize = 0;
+
 /* Create an ACL with the given data.  We will override ACLs that are
  * similar enough to ourself (same stage/host/access/rule#) unless they have
  * special parameter data (such as passwords or 'info line' bans) */
@@ -67,6 +83,9 @@ acl_t *create_acl(int stage, int acc, char *host, const char *type, int rule) {
         strlcpy(ap->user, hostcopy, ACL_USERLEN + 1);
         strlcpy(ap->host, at + 1, ACL_HOSTLEN + 1);
     }
+    if (*ap->user != '\0')
+        ap->userm = create_matcher(ap->user, MATCH_FL_HOST);
+    ap->hostm = create_matcher(ap->host, MATCH_FL_HOST | MATCH_FL_IP);
     ap->type = strdup(type);
     ap->cls = LIST_FIRST(ircd.lists.classes); /* point to the default class */
     ap->added = me.now;
@@ -77,10 +96,11 @@ acl_t *create_acl(int stage, int acc, char *host, const char *type, int rule) {
         ap->rule = acl.default_rule;
     else
         ap->rule = (short)rule;
-    ap->hash = get_acl_hash(ap->host);
+    ap->seq = ++acl.seq;
 
     /* insert into lists.. */
     LIST_INSERT_HEAD(acl.list, ap, lp);
+    acl_index_add(ap);
     if (ap->stage == ACL_STAGE_CONNECT)
         list = acl.stage1_list;
     else if (ap->stage == ACL_STAGE_PREREG)
@@ -105,49 +125,471 @@ acl_t *create_acl(int stage, int acc, char *host, const char *type, int rule) {
     return ap;
 }
 
-/* hash 20 characters of the host.  maybe we should do more?  maybe we should
- * just do the domain.tld? */
-#define ACL_HASHLEN 20
+/* if 'host' is an address or CIDR mask (the things ipmatch() takes) put
+ * the address in 'key' and its family in 'family' and return the number of
+ * significant bits.  otherwise return -1.  this is the same parsing
+ * ipmatch() does. */
+static int acl_ip_mask(const char *host, unsigned char *key, int *family) {
+    char addr[IPADDR_MAXLEN + 1];
+    char *mask;
+    int bits, alen;
+
+    strlcpy(addr, host, IPADDR_MAXLEN + 1);
+    if ((mask = strchr(host, '/')) != NULL) {
+        if (IPADDR_MAXLEN > mask - host)
+            addr[mask - host] = '\0';
+        mask++;
+    }
 
-/* this function takes a regular hostname and returns a pointer to a statically
- * allocated buffer which gives the host's hash-key for the purposes of the ACL
- * system. */
-static uint32_t get_acl_hash(const char *host) {
-    const char *s;
+    *family = get_address_type(addr);
+    if (*family != PF_INET && *family != PF_INET6)
+        return -1;
+    if (inet_pton(*family, addr, key) != 1)
+        return -1;
+
+    alen = (*family == PF_INET6 ? 128 : 32);
+    if (mask == NULL)
+        return alen;
+    bits = str_conv_int(mask, 0);
+    if (bits <= 0 || bits > alen)
+        bits = alen;
+    return bits;
+}
+
+/* the radix trie functions.  nodes hold acls for exactly their own mask, and
+ * 'glue' nodes with no acls are placed wherever two masks diverge. */
+#define ACL_RBIT(key, bit) (((key)[(bit) / 8] >> (7 - ((bit) % 8))) & 1)
+
+/* count how many leading bits (up to 'max') two keys have in common */
+static int acl_rnode_common(const unsigned char *one,
+        const unsigned char *two, int max) {
     int i = 0;
-    int dc = 0;
-    uint32_t hash = 0;
-
-    /* figure out what 'hv' in the structure should be */
-    s = host + strlen(host) - 1; /* point s at the last char */
-    while (s > host && i < ACL_HASHLEN) {
-        if (*s == '.') {
-            /* check for periods.  if we hit a second one, step forward one
-             * character and hash from there.  this means we always hash
-             * 'domain.tld' and not more (but maybe less for long domains) */
-            dc++;
-            if (dc > 1) {
-                s++; /* go forward again */
-                break;
+
+    while (i + 8 <= max && one[i / 8] == two[i / 8])
+        i += 8;
+    while (i < max && ACL_RBIT(one, i) == ACL_RBIT(two, i))
+        i++;
+    return i;
+}
+
+static struct acl_rnode *acl_rnode_create(const unsigned char *key,
+        int bits) {
+    struct acl_rnode *np = calloc(1, sizeof(struct acl_rnode));
+    int i;
+
+    memcpy(np->key, key, IPADDR_SIZE);
+    for (i = bits;i < IPADDR_SIZE * 8;i++)
+        np->key[i / 8] &= ~(0x80 >> (i % 8));
+    np->bits = bits;
+    LIST_INIT(&np->list);
+    LIST_INIT(&np->clients);
+    return np;
+}
+
+/* find the node for the given mask beneath '*rp', creating it (and any glue
+ * node it needs) if 'create' is set. */
+static struct acl_rnode *acl_rnode_get(struct acl_rnode **rp,
+        const unsigned char *key, int bits, bool create) {
+    struct acl_rnode *np, *gp;
+    int common;
+
+    while ((np = *rp) != NULL) {
+        common = acl_rnode_common(np->key, key,
+                (np->bits < bits ? np->bits : bits));
+        if (common < np->bits) {
+            /* the mask diverges from this node, or ends before it does.
+             * either way it goes in above this node. */
+            if (!create)
+                return NULL;
+            if (common == bits) {
+                gp = acl_rnode_create(key, bits);
+                gp->child[ACL_RBIT(np->key, bits)] = np;
+                *rp = gp;
+                return gp;
             }
+            gp = acl_rnode_create(key, common);
+            gp->child[ACL_RBIT(np->key, common)] = np;
+            *rp = gp;
+            rp = &gp->child[ACL_RBIT(key, common)];
+            break;
         }
-        s--;
-        i++;
+        if (np->bits == bits)
+            return np;
+        rp = &np->child[ACL_RBIT(key, np->bits)];
+    }
+
+    if (!create)
+        return NULL;
+    *rp = acl_rnode_create(key, bits);
+    return *rp;
+}
+
+/* walk down to the node for the given mask, and on the way back up remove
+ * any nodes that no longer hold acls and have fewer than two children. */
+static void acl_rnode_prune(struct acl_rnode **rp, const unsigned char *key,
+        int bits) {
+    struct acl_rnode *np = *rp;
+
+    if (np == NULL)
+        return;
+    if (np->bits < bits)
+        acl_rnode_prune(&np->child[ACL_RBIT(key, np->bits)], key, bits);
+
+    if (!LIST_EMPTY(&np->list) || !LIST_EMPTY(&np->clients) ||
+            (np->child[0] != NULL && np->child[1] != NULL))
+        return;
+    *rp = (np->child[0] != NULL ? np->child[0] : np->child[1]);
+    free(np);
+}
+
+static void acl_rnode_destroy(struct acl_rnode *np) {
+
+    if (np == NULL)
+        return;
+    acl_rnode_destroy(np->child[0]);
+    acl_rnode_destroy(np->child[1]);
+    free(np);
+}
+
+/* hostnames go in the 'hosts' table as they are, '*.domain' masks go in the
+ * 'domains' table keyed on '.domain'.  this returns the table a host belongs
+ * in (and sets 'key'), or NULL if it belongs on the 'other' list. */
+static hashtable_t *acl_index_table(struct acl_index *idx, const char *host,
+        const char **key) {
+
+    *key = host;
+    if (istr_okay(ircd.maps.host, host))
+        return idx->hosts;
+    if (host[0] == '*' && host[1] == '.' &&
+            istr_okay(ircd.maps.host, host + 1)) {
+        *key = host + 1;
+        return idx->domains;
+    }
+    return NULL;
+}
+
+/* find the index list an acl with the given host belongs on.  if 'create' is
+ * set the list is made if necessary, otherwise NULL is returned if it does
+ * not exist. */
+static struct acl_list *acl_index_list(struct acl_index *idx,
+        const char *host, bool create) {
+    unsigned char addr[IPADDR_SIZE];
+    struct acl_rnode *np;
+    struct acl_bucket *bp;
+    hashtable_t *table;
+    const char *key;
+    int bits, family;
+
+    if ((bits = acl_ip_mask(host, addr, &family)) != -1) {
+        np = acl_rnode_get((family == PF_INET ? &idx->ip4 : &idx->ip6),
+                addr, bits, create);
+        return (np != NULL ? &np->list : NULL);
+    }
+
+    if ((table = acl_index_table(idx, host, &key)) == NULL)
+        return &idx->other;
+    if ((bp = hash_find(table, (void *)key)) == NULL && create) {
+        bp = calloc(1, sizeof(struct acl_bucket));
+        strlcpy(bp->key, key, ACL_HOSTLEN + 1);
+        LIST_INIT(&bp->list);
+        hash_insert(table, bp);
     }
+    return (bp != NULL ? &bp->list : NULL);
+}
+
+static void acl_index_add(acl_t *ap) {
+
+    LIST_INSERT_HEAD(acl_index_list(ACL_INDEX(ap->stage), ap->host, true),
+            ap, idxlp);
+}
+
+static void acl_index_remove(acl_t *ap) {
+    struct acl_index *idx = ACL_INDEX(ap->stage);
+    unsigned char addr[IPADDR_SIZE];
+    struct acl_bucket *bp;
+    hashtable_t *table;
+    const char *key;
+    int bits, family;
+
+    LIST_REMOVE(ap, idxlp);
+
+    /* clean up after ourselves if that was the last acl for the mask */
+    if ((bits = acl_ip_mask(ap->host, addr, &family)) != -1)
+        acl_rnode_prune((family == PF_INET ? &idx->ip4 : &idx->ip6), addr,
+                bits);
+    else if ((table = acl_index_table(idx, ap->host, &key)) != NULL &&
+            (bp = hash_find(table, (void *)key)) != NULL &&
+            LIST_EMPTY(&bp->list)) {
+        hash_delete(table, bp);
+        free(bp);
+    }
+}
+
+static void acl_add_candidates(struct acl_list *list) {
+    acl_t *ap;
 
-    /* now s is the entry to hash */
-    if (strlen(s) < 5 || !istr_okay(ircd.maps.host, s)) {
-        /* if s is shorter than five bytes, or if it contains an invalid
-         * character (something like *, @, /, whatever) we give up on hashing
-         * it. */
-        return ACL_DEFAULT_HASH;
+    LIST_FOREACH(ap, list, idxlp) {
+        if (acl_ncand == acl_candsize) {
+            acl_candsize = (acl_candsize ? acl_candsize * 2 : 64);
+            acl_cand = realloc(acl_cand, sizeof(acl_t *) * acl_candsize);
+        }
+        acl_cand[acl_ncand++] = ap;
     }
+}
 
-    /* now hash it */
-    while (*s != '\0')
-        hash = hash * 33 + tolower(*s++);
+/* add the acls from the index which might match 's' (a hostname or an
+ * address) to the candidates. */
+static void acl_index_match(struct acl_index *idx, const char *s) {
+    unsigned char addr[IPADDR_SIZE];
+    struct acl_rnode *np = NULL;
+    struct acl_bucket *bp;
+    const char *dot;
+    int alen = 0;
+
+    /* addresses are looked for in the trie.  every node on the way down
+     * to the address is a mask which contains it. */
+    if (inet_pton(PF_INET, s, addr) == 1) {
+        np = idx->ip4;
+        alen = 32;
+    }
+#ifdef INET6
+    else if (strchr(s, ':') != NULL && inet_pton(PF_INET6, s, addr) == 1) {
+        np = idx->ip6;
+        alen = 128;
+    }
+#endif
+    while (np != NULL && acl_rnode_common(np->key, addr, np->bits) ==
+            np->bits) {
+        acl_add_candidates(&np->list);
+        if (np->bits >= alen)
+            break;
+        np = np->child[ACL_RBIT(addr, np->bits)];
+    }
 
-    return hash + (hash >> 5);
+    /* and anything at all might be a hostname, and in any of the domains
+     * above it. */
+    if ((bp = hash_find(idx->hosts, (void *)s)) != NULL)
+        acl_add_candidates(&bp->list);
+    for (dot = strchr(s, '.');dot != NULL;dot = strchr(dot + 1, '.')) {
+        if ((bp = hash_find(idx->domains, (void *)dot)) != NULL)
+            acl_add_candidates(&bp->list);
+    }
+}
+
+/* acls are checked by rule number, and in the order they were added for
+ * acls with the same rule number. */
+static int acl_cand_cmp(const void *one, const void *two) {
+    const acl_t *ap1 = *(acl_t *const *)one;
+    const acl_t *ap2 = *(acl_t *const *)two;
+
+    if (ap1->rule != ap2->rule)
+        return (ap1->rule < ap2->rule ? -1 : 1);
+    if (ap1->seq != ap2->seq)
+        return (ap1->seq < ap2->seq ? -1 : 1);
+    return 0;
+}
+
+/* gather up the acls in 'stage' which might match a connection with the
+ * given host and address ('ip' may be NULL).  they are placed in acl_cand in
+ * the order they should be checked, and the count is returned. */
+static int acl_candidates(int stage, const char *host, const char *ip) {
+    struct acl_index *idx = ACL_INDEX(stage);
+    int i, j;
+
+    acl_ncand = 0;
+    acl_index_match(idx, host);
+    if (ip != NULL && strcasecmp(host, ip))
+        acl_index_match(idx, ip);
+    acl_add_candidates(&idx->other);
+
+    if (acl_ncand > 1) {
+        qsort(acl_cand, acl_ncand, sizeof(acl_t *), acl_cand_cmp);
+        /* the same acl can be found through both the host and the
+         * address, weed those out. */
+        for (i = j = 1;i < acl_ncand;i++) {
+            if (acl_cand[i] != acl_cand[j - 1])
+                acl_cand[j++] = acl_cand[i];
+        }
+        acl_ncand = j;
+    }
+
+    return acl_ncand;
+}
+
+/* find the node for 'host' in the client host tree, creating it (and the
+ * nodes for the domains it is in) if 'create' is set. */
+static struct acl_hnode *acl_hnode_get(const char *host, bool create) {
+    struct acl_hnode *np;
+    const char *dot;
+
+    if ((np = hash_find(acl.clients.hosts, (void *)host)) != NULL ||
+            !create)
+        return np;
+
+    np = calloc(1, sizeof(struct acl_hnode));
+    strlcpy(np->key, host, ACL_HOSTLEN + 1);
+    LIST_INIT(&np->children);
+    LIST_INIT(&np->clients);
+    hash_insert(acl.clients.hosts, np);
+    if ((dot = strchr(host, '.')) != NULL && dot[1] != '\0') {
+        np->parent = acl_hnode_get(dot + 1, true);
+        LIST_INSERT_HEAD(&np->parent->children, np, lp);
+    }
+    return np;
+}
+
+/* add a local client to the client index */
+static void acl_client_add(connection_t *cp) {
+    struct acl_client *acp = calloc(1, sizeof(struct acl_client));
+    char ip[IPADDR_MAXLEN + 1];
+    struct acl_rnode *np;
+
+    acp->conn = cp;
+    *(struct acl_client **)mdext(cp->cli, acl.clients.mdext) = acp;
+
+    get_socket_address(isock_raddr(cp->sock), ip, IPADDR_MAXLEN + 1, NULL);
+    if (inet_pton(PF_INET, ip, acp->addr) == 1) {
+        acp->family = PF_INET;
+        np = acl_rnode_get(&acl.clients.ip4, acp->addr, 32, true);
+        LIST_INSERT_HEAD(&np->clients, acp, alp);
+    }
+#ifdef INET6
+    else if (inet_pton(PF_INET6, ip, acp->addr) == 1) {
+        acp->family = PF_INET6;
+        np = acl_rnode_get(&acl.clients.ip6, acp->addr, 128, true);
+        LIST_INSERT_HEAD(&np->clients, acp, alp);
+    }
+#endif
+
+    if (istr_okay(ircd.maps.host, cp->host)) {
+        acp->host = acl_hnode_get(cp->host, true);
+        LIST_INSERT_HEAD(&acp->host->clients, acp, hlp);
+    }
+}
+
+/* and remove one, cleaning up any nodes which are no longer needed */
+static void acl_client_remove(connection_t *cp) {
+    struct acl_client **acpp =
+        (struct acl_client **)mdext(cp->cli, acl.clients.mdext);
+    struct acl_client *acp = *acpp;
+    struct acl_hnode *np, *parent;
+
+    if (acp == NULL)
+        return;
+    *acpp = NULL;
+
+    if (acp->family == PF_INET) {
+        LIST_REMOVE(acp, alp);
+        acl_rnode_prune(&acl.clients.ip4, acp->addr, 32);
+    } else if (acp->family == PF_INET6) {
+        LIST_REMOVE(acp, alp);
+        acl_rnode_prune(&acl.clients.ip6, acp->addr, 128);
+    }
+
+    if ((np = acp->host) != NULL) {
+        LIST_REMOVE(acp, hlp);
+        while (np != NULL && LIST_EMPTY(&np->clients) &&
+                LIST_EMPTY(&np->children)) {
+            parent = np->parent;
+            if (parent != NULL)
+                LIST_REMOVE(np, lp);
+            hash_delete(acl.clients.hosts, np);
+            free(np);
+            np = parent;
+        }
+    }
+
+    free(acp);
+}
+
+static void acl_add_client_candidate(connection_t *cp) {
+
+    if (acl_nccand == acl_ccandsize) {
+        acl_ccandsize = (acl_ccandsize ? acl_ccandsize * 2 : 64);
+        acl_ccand = realloc(acl_ccand, sizeof(connection_t *) *
+                acl_ccandsize);
+    }
+    acl_ccand[acl_nccand++] = cp;
+}
+
+/* add every client at or beneath the given address node */
+static void acl_rnode_clients(struct acl_rnode *np) {
+    struct acl_client *acp;
+
+    if (np == NULL)
+        return;
+    LIST_FOREACH(acp, &np->clients, alp)
+        acl_add_client_candidate(acp->conn);
+    acl_rnode_clients(np->child[0]);
+    acl_rnode_clients(np->child[1]);
+}
+
+/* add every client with a host in the domain of the given host node (but not
+ * the ones with the host itself) */
+static void acl_hnode_clients(struct acl_hnode *np) {
+    struct acl_hnode *cnp;
+    struct acl_client *acp;
+
+    LIST_FOREACH(cnp, &np->children, lp) {
+        LIST_FOREACH(acp, &cnp->clients, hlp)
+            acl_add_client_candidate(acp->conn);
+        acl_hnode_clients(cnp);
+    }
+}
+
+/* gather up the local clients which 'ap' could match into acl_ccand and
+ * return the count.  if the acl's host could match anything, return -1, in
+ * which case every client must be checked. */
+static int acl_client_candidates(const acl_t *ap) {
+    unsigned char addr[IPADDR_SIZE];
+    struct acl_rnode *np;
+    struct acl_hnode *hnp;
+    struct acl_client *acp;
+    const char *s;
+    int bits, family;
+
+    acl_nccand = 0;
+    if ((bits = acl_ip_mask(ap->host, addr, &family)) != -1) {
+        /* find the node for the mask (or the first one beneath it), all
+         * the clients from there on down are in the mask. */
+        np = (family == PF_INET ? acl.clients.ip4 : acl.clients.ip6);
+        while (np != NULL && np->bits < bits) {
+            if (acl_rnode_common(np->key, addr, np->bits) < np->bits)
+                return 0;
+            np = np->child[ACL_RBIT(addr, np->bits)];
+        }
+        if (np != NULL && acl_rnode_common(np->key, addr, bits) == bits)
+            acl_rnode_clients(np);
+        return acl_nccand;
+    }
+
+    if (istr_okay(ircd.maps.host, ap->host)) {
+        /* an exact hostname. */
+        if ((hnp = acl_hnode_get(ap->host, false)) != NULL) {
+            LIST_FOREACH(acp, &hnp->clients, hlp)
+                acl_add_client_candidate(acp->conn);
+        }
+        return acl_nccand;
+    }
+
+    if (ap->host[0] == '*' && ap->host[1] == '.' &&
+            istr_okay(ircd.maps.host, ap->host + 2)) {
+        /* a '*.domain' mask.  these can match the address (as a string)
+         * as well as the host.  the address is only indexed as a host if
+         * the client has no hostname, so if the domain could be the end of
+         * an address everyone has to be checked. */
+        for (s = ap->host + 2;*s != '\0';s++) {
+            if (*s != '.' && !isdigit((unsigned char)*s))
+                break;
+        }
+        if (*s == '\0')
+            return -1;
+        if ((hnp = acl_hnode_get(ap->host + 2, false)) != NULL)
+            acl_hnode_clients(hnp);
+        return acl_nccand;
+    }
+
+    return -1;
 }
 
 /* this function finds an ACL based on stage/host/type, and possibly based on
@@ -157,9 +599,8 @@ acl_t *find_acl(int stage, int acc, char *hostmask, const char *type,
     struct acl_list *list;
     char *at, hostcopy[ACL_USERLEN + ACL_HOSTLEN + 2], user[ACL_USERLEN + 1];
     char host[ACL_HOSTLEN + 1];
-    acl_t *ap;
+    acl_t *ap, *found = NULL;
 
-    
     /* extract user@host data */
     strlcpy(hostcopy, hostmask, ACL_USERLEN + ACL_HOSTLEN + 2);
     at = strchr(hostcopy, '@');
@@ -175,15 +616,12 @@ acl_t *find_acl(int stage, int acc, char *hostmask, const char *type,
     if (rule == ACL_DEFAULT_RULE)
         rule = acl.default_rule;
 
-    if (stage == ACL_STAGE_CONNECT)
-        list = acl.stage1_list;
-    else if (stage == ACL_STAGE_PREREG)
-        list = acl.stage2_list;
-    else
-        list = acl.stage3_list;
-
-    /* now try and find them in the bucket. */
-    LIST_FOREACH(ap, list, intlp) {
+    /* every acl with this host is on the same index list, so only that list
+     * needs looking through.  it isn't kept in any particular order, so
+     * find the first match as it would be in the stage list. */
+    if ((list = acl_index_list(ACL_INDEX(stage), host, false)) == NULL)
+        return NULL;
+    LIST_FOREACH(ap, list, idxlp) {
         if (acc != ACL_ACCESS_ANY && ap->access != acc)
             continue;
         if (rule != ACL_ANY_RULE && ap->rule != rule)
@@ -192,11 +630,12 @@ acl_t *find_acl(int stage, int acc, char *hostmask, const char *type,
         if (!strcasecmp(ap->user, user) && !strcasecmp(ap->host, host) &&
                 !strcasecmp(ap->type, type) &&
                 (pass == NULL || !strcmp(ap->pass, pass)) &&
-                (info == NULL || !strcmp(ap->info, info)))
-            return ap;
+                (info == NULL || !strcmp(ap->info, info)) &&
+                (found == NULL || acl_cand_cmp(&ap, &found) < 0))
+            found = ap;
     }
 
-    return NULL;
+    return found;
 }
 
 /* remove an ACL from the requisite lists and release its memory */
@@ -207,6 +646,7 @@ void destroy_acl(acl_t *ap) {
 
     /* remove it from the big list */
     LIST_REMOVE(ap, lp);
+    acl_index_remove(ap);
     
     /* and remove it from whatever list it's in */
     if (ap->stage == ACL_STAGE_CONNECT)
@@ -229,6 +669,8 @@ void destroy_acl(acl_t *ap) {
         free(ap->redirect);
     if (ap->timer != TIMER_INVALID)
         destroy_timer(ap->timer);
+    destroy_matcher(ap->userm);
+    destroy_matcher(ap->hostm);
     free(ap);
 
     return;
@@ -252,6 +694,7 @@ void acl_force_check(int stage, const acl_t *ap, const char *by, bool
         msg_always) {
     int nukes = 0;
     int checks = 0;
+    int i, n;
     connection_t *cp, *cp2;
     void *ret;
 
@@ -280,15 +723,24 @@ void acl_force_check(int stage, const acl_t *ap, const char *by, bool
         }
     }
     if (stage == 0 || stage == ACL_STAGE_REGISTER) {
-        cp = LIST_FIRST(ircd.connections.clients);
-        while (cp != NULL) {
-            cp2 = LIST_NEXT(cp, lp);
+        /* registered clients can be found through the client index, and
+         * only the ones the acl could match need to be checked.  this is
+         * what keeps a burst of bans from costing clients x bans worth of
+         * matching.  the candidates are gathered up first, since checking
+         * them may remove clients from the index. */
+        if ((n = acl_client_candidates(ap)) == -1) {
+            acl_nccand = 0;
+            LIST_FOREACH(cp, ircd.connections.clients, lp)
+                acl_add_client_candidate(cp);
+            n = acl_nccand;
+        }
+        for (i = 0;i < n;i++) {
+            cp = acl_ccand[i];
             if ((ret = acl_stage3_hook(NULL, (void *)cp)) != NULL) {
                 destroy_connection(cp, ret);
                 nukes++;
             }
             checks++;
-            cp = cp2;
         }
     }
 
@@ -309,21 +761,18 @@ void acl_force_check(int stage, const acl_t *ap, const char *by, bool
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */
 /* handling for stage one is by far the easiest, there are no classes or
  * passwords involved.  also, stuff in stage1 should always be in a single
- * place.  we create a hashtable, but it's mostly just a glorified list (for
- * now, anyways) */
+ * place.  only the acls the index turns up for the host are checked. */
 HOOK_FUNCTION(acl_stage1_hook) {
-    acl_t *ap;
+    acl_t *ap = NULL;
     connection_t *cp = (connection_t  *)data;
-    uint32_t hash = get_acl_hash(cp->host);
-
-    /* now match.  skip over any entries that aren't the default hash or our
-     * hash. */
-    LIST_FOREACH(ap, acl.stage1_list, intlp) {
-        if (ap->hash != hash && ap->hash != ACL_DEFAULT_HASH)
-            continue;
-
-        if (ipmatch(ap->host, cp->host) ||
-                hostmatch(ap->host, cp->host)) {
+    int i, n;
+
+    /* now match. */
+    n = acl_candidates(ACL_STAGE_CONNECT, cp->host, NULL);
+    for (i = 0;i < n;i++) {
+        ap = acl_cand[i];
+        if (matcher_ipmatch(ap->hostm, cp->host) ||
+                matcher_match(ap->hostm, cp->host)) {
             if (ap->access == ACL_DENY)
                 return (ap->reason != NULL ? ap->reason : "");
             else
@@ -331,7 +780,7 @@ HOOK_FUNCTION(acl_stage1_hook) {
         }
     }
 
-    if (ap != NULL) {
+    if (i < n) {
         if (ap->flags & ACL_FL_SKIP_DNS)
             cp->flags |= IRCD_CONNFL_DNS;
         if (ap->flags & ACL_FL_SKIP_IDENT)
@@ -346,25 +795,21 @@ HOOK_FUNCTION(acl_stage1_hook) {
 HOOK_FUNCTION(acl_stage2_hook) {
     acl_t *ap;
     connection_t  *cp = (connection_t  *)data;
-    uint32_t hash, iphash;
     char ip[ACL_HOSTLEN + 1];
+    int i, n;
 
     get_socket_address(isock_raddr(cp->sock), ip, ACL_HOSTLEN + 1, NULL);
 
-    hash = get_acl_hash(cp->host);
-    iphash = get_acl_hash(ip);
-
     /* this is more complicated now.  we must check the username, the hostname,
      * and the ip (using hostmatch and ipmatch).  All together that is four
-     * calls.  Also, our hash space is expanded. */
-    LIST_FOREACH(ap, acl.stage2_list, intlp) {
-        if (ap->hash != hash && ap->hash != iphash &&
-                ap->hash != ACL_DEFAULT_HASH)
-            continue; /* skip .. */
-
-        if ((*ap->user ? hostmatch(ap->user, cp->user) : 1)) {
-            if (hostmatch(ap->host, cp->host) ||
-                    hostmatch(ap->host, ip) || ipmatch(ap->host, ip)) {
+     * calls.  Also, the index is searched for both the host and the ip. */
+    n = acl_candidates(ACL_STAGE_PREREG, cp->host, ip);
+    for (i = 0;i < n;i++) {
+        ap = acl_cand[i];
+        if ((ap->userm != NULL ? matcher_match(ap->userm, cp->user) : 1)) {
+            if (matcher_match(ap->hostm, cp->host) ||
+                    matcher_match(ap->hostm, ip) ||
+                    matcher_ipmatch(ap->hostm, ip)) {
                 /* okay, it actually matches. */
                 if (ap->access == ACL_DENY)
                     return (ap->reason != NULL ? ap->reason : "");
@@ -390,33 +835,31 @@ HOOK_FUNCTION(acl_stage2_hook) {
 HOOK_FUNCTION(acl_stage3_hook) {
     acl_t *ap;
     connection_t  *cp = (connection_t  *)data;
-    uint32_t hash, iphash;
     char ip[ACL_HOSTLEN + 1];
     void *ret = NULL;
+    int i, n;
 
     get_socket_address(isock_raddr(cp->sock), ip, ACL_HOSTLEN + 1, NULL);
 
-    hash = get_acl_hash(cp->host);
-    iphash = get_acl_hash(ip);
-
     /* this is the most complicated search.  we need to check for passwords,
      * info/gecos, and user/host/ip.  also, in the case of 'allows', if they
      * aren't allowed because of a class being full we actually have to keep on
      * looking to see if they fit in somewhere else. blechhh. */
-    LIST_FOREACH(ap, acl.stage3_list, intlp) {
-        if (ap->hash != hash && ap->hash != iphash &&
-                ap->hash != ACL_DEFAULT_HASH)
-            continue; /* don't bother.. */
-        
+    n = acl_candidates(ACL_STAGE_REGISTER, cp->host, ip);
+    for (i = 0;i < n;i++) {
+        ap = acl_cand[i];
+
         /* check password/info first, since they're cheaper than all the
          * match calls (I guess */
         if (ap->pass != NULL && cp->pass != NULL && strcmp(ap->pass, cp->pass))
             continue; /* password incorrect */
         if (ap->info != NULL && !match(ap->info, cp->cli->info))
             continue; /* info doesn't match */
-        if ((*ap->user ? hostmatch(ap->user, cp->cli->user) : 1)) {
-            if (hostmatch(ap->host, cp->host) ||
-                hostmatch(ap->host, ip) || ipmatch(ap->host, ip)) {
+        if ((ap->userm != NULL ?
+                    matcher_match(ap->userm, cp->cli->user) : 1)) {
+            if (matcher_match(ap->hostm, cp->host) ||
+                    matcher_match(ap->hostm, ip) ||
+                    matcher_ipmatch(ap->hostm, ip)) {
                 /* okay, it actually matches. */
                 if (ap->access == ACL_DENY) {
                     /* Is this a redirect?  Maybe so, let's send them the
@@ -464,6 +907,20 @@ HOOK_FUNCTION(acl_timer_hook) {
     return NULL;
 }
 
+/* keep the client index up to date as local clients come and go */
+HOOK_FUNCTION(acl_client_hook) {
+    client_t *cli = (client_t *)data;
+
+    if (cli->conn == NULL)
+        return NULL;
+    if (ep == ircd.events.client_connect)
+        acl_client_add(cli->conn);
+    else
+        acl_client_remove(cli->conn);
+
+    return NULL;
+}
+
 /* These two are the defaults for runtime and configured rule numbers,
  * respectively. */
 #define ACLCONF_DEFAULT_RULE 1000
@@ -739,6 +1196,8 @@ XINFO_FUNC(xinfo_acl_handler) {
 }
 
 MODULE_LOADER(acl) {
+    connection_t *cp;
+    int i;
 
     memset(&acl, 0, sizeof(acl));
 
@@ -746,6 +1205,23 @@ MODULE_LOADER(acl) {
     LIST_ALLOC(acl.stage1_list);
     LIST_ALLOC(acl.stage2_list);
     LIST_ALLOC(acl.stage3_list);
+    for (i = 0;i < 3;i++) {
+        acl.index[i].hosts = create_hash_table(128,
+                offsetof(struct acl_bucket, key), ACL_HOSTLEN,
+                HASH_FL_NOCASE | HASH_FL_STRING, "strncasecmp");
+        acl.index[i].domains = create_hash_table(128,
+                offsetof(struct acl_bucket, key), ACL_HOSTLEN,
+                HASH_FL_NOCASE | HASH_FL_STRING, "strncasecmp");
+        LIST_INIT(&acl.index[i].other);
+    }
+    acl.clients.hosts = create_hash_table(1024,
+            offsetof(struct acl_hnode, key), ACL_HOSTLEN,
+            HASH_FL_NOCASE | HASH_FL_STRING, "strncasecmp");
+    acl.clients.mdext = create_mdext_item(ircd.mdext.client,
+            sizeof(struct acl_client *));
+    /* index any clients who are already here */
+    LIST_FOREACH(cp, ircd.connections.clients, lp)
+        acl_client_add(cp);
 
     add_xinfo_handler(xinfo_acl_handler, "ACL", XINFO_HANDLER_OPER, 
             "Provides information about the server Access Control List");
@@ -755,15 +1231,36 @@ MODULE_LOADER(acl) {
     add_hook(ircd.events.stage2_connect, acl_stage2_hook);
     add_hook(ircd.events.stage3_connect, acl_stage3_hook);
     add_hook(me.events.read_conf, acl_conf_hook);
+    add_hook(ircd.events.client_connect, acl_client_hook);
+    add_hook(ircd.events.client_disconnect, acl_client_hook);
 
         acl_conf_hook(NULL, NULL);
 
     return 1;
 }
 MODULE_UNLOADER(acl) {
+    connection_t *cp;
+    int i;
 
     while (!LIST_EMPTY(acl.list))
         destroy_acl(LIST_FIRST(acl.list));
+    /* the index should be empty now, but just in case.. */
+    for (i = 0;i < 3;i++) {
+        acl_rnode_destroy(acl.index[i].ip4);
+        acl_rnode_destroy(acl.index[i].ip6);
+        destroy_hash_table(acl.index[i].hosts);
+        destroy_hash_table(acl.index[i].domains);
+    }
+    free(acl_cand);
+    acl_cand = NULL;
+    acl_candsize = 0;
+    LIST_FOREACH(cp, ircd.connections.clients, lp)
+        acl_client_remove(cp);
+    destroy_hash_table(acl.clients.hosts);
+    destroy_mdext_item(ircd.mdext.client, acl.clients.mdext);
+    free(acl_ccand);
+    acl_ccand = NULL;
+    acl_ccandsize = 0;
     LIST_FREE(acl.list);
     LIST_FREE(acl.stage1_list);
     LIST_FREE(acl.stage2_list);
@@ -775,6 +1272,8 @@ MODULE_UNLOADER(acl) {
     remove_hook(ircd.events.stage2_connect, acl_stage2_hook);
     remove_hook(ircd.events.stage3_connect, acl_stage3_hook);
     remove_hook(me.events.read_conf, acl_conf_hook);
+    remove_hook(ircd.events.client_connect, acl_client_hook);
+    remove_hook(ircd.events.client_disconnect, acl_client_hook);
 }
 
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */
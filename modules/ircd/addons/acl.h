@@ -21,7 +21,9 @@ typedef struct acl {
     int     access;
 
     unsigned short rule;            /* rule number of the acl */
-    uint32_t hash;                  /* hash of the acl */
+    uint32_t seq;                   /* order the acl was added in.  acls with
+                                       the same rule number are checked in
+                                       this order */
 
 #define ACL_USERLEN (USERLEN * 2)
 #define ACL_HOSTLEN HOSTLEN
@@ -30,6 +32,8 @@ typedef struct acl {
                                        placed in (optional) */
     char    user[ACL_USERLEN + 1];      /* username to match against (optional) */
     char    host[ACL_HOSTLEN + 1];      /* hostname/mask to match against */
+    matcher_t *userm;               /* compiled forms of the above (userm is */
+    matcher_t *hostm;               /* NULL if there is no username) */
     char    *reason;                /* ban reason */
     char    *info;                  /* "info" line to match against (stage 3
                                        only) */
@@ -52,16 +56,78 @@ typedef struct acl {
 
     LIST_ENTRY(acl) intlp;          /* list pointers.  intlp is for internal
                                        (stage-segregated) lists */
+    LIST_ENTRY(acl) idxlp;          /* idxlp is for the stage's index */
     LIST_ENTRY(acl) lp;             /* lp is for the 'big list'. */
 } acl_t;
 
 LIST_HEAD(acl_list, acl);
 
+/* each stage's acls are also indexed by their host, so that a connection is
+ * only checked against the acls that could possibly match it.  addresses and
+ * CIDR masks go in a radix trie (one for each address family), hostnames
+ * and '*.domain' masks go in hash tables, and whatever is left (masks with
+ * wildcards anywhere else) goes on a list which is always checked. */
+LIST_HEAD(acl_client_list, acl_client);
+struct acl_rnode {
+    unsigned char key[IPADDR_SIZE]; /* address (zeroed past 'bits') */
+    int     bits;                   /* number of significant bits */
+    struct acl_rnode *child[2];     /* children, by the bit after 'bits' */
+    struct acl_list list;           /* acls for exactly this mask */
+    struct acl_client_list clients; /* or, in the client index, clients
+                                       with exactly this address */
+};
+
+struct acl_bucket {
+    char    key[ACL_HOSTLEN + 1];   /* a hostname, or '.domain' */
+    struct acl_list list;           /* acls for this host or domain */
+};
+
+struct acl_index {
+    struct acl_rnode *ip4;          /* IPv4 addresses and masks */
+    struct acl_rnode *ip6;          /* IPv6 addresses and masks */
+    hashtable_t *hosts;             /* plain hostnames */
+    hashtable_t *domains;           /* '*.domain' masks, keyed on '.domain' */
+    struct acl_list other;          /* everything else */
+};
+
+/* local clients are indexed by their address and hostname as well, so that
+ * when an acl is added only the clients it could match are checked against
+ * it.  addresses go in radix tries like the ones above.  hostnames are kept
+ * in a tree of their labels ('a.b.c' is beneath 'b.c', which is beneath
+ * 'c'), so a '*.domain' mask need only look beneath 'domain'. */
+struct acl_hnode {
+    char    key[ACL_HOSTLEN + 1];   /* the host (or the domain) */
+    struct acl_hnode *parent;       /* the domain this is in */
+    LIST_HEAD(, acl_hnode) children; /* the hosts/domains in this one */
+    struct acl_client_list clients; /* clients with exactly this host */
+
+    LIST_ENTRY(acl_hnode) lp;
+};
+
+struct acl_client {
+    connection_t *conn;
+    int     family;                 /* family of 'addr', 0 if not indexed */
+    unsigned char addr[IPADDR_SIZE];
+    struct acl_hnode *host;         /* host node, NULL if not indexed */
+
+    LIST_ENTRY(acl_client) alp;     /* entry in the address node */
+    LIST_ENTRY(acl_client) hlp;     /* entry in the host node */
+};
+
 extern struct acl_module_data {
     struct acl_list *stage1_list;
     struct acl_list *stage2_list;
     struct acl_list *stage3_list;
     struct acl_list *list;
+    struct acl_index index[3];      /* indexes for each stage */
+    uint32_t seq;                   /* counter for acl_t.seq */
+
+    struct {
+        struct acl_rnode *ip4;      /* local clients by address */
+        struct acl_rnode *ip6;
+        hashtable_t *hosts;         /* and by host (acl_hnode) */
+        struct mdext_item *mdext;   /* each client's acl_client */
+    } clients;
 
     unsigned short default_rule;
 } acl;
@@ -38,13 +38,21 @@ MODULE_REGISTER("$Rev: 701 $");
 struct core_addon_struct core;
 
 /* channel mode handlers */
-static int check_bans(const struct channel_ban_list *, const char *,
+static const char *ban_orighost(const char *, const char *);
+static bool ban_match(const struct channel_ban *, const char *, const char *,
+        const char *, const char *, const char *);
+static bool ban_match_client(const struct channel_ban *, client_t *);
+static unsigned int ban_bucket(const char *);
+static void ban_index_add(struct channel_bans *, struct channel_ban *);
+static int check_bans(const struct channel_bans *, const char *,
         const char *, const char *, const char *, const char *);
+static void destroy_ban(struct channel_ban *);
 CHANMODE_FUNC(chanmode_ban);
 CHANMODE_QUERY_FUNC(chanmode_ban_query);
 HOOK_FUNCTION(can_join_mode_b);
 HOOK_FUNCTION(can_send_mode_b);
 HOOK_FUNCTION(can_nick_mode_b);
+HOOK_FUNCTION(ban_host_hook);
 
 HOOK_FUNCTION(can_send_mode_m);
 HOOK_FUNCTION(can_send_mode_n);
@@ -85,7 +93,7 @@ MODULE_LOADER(core) {
         EXPORT_SYM(chanmode_uflag);
         EXPORT_SYM(chanmode_uflag_query);
         chanmode_request('b', &core.chanmodes.ban, CHANMODE_FL_A, "chanmode_ban",
-                "chanmode_ban_query", sizeof(struct channel_ban_list), NULL);
+                "chanmode_ban_query", sizeof(struct channel_bans), NULL);
         chanmode_request('k', &core.chanmodes.key, CHANMODE_FL_B, "chanmode_key",
                 "chanmode_key_query", PASSWDLEN + 1, NULL);
         chanmode_request('l', &core.chanmodes.limit, CHANMODE_FL_C,
@@ -105,6 +113,7 @@ MODULE_LOADER(core) {
     add_hook(ircd.events.can_join_channel, can_join_mode_b);
     add_hook(ircd.events.can_send_channel, can_send_mode_b);
     add_hook(ircd.events.can_nick_channel, can_nick_mode_b);
+    add_hook(ircd.events.client_host, ban_host_hook);
 
     add_hook(ircd.events.can_send_channel, can_send_mode_m);
 
@@ -160,6 +169,7 @@ MODULE_UNLOADER(core) {
     remove_hook(ircd.events.can_join_channel, can_join_mode_b);
     remove_hook(ircd.events.can_send_channel, can_send_mode_b);
     remove_hook(ircd.events.can_nick_channel, can_nick_mode_b);
+    remove_hook(ircd.events.client_host, ban_host_hook);
 
     remove_hook(ircd.events.can_send_channel, can_send_mode_m);
 
@@ -188,45 +198,144 @@ MODULE_UNLOADER(core) {
     DMSG(ERR_CHANOPRIVSNEEDED);
 }
 
-/* Function to count how many bans in a channel a user matches against.  
- * We try to do the least number of comparisons possible (always 2,
- * maybe 3(. */
+/* the original host only needs to be checked when it differs from the
+ * displayed one.  return it if so, NULL otherwise. */
+static const char *ban_orighost(const char *host, const char *orighost) {
 
-static int check_bans(const struct channel_ban_list *list, const char *nick,
+    if (orighost != NULL && *orighost != '\0' && strcasecmp(host, orighost))
+        return orighost;
+    return NULL;
+}
+
+/* Check a single ban against the given data.  If the nick or username don't
+ * match we skip right away, then do two (or three) host checks.  First we
+ * check the "display" host, then we do ip matching on the ip, and then we
+ * check the orighost if one is given. */
+static bool ban_match(const struct channel_ban *cbp, const char *nick,
         const char *user, const char *host, const char *ip,
         const char *orighost) {
-    struct channel_ban *cbp;
-    bool check_orighost = false;
-    int bans = 0;
 
-    if (orighost != NULL && *orighost != '\0' && strcasecmp(host, orighost))
-        check_orighost = true;
-
-    /* Walk the list only once, checking each ban against the various
-     * pieces of data provided.  If the nick or username don't match we skip
-     * right away, then do two (or three) host checks.  First we check the
-     * "display" host, then we do ip matching on the ip, and then we check
-     * the orighost if required. */
-
-    LIST_FOREACH(cbp, list, lp) {
-        if (!match(cbp->nick, nick) || !match(cbp->user, user))
-            continue; /* not a match */
-        if (match(cbp->host, host) || ipmatch(cbp->host, ip)) {
-            bans++;
-            continue;
-        } else if (check_orighost && match(cbp->host, orighost)) {
-            bans++;
-            continue;
+    if ((!(cbp->flags & CHANNEL_BAN_FL_ANYNICK) &&
+                !matcher_match(cbp->nickm, nick)) ||
+            (!(cbp->flags & CHANNEL_BAN_FL_ANYUSER) &&
+                !matcher_match(cbp->userm, user)))
+        return false; /* not a match */
+    return (matcher_match(cbp->hostm, host) ||
+            matcher_ipmatch(cbp->hostm, ip) ||
+            (orighost != NULL && matcher_match(cbp->hostm, orighost)));
+}
+
+static bool ban_match_client(const struct channel_ban *cbp, client_t *cli) {
+
+    return ban_match(cbp, cli->nick, cli->user, cli->host, cli->ip,
+            ban_orighost(cli->host, cli->orighost));
+}
+
+/* the bucket in the 'exact' hash for a host (or address).  this has to
+ * fold case the same way match() does. */
+static unsigned int ban_bucket(const char *host) {
+    const unsigned char *s = (const unsigned char *)host;
+    uint32_t hv = 2166136261U; /* FNV-1a */
+
+    while (*s != '\0') {
+        hv ^= tolower(*s);
+        hv *= 16777619U;
+        s++;
+    }
+
+    return hv % CHANNEL_BAN_BUCKETS;
+}
+
+/* sort a new ban into the channel's buckets.  a host with no wildcards
+ * (or mask) in it can only match that one host, or if it is an address
+ * written the way inet_ntop() would write it, that one address.  those are
+ * hashed, everything else is checked the long way. */
+static void ban_index_add(struct channel_bans *bans, struct channel_ban *cbp) {
+    unsigned char addr[IPADDR_SIZE];
+    char canon[IPADDR_MAXLEN + 1];
+    int family;
+
+    if (!strcmp(cbp->nick, "*"))
+        cbp->flags |= CHANNEL_BAN_FL_ANYNICK;
+    if (!strcmp(cbp->user, "*"))
+        cbp->flags |= CHANNEL_BAN_FL_ANYUSER;
+    if (strpbrk(cbp->host, "*?/") == NULL) {
+        family = get_address_type(cbp->host);
+        if ((family != PF_INET && family != PF_INET6) ||
+                inet_pton(family, cbp->host, addr) != 1 ||
+                (inet_ntop(family, addr, canon, IPADDR_MAXLEN + 1) != NULL &&
+                 !strcasecmp(canon, cbp->host)))
+            cbp->flags |= CHANNEL_BAN_FL_EXACT;
+    }
+
+    if (cbp->flags & CHANNEL_BAN_FL_EXACT) {
+        if (bans->exact == NULL)
+            bans->exact = calloc(CHANNEL_BAN_BUCKETS,
+                    sizeof(struct channel_ban_list));
+        LIST_INSERT_HEAD(&bans->exact[ban_bucket(cbp->host)], cbp, lpbucket);
+    } else
+        LIST_INSERT_HEAD(&bans->masks, cbp, lpbucket);
+}
+
+/* Function to count how many bans in a channel a user matches against.
+ * Bans on a single host can only match the user's host, address, or
+ * original host, so just the buckets for those are checked (each once).
+ * Then the masks are checked one by one. */
+static int check_bans(const struct channel_bans *bans, const char *nick,
+        const char *user, const char *host, const char *ip,
+        const char *orighost) {
+    struct channel_ban *cbp;
+    unsigned char addr[IPADDR_SIZE];
+    char canon[IPADDR_MAXLEN + 1];
+    unsigned int bucket[3];
+    int family, nb = 0, i, j;
+    int count = 0;
+
+    orighost = ban_orighost(host, orighost);
+    if (bans->exact != NULL) {
+        bucket[nb++] = ban_bucket(host);
+        family = get_address_type(ip);
+        if ((family == PF_INET || family == PF_INET6) &&
+                inet_pton(family, ip, addr) == 1 &&
+                inet_ntop(family, addr, canon, IPADDR_MAXLEN + 1) != NULL)
+            bucket[nb++] = ban_bucket(canon);
+        if (orighost != NULL)
+            bucket[nb++] = ban_bucket(orighost);
+
+        for (i = 0;i < nb;i++) {
+            for (j = 0;j < i;j++) {
+                if (bucket[j] == bucket[i])
+                    break;
+            }
+            if (j < i)
+                continue; /* already done this one */
+            LIST_FOREACH(cbp, &bans->exact[bucket[i]], lpbucket) {
+                if (ban_match(cbp, nick, user, host, ip, orighost))
+                    count++;
+            }
         }
     }
+    LIST_FOREACH(cbp, &bans->masks, lpbucket) {
+        if (ban_match(cbp, nick, user, host, ip, orighost))
+            count++;
+    }
 
-    return bans;
+    return count;
+}
+
+static void destroy_ban(struct channel_ban *cbp) {
+
+    destroy_matcher(cbp->nickm);
+    destroy_matcher(cbp->userm);
+    destroy_matcher(cbp->hostm);
+    free(cbp);
 }
 
 /* bans.  rather complicated! */
 CHANMODE_FUNC(chanmode_ban) {
-    struct channel_ban_list *banlist =
-        (struct channel_ban_list *)chanmode_getdata(chan, mode);
+    struct channel_bans *bans =
+        (struct channel_bans *)chanmode_getdata(chan, mode);
+    struct channel_ban_list *banlist = &bans->list;
     struct channel_ban *cbp;
     struct chanlink *clp;
     char nick[NICKLEN + 1];
@@ -320,14 +429,18 @@ CHANMODE_FUNC(chanmode_ban) {
                 strcpy(cbp->who, ircd.me->name);
             cbp->when = me.now;
             cbp->type = CHANNEL_BAN_BAN;
+            cbp->nickm = create_matcher(cbp->nick, 0);
+            cbp->userm = create_matcher(cbp->user, 0);
+            cbp->hostm = create_matcher(cbp->host, MATCH_FL_IP);
 
             LIST_INSERT_HEAD(banlist, cbp, lp);
+            ban_index_add(bans, cbp);
 
-            /* count bans against all users in the channel. */
+            /* the other bans are already counted for the users in the
+             * channel, so only the new one needs to be checked. */
             LIST_FOREACH(clp, &chan->users, lpchan) {
-                clp->bans = check_bans(banlist, clp->cli->nick,
-                        clp->cli->user, clp->cli->host, clp->cli->ip,
-                        clp->cli->orighost);
+                if (ban_match_client(cbp, clp->cli))
+                    clp->bans++;
             }
             
             break;
@@ -336,16 +449,18 @@ CHANMODE_FUNC(chanmode_ban) {
                 if (!strcasecmp(cbp->nick, nick) &&
                         !strcasecmp(cbp->user, user) &&
                         !strcasecmp(cbp->host, host)) {
-                    /* a winner. */
-                    LIST_REMOVE(cbp, lp);
-                    free(cbp);
-
-                    /* count bans against all users in the channel. */
+                    /* a winner.  take it off the count of those it
+                     * matches.  (the count may have been zeroed by an
+                     * invite, so don't let it go below that.)  counts are
+                     * redone when a host changes, see ban_host_hook(), so
+                     * this matches what was counted. */
                     LIST_FOREACH(clp, &chan->users, lpchan) {
-                        clp->bans = check_bans(banlist, clp->cli->nick,
-                                clp->cli->user, clp->cli->host, clp->cli->ip,
-                                clp->cli->orighost);
+                        if (clp->bans > 0 && ban_match_client(cbp, clp->cli))
+                            clp->bans--;
                     }
+                    LIST_REMOVE(cbp, lp);
+                    LIST_REMOVE(cbp, lpbucket);
+                    destroy_ban(cbp);
                     break;
                 }
             }
@@ -353,7 +468,12 @@ CHANMODE_FUNC(chanmode_ban) {
         case CHANMODE_CLEAR:
             while ((cbp = LIST_FIRST(banlist)) != NULL) {
                 LIST_REMOVE(cbp, lp);
-                free(cbp);
+                LIST_REMOVE(cbp, lpbucket);
+                destroy_ban(cbp);
+            }
+            if (bans->exact != NULL) {
+                free(bans->exact);
+                bans->exact = NULL;
             }
             break;
     }
@@ -368,7 +488,7 @@ struct ban_query_state {
 
 CHANMODE_QUERY_FUNC(chanmode_ban_query) {
     struct channel_ban_list *banlist =
-        (struct channel_ban_list *)chanmode_getdata(chan, mode);
+        &((struct channel_bans *)chanmode_getdata(chan, mode))->list;
     struct channel_ban *cbp;
     struct ban_query_state *bqs;
     char mask[BAN_MASK_LEN];
@@ -412,12 +532,12 @@ CHANMODE_QUERY_FUNC(chanmode_ban_query) {
 
 HOOK_FUNCTION(can_join_mode_b) {
     struct channel_check_args *ccap = (struct channel_check_args *)data;
-    struct channel_ban_list *banlist =
-        (struct channel_ban_list *)chanmode_getdata(ccap->chan,
-                                                    core.chanmodes.ban);
+    struct channel_bans *bans =
+        (struct channel_bans *)chanmode_getdata(ccap->chan,
+                                                core.chanmodes.ban);
     void *ret = (void *)HOOK_COND_OK; /* deny by default. */
 
-    ccap->clp->bans = check_bans(banlist, ccap->cli->nick, ccap->cli->user,
+    ccap->clp->bans = check_bans(bans, ccap->cli->nick, ccap->cli->user,
             ccap->cli->host, ccap->cli->ip, ccap->cli->orighost);
 
     if (ccap->clp->bans)
@@ -437,9 +557,9 @@ HOOK_FUNCTION(can_send_mode_b) {
 }
 HOOK_FUNCTION(can_nick_mode_b) {
     struct channel_check_args *ccap = (struct channel_check_args *)data;
-    struct channel_ban_list *banlist =
-        (struct channel_ban_list *)chanmode_getdata(ccap->chan,
-                                                    core.chanmodes.ban);
+    struct channel_bans *bans =
+        (struct channel_bans *)chanmode_getdata(ccap->chan,
+                                                core.chanmodes.ban);
 
     if (ccap->clp == NULL) {
         log_debug("can_nick_mode_b() called when client wasn't in channel!");
@@ -450,13 +570,31 @@ HOOK_FUNCTION(can_nick_mode_b) {
 
     /* if they're not banned, make sure the nickname change wouldn't result in
      * a ban either. */
-    if (check_bans(banlist, ccap->extra, ccap->cli->user, ccap->cli->host,
+    if (check_bans(bans, ccap->extra, ccap->cli->user, ccap->cli->host,
                 ccap->cli->ip, ccap->cli->orighost))
         return (void *)ERR_BANONCHAN;
 
     return (void *)HOOK_COND_NEUTRAL; /* eh. */
 }
 
+/* a client's host changed, so the bans counted against them in each of
+ * their channels may no longer be the ones which match.  count them again,
+ * that way -b can take a ban off exactly the users it matches now. */
+HOOK_FUNCTION(ban_host_hook) {
+    client_t *cli = (client_t *)data;
+    struct chanlink *clp;
+    struct channel_bans *bans;
+
+    LIST_FOREACH(clp, &cli->chans, lpcli) {
+        bans = (struct channel_bans *)chanmode_getdata(clp->chan,
+                core.chanmodes.ban);
+        clp->bans = check_bans(bans, cli->nick, cli->user, cli->host,
+                cli->ip, cli->orighost);
+    }
+
+    return NULL;
+}
+
 CHANMODE_FUNC(chanmode_flag) {
     
     *argused = 0;
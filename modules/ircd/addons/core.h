@@ -41,11 +41,33 @@ struct channel_ban {
     char user[USERLEN + 1];
     char host[HOSTLEN + 1];
     char who[BAN_MASK_LEN + 1];
+    matcher_t *nickm;   /* and the three of them compiled, since they are */
+    matcher_t *userm;   /* matched against everyone who joins */
+    matcher_t *hostm;
     time_t  when;       /* when the ban was set */
 #define CHANNEL_BAN_BAN 0x01
     unsigned char type; /* reserved for various uses */
+#define CHANNEL_BAN_FL_ANYNICK 0x01     /* the nick part is just '*' */
+#define CHANNEL_BAN_FL_ANYUSER 0x02     /* the user part is just '*' */
+#define CHANNEL_BAN_FL_EXACT 0x04       /* the host part is a single host
+                                           (or address), see below */
+    unsigned char flags;
 
     LIST_ENTRY(channel_ban) lp;
+    LIST_ENTRY(channel_ban) lpbucket;   /* in 'exact' or 'masks' below */
+};
+
+/* the bans on a channel.  'list' holds all of them, newest first.  to check
+ * a client against them quickly, bans on a single host or address are also
+ * hashed by it into 'exact', so only the ones for the client's own host and
+ * address need to be looked at.  the rest (wildcard and CIDR masks) are
+ * kept in 'masks'. */
+#define CHANNEL_BAN_BUCKETS 32
+struct channel_bans {
+    struct channel_ban_list list;
+    struct channel_ban_list *exact; /* CHANNEL_BAN_BUCKETS lists, allocated
+                                       when the first such ban is set */
+    struct channel_ban_list masks;
 };
 
 /* some macros... the link variety are a lot faster if you've already taken
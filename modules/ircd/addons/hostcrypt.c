@@ -191,6 +191,7 @@ HOOK_FUNCTION(hostcrypt_oper_hook) {
             strlcpy(cli->host, hostcrypt.operhost, HOSTLEN + 1);
         else
             strlcpy(cli->host, hostcrypt.crypter(cli), HOSTLEN + 1);
+        hook_event(ircd.events.client_host, cli);
     }
 
     return NULL;
@@ -264,12 +265,14 @@ static void hostcrypt_encrypt(client_t *cli) {
         strlcpy(cli->host, hostcrypt.operhost, HOSTLEN + 1);
     else
         strlcpy(cli->host, hostcrypt.crypter(cli), HOSTLEN + 1);
+    hook_event(ircd.events.client_host, cli);
 }
 
 /* This function wraps the decryption of hosts.  It's similar to the above. */
 static void hostcrypt_decrypt(client_t *cli) {
 
     strcpy(cli->host, cli->orighost);
+    hook_event(ircd.events.client_host, cli);
 }
 
 /*****************************************************************************
@@ -100,6 +100,7 @@ HOOK_FUNCTION(hostmask_cc_hook) {
         sendto_flag(SFLAG("SPY"), "Changing hostname for %s!%s@%s to %s",
                 cli->nick, cli->user, cli->host, mask);
         strlcpy(cli->host, mask, HOSTLEN + 1);
+        hook_event(ircd.events.client_host, cli);
     }
 
     return NULL;
@@ -24,6 +24,7 @@ channel_t *create_channel(char *name) {
     strncpy(chan->name, name, ircd.limits.chanlen);
     chan->created = me.now;
 
+    chan->serial = ++ircd.serial;
     LIST_INSERT_HEAD(ircd.lists.channels, chan, lp);
     hash_insert(ircd.hashes.channel, chan);
 
@@ -42,6 +43,7 @@ void add_to_channel(client_t *cli, channel_t *chan, bool hook) {
     clp->cli = cli;
     clp->chan = chan;
     clp->flags = clp->bans = 0;
+    clp->serial = ++ircd.serial;
     LIST_INSERT_HEAD(&chan->users, clp, lpchan);
     LIST_INSERT_HEAD(&cli->chans, clp, lpcli);
 
@@ -87,6 +89,7 @@ void destroy_channel(channel_t *chan) {
 
     /* we only expect to be called on an empty channel! */
     hash_delete(ircd.hashes.channel, chan);
+    server_burst_forget_channel(chan);
     LIST_REMOVE(chan, lp);
     ircd.stats.channels--;
     mdext_free(ircd.mdext.channel, chan->mdext);
@@ -223,7 +226,7 @@ void chanmode_release(unsigned char mode) {
 static void chanmode_build_lists(void) {
     int i;
     unsigned char imodes[256];
-    unsigned char *s;
+    unsigned char *s, *t;
 
     /* fill in the 'avail' modestring thing. */
     s = ircd.cmodes.avail;
@@ -254,6 +257,17 @@ static void chanmode_build_lists(void) {
     }
     *s = '\0';
 
+    /* and the prefixes for every set of chanlink flags in the table */
+    for (i = 0;i < CHANMODE_PFXTAB_SIZE;i++) {
+        t = ircd.cmodes.pfxtab[i] + 1;
+        for (s = ircd.cmodes.pmodes;*s != '\0';s++) {
+            if (i & ircd.cmodes.modes[*s].umask)
+                *t++ = ircd.cmodes.modes[*s].prefix;
+        }
+        *t = '\0';
+        ircd.cmodes.pfxtab[i][0] = t - ircd.cmodes.pfxtab[i] - 1;
+    }
+
     /* now do a/b/c/d/e */
     s = imodes;
 #define CHANMODE_BUILD_TYPE(_flg) do {                                        \
@@ -366,21 +380,29 @@ int chanmode_isprefix(channel_t *chan, client_t *cli, unsigned char prefix) {
 }
 
 char *chanmode_getprefixes(channel_t *chan, client_t *cli) {
-    static unsigned char pfx[64];
     struct chanlink *clp = find_chan_link(cli, chan);
+
+    if (clp == NULL)
+        return "";
+    return (char *)chanlink_prefixes(clp) + 1;
+}
+
+/* this works out the prefixes for links whose flags are too big for the
+ * table built in chanmode_build_lists(). */
+unsigned char *chanmode_linkprefixes(struct chanlink *clp) {
+    static unsigned char pfx[18];
     unsigned char *s = ircd.cmodes.pmodes;
-    int i = 0;
+    int i = 1;
 
-    if (clp != NULL) {
-        while (*s != '\0') {
-            if (clp->flags & ircd.cmodes.modes[*s].umask)
-                pfx[i++] = ircd.cmodes.modes[*s].prefix;
-            s++;
-        }
+    while (*s != '\0') {
+        if (clp->flags & ircd.cmodes.modes[*s].umask)
+            pfx[i++] = ircd.cmodes.modes[*s].prefix;
+        s++;
     }
 
     pfx[i] = '\0';
-    return (char *)pfx;
+    pfx[0] = i - 1;
+    return pfx;
 }
 
 /* this function returns two strings.  the first is all the modes set on the
@@ -192,11 +192,23 @@ struct chanlink {
     short   flags;
     short   bans; /* for users only, stores how many bans they have against
                      them */
+    uint64_t serial; /* see ircd.serial */
 
     LIST_ENTRY(chanlink) lpcli;
     LIST_ENTRY(chanlink) lpchan;
 };
 
+/* this gives the prefixes for a chanlink from a table kept with the other
+ * channel mode lists.  the first byte is the number of prefixes, which
+ * follow it and are \0 terminated.  links with flags beyond the table (more
+ * than eight prefix modes) have their prefixes worked out by
+ * chanmode_linkprefixes(), which returns the same format. */
+#define CHANMODE_PFXTAB_SIZE 256
+#define chanlink_prefixes(clp)                                             \
+((unsigned short)(clp)->flags < CHANMODE_PFXTAB_SIZE ?                     \
+ ircd.cmodes.pfxtab[(clp)->flags] : chanmode_linkprefixes(clp))
+unsigned char *chanmode_linkprefixes(struct chanlink *);
+
 char **channel_mdext_iter(char **);
 
 struct channel {
@@ -208,6 +220,7 @@ struct channel {
     struct chanusers users;            /* list of users in channel */
     uint64_t modes;                    /* the flag-modes for the channel. */
     char    *mdext;                    /* mdext data */
+    uint64_t serial;                   /* see ircd.serial */
 
     LIST_ENTRY(channel) lp;
 };
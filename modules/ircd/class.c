@@ -24,6 +24,9 @@ class_t *create_class(char *name) {
     c->flood = 192; /* ? */
     c->clients = 0;
     c->sendq = 1000; /* ? */
+    c->sendq_bytes = 0;
+    c->sendq_chunked = 0;
+    c->bufsize = 0;
     c->default_mode = strdup("+i");
     c->mset = LIST_FIRST(ircd.messages.sets);
     c->pset = LIST_FIRST(ircd.privileges.sets);
@@ -66,6 +69,8 @@ void add_to_class(class_t *c, connection_t *conn) {
 
     conn->cls = c;
     conn->mset = c->mset;
+    if (conn->sendq_bytes)
+        SENDQ_CLASS_ADD(c, conn->sendq_bytes);
     if (conn->cli != NULL)
         conn->cli->pset = c->pset;
     c->clients++;
@@ -75,6 +80,7 @@ void del_from_class(connection_t *conn) {
     class_t *c = conn->cls;
 
     c->clients--;
+    c->stats.queued -= conn->sendq_bytes;
     conn->cls = NULL; /* make sure nothing references this class */
 
     if (c->clients == 0 && c->dead) /* if it's dead, nerf it */
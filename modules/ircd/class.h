@@ -17,7 +17,21 @@ struct class {
     int            flood;                /* maximum flood weight in this class */
     int            clients;                /* current number of clients in this class
                                    (may be > max) */
-    int            sendq;                /* maximum number of sendqueue items */
+    int            sendq;                /* maximum number of sendqueue items (0
+                                   for no limit, unused for chunked sendqs) */
+    int            sendq_bytes;        /* maximum number of bytes queued (0 for
+                                   no limit) */
+    int            bufsize;        /* the size of the read buffer for
+                                   connections in this class (if it is
+                                   bigger than the protocol's) */
+    int            sendq_chunked;        /* set if connections in this class copy
+                                   their output into chunks (see send.c) */
+    struct {
+        size_t        queued;                /* bytes queued by connections in the
+                                   class right now */
+        size_t        peak;                /* the most bytes ever queued at once */
+        uint64_t total;                /* all the bytes ever queued */
+    } stats;
     char    *default_mode;        /* default modes for users in this class */
     struct message_set *mset;        /* the suggested message set, by default this
                                    is the default set */
@@ -106,6 +106,10 @@ void destroy_client(client_t *cli, char *msg) {
         /* they would now be visible, except we're nerfing them. */
         ircd.stats.net.visclients--;
         ircd.stats.net.curclients--;
+
+        server_burst_forget_client(cli);
+        LIST_REMOVE(cli, lpsrv);
+        cli->server->nclients--;
     }
 
     /* Oops.  We have to delete clients from the hashtable even if they aren't
@@ -157,7 +161,10 @@ void client_change_nick(client_t *cli, char *to) {
             client_add_history(cli);
     }
 
+    if (CLIENT_REGISTERED(cli))
+        server_burst_nick(cli);
     strncpy(cli->nick, to, NICKLEN);
+    cli->nicklen = strlen(cli->nick);
 
     if (!casechng) {
         hash_insert(ircd.hashes.client, cli);
@@ -183,6 +190,10 @@ int register_client(client_t *cli) {
     connection_t *cp = cli->conn;
     void **returns; /* hook returns */
     int x = 0;
+
+    /* remote clients and pseudo-clients have their nickname copied straight
+     * into place, so the cached length is set here for everyone. */
+    cli->nicklen = strlen(cli->nick);
                 
     /* determine if it is okay for them to connect.  if it is, and we allow the
      * connection through, let the rest of the network know before we do
@@ -203,6 +214,7 @@ int register_client(client_t *cli) {
              * list. */
             LIST_REMOVE(cp, lp);
             LIST_INSERT_HEAD(ircd.connections.clients, cp, lp);
+            cp->flags |= IRCD_CONNFL_STAGE3;
         }
 
         cli->signon = cli->ts = me.now;
@@ -256,6 +268,9 @@ int register_client(client_t *cli) {
         strcpy(cli->ip, "0.0.0.0");
 
     cli->flags |= IRCD_CLIENT_REGISTERED;
+    cli->serial = ++ircd.serial;
+    LIST_INSERT_HEAD(&cli->server->clients, cli, lpsrv);
+    cli->server->nclients++;
 
     /* now introduce the client to our servers down the line, sptr should be
      * the server the client was introduced from (possibly us) */
@@ -12,6 +12,7 @@
 
 struct client {
     char    nick[NICKLEN + 1];      /* nickname */
+    unsigned char nicklen;          /* and its length */
     char    user[USERLEN + 1];      /* username on IRC (different from username
                                        in conn */
     char    host[HOSTLEN + 1];      /* hostname on IRC */
@@ -47,6 +48,7 @@ struct client {
                                        conn->last) */
     int     hops;                   /* how many hops away are they? */
     uint64_t modes;                 /* the user's modes, see below */
+    uint64_t serial;                /* see ircd.serial */
 
     struct userchans chans;         /* our channels */
 
@@ -58,6 +60,7 @@ struct client {
     char    *mdext;                 /* mdext data */
     
     LIST_ENTRY(client) lp;
+    LIST_ENTRY(client) lpsrv;       /* entry in our server's client list */
 };
 
 struct client *create_client(struct connection *);
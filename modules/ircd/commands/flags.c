@@ -32,6 +32,7 @@ static struct {
 
 HOOK_FUNCTION(send_flag_log_hook);
 HOOK_FUNCTION(send_flag_connect_hook);
+static bool send_flag_log_filter(enum logtypes, const char *);
 
 MODULE_LOADER(flags) {
     int64_t i64 = 0;
@@ -58,6 +59,7 @@ MODULE_LOADER(flags) {
     add_hook(me.events.log_warn, send_flag_log_hook);
     add_hook(me.events.log_error, send_flag_log_hook);
     add_hook(me.events.log_unknown, send_flag_log_hook);
+    log_add_filter(send_flag_log_hook, send_flag_log_filter);
 
     add_hook_before(ircd.events.client_connect, send_flag_connect_hook, NULL);
     add_hook_before(ircd.events.client_disconnect, send_flag_connect_hook,
@@ -81,6 +83,7 @@ MODULE_UNLOADER(flags) {
         destroy_send_flag(flags.flags.skill);
     }
 
+    log_remove_filter(send_flag_log_hook);
     remove_hook(me.events.log_debug, send_flag_log_hook);
     remove_hook(me.events.log_notice, send_flag_log_hook);
     remove_hook(me.events.log_warn, send_flag_log_hook);
@@ -208,6 +211,15 @@ HOOK_FUNCTION(send_flag_log_hook) {
     return NULL;
 }
 
+/* log messages only need to be formatted for us if someone is listening */
+static bool send_flag_log_filter(enum logtypes level, const char *module) {
+    int flg = flags.flags.log;
+
+    if (flg < 0 || flg >= ircd.sflag.size || ircd.sflag.flags[flg].num < 0)
+        return false;
+    return !LIST_EMPTY(&ircd.sflag.flags[flg].users);
+}
+
 /* this function just sends a notification message when clients connect or
  * disconnect. */
 HOOK_FUNCTION(send_flag_connect_hook) {
@@ -93,7 +93,7 @@ void do_names(client_t *cli, channel_t *chan) {
             len = 0;
         }
         len += sprintf(&buf[len], "%s%s ",
-                chanmode_getprefixes(chan, clp->cli), clp->cli->nick);
+                (char *)chanlink_prefixes(clp) + 1, clp->cli->nick);
     }
     if (len) {
         buf[len - 1] = '\0';
@@ -53,11 +53,19 @@ SERVER_COMMAND(ping, 1, 2, 0) {
     else if ((sp = find_server(argv[2])) != NULL)
         return 0;
 
-    /* sp is now set to our destination.  srv is our origin. */
-    if (sp == ircd.me)
+    /* sp is now set to our destination.  srv is our origin.  our PONG
+     * doesn't mention any clients, so it needn't wait behind a burst we are
+     * sending in that direction. */
+    if (sp == ircd.me) {
+        server_t *up = srv_server_uplink(srv);
+
+        if (up->burst != NULL)
+            up->burst->flags |= SERVER_BURST_PASS;
         sendto_serv_from(srv, NULL, ircd.me, NULL, "PONG", "%s :%s",
                 ircd.me->name, srv->name);
-    else
+        if (up->burst != NULL)
+            up->burst->flags &= ~SERVER_BURST_PASS;
+    } else
         sendto_serv_from(sp, NULL, srv, NULL, "PING", "%s :%s", srv->name,
                 sp->name);
 
@@ -64,6 +64,11 @@ CLIENT_COMMAND(stats, 1, 2, COMMAND_FL_REGISTERED) {
         strcpy(argv[1], "CLASS");
         argc = 2;
         break;
+    case 'z':
+    case 'Z':
+        strcpy(argv[1], "HEAP");
+        argc = 2;
+        break;
     }
 
     strcpy(argv[0], "XINFO");
@@ -53,6 +53,17 @@ MODULE_UNLOADER(trace) {
     DMSG(RPL_ENDOFTRACE);
 }
 
+/* count the clients and servers behind the given server (including the
+ * server itself). */
+static void trace_count(server_t *srv, int *cnt, int *scnt) {
+    server_t *sp;
+
+    *cnt += srv->nclients;
+    (*scnt)++;
+    LIST_FOREACH(sp, &srv->children, lpchild)
+        trace_count(sp, cnt, scnt);
+}
+
 /* argv[1] ?= server/client to trace to */
 CLIENT_COMMAND(trace, 0, 2, COMMAND_FL_REGISTERED) {
     client_t *cp = NULL;
@@ -137,15 +148,9 @@ CLIENT_COMMAND(trace, 0, 2, COMMAND_FL_REGISTERED) {
                     cli->nick, me.now - connp->last);
     }
     LIST_FOREACH(connp, ircd.connections.servers, lp) {
-        /* XXX: ye gods is this expensive. */
         int cnt = 0, scnt = 0; /* client/server count */
-        LIST_FOREACH(cp, ircd.lists.clients, lp)
-            if (cli_server_uplink(cp) == connp->srv)
-                cnt++;
-        LIST_FOREACH(sp, ircd.lists.servers, lp)
-            if (sp == connp->srv || srv_server_uplink(sp) == connp->srv)
-                scnt++;
         sp = connp->srv;
+        trace_count(sp, &cnt, &scnt);
         sendto_one(cli, RPL_FMT(cli, RPL_TRACESERVER), connp->cls->name, cnt,
                 scnt, sp->name, "*", me.now - connp->last);
     }
@@ -66,6 +66,7 @@ static struct watchlink *find_watch_link(client_t *, watch_t *);
 static void add_to_watch(watch_t *, client_t *);
 static void del_from_watch(watch_t *, client_t *);
 HOOK_FUNCTION(watch_client_hook);
+HOOK_FUNCTION(watch_reload_hook);
 #define find_watch(x) (struct watch *)hash_find(watch.table, x)
 
 MODULE_LOADER(watch) {
@@ -80,12 +81,16 @@ MODULE_LOADER(watch) {
                 offsetof(watch_t, nick), NICKLEN,
                 HASH_FL_NOCASE|HASH_FL_STRING, "nickcmp");
     }
+    hash_set_foldmap(watch.table, ircd.maps.nick);
 
     add_isupport("WATCH", ISUPPORT_FL_PRIV, (char *)&watch.watchlim);
 
     add_hook(ircd.events.register_client, watch_client_hook);
     add_hook(ircd.events.unregister_client, watch_client_hook);
     add_hook(ircd.events.client_nick, watch_client_hook);
+    /* this is added after ircd's own reload hook, so the nick map is
+     * up to date by the time ours is called */
+    add_hook(me.events.read_conf, watch_reload_hook);
 
     /* now create numerics.  the toomanywatch numeric is a bogon, according to
      * various rfcs, because 5xx numbers are supposed to be permanent errors
@@ -127,6 +132,7 @@ MODULE_UNLOADER(watch) {
     remove_hook(ircd.events.register_client, watch_client_hook);
     remove_hook(ircd.events.unregister_client, watch_client_hook);
     remove_hook(ircd.events.client_nick, watch_client_hook);
+    remove_hook(me.events.read_conf, watch_reload_hook);
 
     DMSG(ERR_TOOMANYWATCH);
     DMSG(RPL_LOGON);
@@ -294,6 +300,14 @@ static void del_from_watch(watch_t *wp, client_t *cli) {
         destroy_watch(wp);
 }
 
+/* the nick map may have changed, keep the table hashing nicks the same way
+ * nickcmp() compares them. */
+HOOK_FUNCTION(watch_reload_hook) {
+
+    hash_set_foldmap(watch.table, ircd.maps.nick);
+    return NULL;
+}
+
 HOOK_FUNCTION(watch_client_hook) {
     client_t *cli = (client_t *)data;
     watch_t *wp;
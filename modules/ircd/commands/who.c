@@ -22,6 +22,8 @@ MODULE_REGISTER("$Rev: 579 $");
 static int priv_wholimit;
 static int priv_whoinvis;
 
+static void who_destroy_options(void);
+
 MODULE_LOADER(who) {
     int64_t i;
 
@@ -50,6 +52,7 @@ MODULE_UNLOADER(who) {
 
     destroy_privilege(priv_wholimit);
     destroy_privilege(priv_whoinvis);
+    who_destroy_options();
 
     /* now create numerics */
     DMSG(RPL_ENDOFWHO);
@@ -70,6 +73,8 @@ static struct {
     char *host;
     char *gcos;
     char *ip;
+    /* the compiled forms of the patterns above, see who_compile_options() */
+    matcher_t *nickm, *userm, *hostm, *gcosm, *ipm;
     channel_t *channel;
     server_t *server;
     /* below here are single bit flags */
@@ -127,6 +132,34 @@ NULL
     return COMMAND_WEIGHT_MEDIUM;                                             \
 } while (0)
 
+/* the patterns in the options are (usually) checked against a great many
+ * clients, so they are compiled once up front.  the matchers are kept until
+ * the next query comes along. */
+static void who_compile_options(void) {
+
+    if (who_opts.nick != NULL)
+        who_opts.nickm = create_matcher(who_opts.nick, 0);
+    if (who_opts.user != NULL)
+        who_opts.userm = create_matcher(who_opts.user, 0);
+    if (who_opts.host != NULL)
+        who_opts.hostm = create_matcher(who_opts.host, 0);
+    if (who_opts.gcos != NULL)
+        who_opts.gcosm = create_matcher(who_opts.gcos, 0);
+    if (who_opts.ip != NULL)
+        who_opts.ipm = create_matcher(who_opts.ip, MATCH_FL_IP);
+}
+
+static void who_destroy_options(void) {
+
+    destroy_matcher(who_opts.nickm);
+    destroy_matcher(who_opts.userm);
+    destroy_matcher(who_opts.hostm);
+    destroy_matcher(who_opts.gcosm);
+    destroy_matcher(who_opts.ipm);
+    who_opts.nickm = who_opts.userm = who_opts.hostm = who_opts.gcosm =
+        who_opts.ipm = NULL;
+}
+
 /* this function parses the search options given by the user into the
  * 'who_opts' structure above.  If the options are not parseable or do not make
  * sense, we send an error message and return 0. */
@@ -135,6 +168,7 @@ static int who_parse_options(client_t *cli, int argc, char **argv) {
     unsigned char *s;
     int oarg = 1;
 
+    who_destroy_options();
     memset(&who_opts, 0, sizeof(who_opts));
 
     who_opts.issuer = cli;
@@ -345,42 +379,49 @@ static int who_check(client_t *cli, int showall) {
             return 0;
     }
     if (who_opts.user != NULL) {
-        if ((who_opts.flags.user && !match(who_opts.user, cli->user)) ||
-                (who_opts.flags.user == 0 && match(who_opts.user, cli->user)))
+        if ((who_opts.flags.user &&
+                    !matcher_match(who_opts.userm, cli->user)) ||
+                (who_opts.flags.user == 0 &&
+                 matcher_match(who_opts.userm, cli->user)))
             return 0;
     }
     if (who_opts.nick != NULL) {
-        if ((who_opts.flags.nick && !match(who_opts.nick, cli->nick)) ||
-                (who_opts.flags.nick == 0 && match(who_opts.nick, cli->nick)))
+        if ((who_opts.flags.nick &&
+                    !matcher_match(who_opts.nickm, cli->nick)) ||
+                (who_opts.flags.nick == 0 &&
+                 matcher_match(who_opts.nickm, cli->nick)))
             return 0;
     }
     if (who_opts.host != NULL) {
         if (CAN_SEE_REAL_HOST(who_opts.issuer, cli)) {
             if ((who_opts.flags.host &&
-                        !match(who_opts.host, cli->orighost)) ||
+                        !matcher_match(who_opts.hostm, cli->orighost)) ||
                     (who_opts.flags.host == 0 &&
-                     match(who_opts.host, cli->orighost)))
+                     matcher_match(who_opts.hostm, cli->orighost)))
                 return 0;
         } else {
-            if ((who_opts.flags.host && !match(who_opts.host, cli->host)) ||
+            if ((who_opts.flags.host &&
+                        !matcher_match(who_opts.hostm, cli->host)) ||
                     (who_opts.flags.host == 0 &&
-                     match(who_opts.host, cli->host)))
+                     matcher_match(who_opts.hostm, cli->host)))
                 return 0;
         }
     }
     if (who_opts.gcos != NULL) {
-        if ((who_opts.flags.gcos && !match(who_opts.gcos, cli->info)) ||
-                (who_opts.flags.gcos == 0 && match(who_opts.gcos, cli->info)))
+        if ((who_opts.flags.gcos &&
+                    !matcher_match(who_opts.gcosm, cli->info)) ||
+                (who_opts.flags.gcos == 0 &&
+                 matcher_match(who_opts.gcosm, cli->info)))
             return 0;
     }
     if (who_opts.ip != NULL && CAN_SEE_REAL_HOST(who_opts.issuer, cli)) {
         if (
                 (who_opts.flags.ip &&
-                 (!match(who_opts.ip, cli->ip) &&
-                  !ipmatch(who_opts.ip, cli->ip))) ||
+                 (!matcher_match(who_opts.ipm, cli->ip) &&
+                  !matcher_ipmatch(who_opts.ipm, cli->ip))) ||
                 (who_opts.flags.ip == 0 &&
-                 (match(who_opts.ip, cli->ip) ||
-                  ipmatch(who_opts.ip, cli->ip))))
+                 (matcher_match(who_opts.ipm, cli->ip) ||
+                  matcher_ipmatch(who_opts.ipm, cli->ip))))
             return 0;
     }
 
@@ -431,6 +472,7 @@ CLIENT_COMMAND(who, 0, 0, 0) {
         return COMMAND_WEIGHT_NONE; /* /WHOs don't get routed..but? */
     if (!who_parse_options(cli, argc - 1, argv + 1))
         return COMMAND_WEIGHT_MEDIUM; /* query was no good. */
+    who_compile_options();
 
     /* it parsed okay, now depending on what they asked for, reply differently.
      * if they asked for a channel, life is pretty easy, other queries are not
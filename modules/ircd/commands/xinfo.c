@@ -20,6 +20,7 @@ static XINFO_FUNC(xinfo_class_handler);
 static XINFO_FUNC(xinfo_client_handler);
 static XINFO_FUNC(xinfo_connects_handler);
 static XINFO_FUNC(xinfo_hash_handler);
+static XINFO_FUNC(xinfo_heap_handler);
 static XINFO_FUNC(xinfo_me_handler);
 static XINFO_FUNC(xinfo_privilege_handler);
 static XINFO_FUNC(xinfo_server_handler);
@@ -37,6 +38,8 @@ MODULE_LOADER(xinfo) {
             "Shows information about server uplinks");
     add_xinfo_handler(xinfo_hash_handler, "HASH", XINFO_HANDLER_OPER,
             "Shows hash table statistics.");
+    add_xinfo_handler(xinfo_heap_handler, "HEAP", XINFO_HANDLER_OPER,
+            "Shows block heap (memory pool) statistics.");
     add_xinfo_handler(xinfo_me_handler, "ME", XINFO_HANDLER_LOCAL,
             "Provides information about your connection statistics");
     add_xinfo_handler(xinfo_privilege_handler, "PRIVILEGE",
@@ -63,6 +66,7 @@ MODULE_UNLOADER(xinfo) {
 
     remove_xinfo_handler(xinfo_class_handler);
     remove_xinfo_handler(xinfo_client_handler);
+    remove_xinfo_handler(xinfo_heap_handler);
     remove_xinfo_handler(xinfo_me_handler);
     remove_xinfo_handler(xinfo_privilege_handler);
     remove_xinfo_handler(xinfo_server_handler);
@@ -159,6 +163,13 @@ static XINFO_FUNC(xinfo_class_handler) {
                     cls->name, cls->freq, cls->max, cls->sendq, cls->flood,
                     cls->clients);
             sendto_one(cli, RPL_FMT(cli, RPL_XINFO), "DATA", rpl);
+            snprintf(rpl, XINFO_LEN,
+                    "LIMIT %d CHUNKED %d QUEUED %lu PEAK %lu TOTAL %llu",
+                    cls->sendq_bytes, cls->sendq_chunked,
+                    (unsigned long)cls->stats.queued,
+                    (unsigned long)cls->stats.peak,
+                    (unsigned long long)cls->stats.total);
+            sendto_one(cli, RPL_FMT(cli, RPL_XINFO), "SENDQ", rpl);
             sendto_one(cli, RPL_FMT(cli, RPL_XINFO), "MODE",
                     cls->default_mode);
             sendto_one(cli, RPL_FMT(cli, RPL_XINFO), "MSET",
@@ -171,8 +182,12 @@ static XINFO_FUNC(xinfo_class_handler) {
         }
     } else {
         LIST_FOREACH(cls, ircd.lists.classes, lp) {
-            snprintf(rpl, XINFO_LEN, "NAME %s PINGFREQ %d MAX %d SENDQ %d",
-                    cls->name, cls->freq, cls->max, cls->sendq);
+            snprintf(rpl, XINFO_LEN, "NAME %s PINGFREQ %d MAX %d SENDQ %d "
+                    "SENDQBYTES %d QUEUED %lu PEAK %lu TOTAL %llu",
+                    cls->name, cls->freq, cls->max, cls->sendq,
+                    cls->sendq_bytes, (unsigned long)cls->stats.queued,
+                    (unsigned long)cls->stats.peak,
+                    (unsigned long long)cls->stats.total);
             sendto_one(cli, RPL_FMT(cli, RPL_XINFO), "DATA", rpl);
         }
     }
@@ -298,6 +313,19 @@ static XINFO_FUNC(xinfo_hash_handler) {
     XINFO_SHOW_HASH(ircd.hashes.channel, "channels");
 }
 
+static XINFO_FUNC(xinfo_heap_handler) {
+    char rpl[XINFO_LEN];
+    heap_t *hp;
+
+    LIST_FOREACH(hp, &me.heaps, lp) {
+        snprintf(rpl, XINFO_LEN, "HEAP %s SIZE %d COUNT %d BLOCKS %d USED %d "
+                "PEAK %d ALLOCS %llu", hp->name, (int)hp->size, hp->count,
+                hp->stats.blocks, hp->stats.used, hp->stats.peak,
+                (unsigned long long)hp->stats.allocs);
+        sendto_one(cli, RPL_FMT(cli, RPL_XINFO), "HEAPINFO", rpl);
+    }
+}
+
 static XINFO_FUNC(xinfo_me_handler) {
     /* this is just a wrapper to xinfo_client_handler, but without the
      * associated privilege check.  mock up a fake argv and all that. */
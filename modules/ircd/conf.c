@@ -104,6 +104,12 @@ int ircd_parse_conf(conf_list_t *conf) {
             if (!istr_map(ent, ircd.maps.host))
                 log_warn("invalid character map pattern \"%s\"", ent);
     }
+    /* nicks and channels are compared with these maps, so they must be
+     * hashed with them as well.  (this rehashes the tables if a map has
+     * changed) */
+    hash_set_foldmap(ircd.hashes.client, ircd.maps.nick);
+    hash_set_foldmap(ircd.hashes.client_history, ircd.maps.nick);
+    hash_set_foldmap(ircd.hashes.channel, ircd.maps.channel);
 
     return 1;
 }
@@ -422,7 +428,14 @@ static void ircd_parse_classes(conf_list_t *conf) {
         cls->freq = str_conv_time(conf_find_entry("ping", c, 1), 180);
         cls->max = str_conv_int(conf_find_entry("max", c, 1), 600);
         cls->flood = str_conv_int(conf_find_entry("flood", c, 1), 192);
+        cls->bufsize = str_conv_int(conf_find_entry("read-buffer", c, 1), 0);
         cls->sendq = str_conv_int(conf_find_entry("sendq", c, 1), 1000);
+        cls->sendq_chunked = str_conv_bool(conf_find_entry("sendq-chunked", c,
+                    1), 0);
+        /* chunked sendqs can only be limited by size, so they always get a
+         * byte limit. */
+        cls->sendq_bytes = str_conv_int(conf_find_entry("sendq-bytes", c, 1),
+                (cls->sendq_chunked ? 524288 : 0));
 
         if ((s = conf_find_entry("message-set", c, 1)) != NULL)
             cls->mset = find_message_set(s);
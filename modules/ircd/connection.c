@@ -23,6 +23,7 @@ IDSTRING(rcsid, "$Id: connection.c 831 2009-02-09 00:42:56Z wd $");
 
 static void connection_stage2_done(connection_t *);
 static void connection_init_lookups(connection_t *);
+static time_t connection_ping_due(connection_t *);
 
 /* set the protocol for a connection, possibly cleaning up if necessary for
  * protocol changes */
@@ -86,6 +87,8 @@ void destroy_connection(connection_t *c, char *reason) {
         while (STAILQ_FIRST(&c->sendq) != NULL)
             sendq_pop(c);
     }
+    if (c->flags & IRCD_CONNFL_WRITER)
+        LIST_REMOVE(c, wlp);
 
     if (c->pass != NULL)
         free(c->pass);
@@ -93,6 +96,7 @@ void destroy_connection(connection_t *c, char *reason) {
     if (c->buf != NULL)
         free(c->buf);
 
+    destroy_timer(c->ping_timer);
     destroy_socket(c->sock);
     del_from_class(c);
     LIST_REMOVE(c, lp);
@@ -119,34 +123,61 @@ int close_unknown_connections(char *reason) {
     return count;
 }
 
+/* the most sendq items we will hand to socket_writev() at once. */
+#ifndef IOV_MAX
+# ifdef UIO_MAXIOV
+#  define IOV_MAX UIO_MAXIOV
+# else
+#  define IOV_MAX 16
+# endif
+#endif
+
 /* this function attempts to flush the send queue of a connection.  it returns
  * 1 if the client still exists (is not sendq'd off), or 0 otherwise. */
 int sendq_flush(connection_t *conn) {
     struct sendq_item *sip;
-    int ret;
+    struct iovec iov[IOV_MAX];
+    size_t len, left;
+    int ret, cnt;
 
     /* if the connection is writeable and has a send queue, push things off to
-     * the socket. */
+     * the socket.  we gather up as many items as we can and write them in
+     * one go, then pop off everything which went out whole.  the first item
+     * may already have been partially written. */
     if (conn->flags & IRCD_CONNFL_WRITEABLE) {
         while ((sip = STAILQ_FIRST(&conn->sendq)) != NULL) {
-            ret = socket_write(conn->sock, sip->block->msg + sip->offset,
-                    sip->block->len - sip->offset);
-            if (ret <= 0)
-                break;
-            else if ((size_t)ret != sip->block->len - sip->offset) {
-                sip->offset += ret;
+            len = 0;
+            for (cnt = 0;sip != NULL && cnt < IOV_MAX;cnt++) {
+                iov[cnt].iov_base = sip->block->msg + sip->offset;
+                iov[cnt].iov_len = sip->block->len - sip->offset;
+                len += iov[cnt].iov_len;
+                sip = STAILQ_NEXT(sip, lp);
+            }
+            if ((ret = socket_writev(conn->sock, iov, cnt)) <= 0)
                 break;
-            } else {
+            len -= ret; /* whatever is left over didn't fit */
+
+            while (ret > 0) {
+                sip = STAILQ_FIRST(&conn->sendq);
+                left = sip->block->len - sip->offset;
+                if ((size_t)ret < left) {
+                    sip->offset += ret;
+                    SENDQ_SUB_BYTES(conn, ret);
+                    break;
+                }
+                ret -= left;
                 conn->stats.sent += sip->block->len;
                 conn->stats.psent++;
                 sendq_pop(conn);
             }
+            if (len > 0)
+                break;
         }
     }
-    if (conn->flags & IRCD_CONNFL_NOSENDQ && conn->sendq_items == 0)
-        conn->flags &= ~IRCD_CONNFL_NOSENDQ;
-    else if (!(conn->flags & IRCD_CONNFL_NOSENDQ) &&
-            conn->sendq_items > conn->cls->sendq) {
+    if (conn->flags & IRCD_CONNFL_SENDQEXCEEDED || SENDQ_FULL(conn) ||
+            (!(conn->flags & IRCD_CONNFL_NOSENDQ) &&
+                !conn->cls->sendq_chunked && conn->cls->sendq > 0 &&
+                conn->sendq_items > conn->cls->sendq)) {
         destroy_connection(conn, "SendQ Exceeded");
         return 0;
     }
@@ -167,6 +198,7 @@ HOOK_FUNCTION(ircd_listen_hook) {
         c = calloc(1, sizeof(connection_t));
         c->sock = sp;
         c->signon = c->last = me.now;
+        c->ping_timer = TIMER_INVALID;
         sp->udata = c;
         get_socket_address(isock_raddr(sp), c->host, HOSTLEN + 1, NULL);
 
@@ -392,10 +424,72 @@ static void connection_stage2_done(connection_t *c) {
     /* now stick them in the default protocol */
     set_connection_protocol(c, ircd.default_proto);
     c->last = me.now;
+    connection_ping_schedule(c);
     /* and monitor them */
     socket_monitor(c->sock, SOCKET_FL_READ|SOCKET_FL_WRITE);
 }
 
+/* ping timeouts are handled with a timer for each connection past stage1.
+ * the timer goes off when the connection next needs to be looked at: either
+ * to send it a PING or to drop it.  cp->last changes all the time, so
+ * rather than moving the timer on every read we let it go off and push it
+ * back out if the connection turns out to have been active since. */
+static time_t connection_ping_due(connection_t *c) {
+    time_t freq = c->cls->freq;
+
+    /* for stage2, drop connections 4x faster than normal, since
+     * connections should *not* sit in a stage2 situation */
+    if (!(c->flags & IRCD_CONNFL_STAGE3))
+        return c->last + freq / 4 + 1;
+    else if (!CONN_PINGSENT(c))
+        return c->last + (int)((float)freq * 0.5) + 1;
+    else
+        return c->last + freq + 1;
+}
+
+/* this (re)schedules the ping timer for the given connection, creating it if
+ * necessary. */
+void connection_ping_schedule(connection_t *c) {
+    time_t when = connection_ping_due(c) - me.now;
+
+    if (when < 1)
+        when = 1;
+    if (c->ping_timer == TIMER_INVALID)
+        c->ping_timer = create_timer(-1, when, connection_ping_hook, c);
+    else
+        adjust_timer(c->ping_timer, -1, when);
+}
+
+HOOK_FUNCTION(connection_ping_hook) {
+    connection_t *c = (connection_t *)data;
+    time_t idle = me.now - c->last;
+
+    if (!(c->flags & IRCD_CONNFL_STAGE3)) {
+        if (idle > c->cls->freq / 4) {
+            destroy_connection(c, "Ping timeout");
+            return NULL;
+        }
+    } else if (idle > c->cls->freq) {
+        destroy_connection(c, "Ping timeout");
+        return NULL;
+    } else if (idle > (int)((float)c->cls->freq * 0.5) &&
+            !CONN_PINGSENT(c)) {
+        /* if 1/2 of the pingfreq time has elapsed, drop them a PING.  use
+         * sendto_one_target/sendto_serv_from here so that there is no
+         * prefix added, apparently most clients balk at the prefix */
+        if (c->cli != NULL)
+            sendto_one_target(c->cli, NULL, NULL, NULL, "PING", ":%s",
+                    ircd.me->name);
+        else
+            sendto_serv_from(c->srv, NULL, NULL, NULL, "PING", ":%s",
+                    ircd.me->name);
+        c->flags |= IRCD_CONNFL_PINGSENT;
+    }
+
+    connection_ping_schedule(c);
+    return NULL;
+}
+
 HOOK_FUNCTION(ircd_connection_datahook) {
     isocket_t *s = (isocket_t *)data;
     connection_t *c = (connection_t *)s->udata;
@@ -460,6 +554,13 @@ HOOK_FUNCTION(ircd_connection_datahook) {
 
         if (ret == IRCD_CONNECTION_CLOSED)
             return NULL; /* nothing to do... */
+
+        /* the class may want a bigger buffer than the protocol does, so
+         * that more can be read at once (this is mostly for servers). */
+        if (c->bufsize < (size_t)c->cls->bufsize) {
+            c->buf = realloc(c->buf, c->cls->bufsize);
+            c->bufsize = c->cls->bufsize;
+        }
     }
 
     if (SOCKET_WRITE(s))
@@ -491,31 +592,15 @@ HOOK_FUNCTION(ircd_connection_datahook) {
 HOOK_FUNCTION(ircd_writer_hook) {
     connection_t *cp, *cp2;
 
-    /* handle sendqs for each of our three connection stages, in order */
-    cp = LIST_FIRST(ircd.connections.stage1);
-    while (cp != NULL) {
-        cp2 = LIST_NEXT(cp, lp);
-        sendq_flush(cp);
-        cp = cp2;
-    }
-    cp = LIST_FIRST(ircd.connections.stage2);
-    while (cp != NULL) {
-        cp2 = LIST_NEXT(cp, lp);
-        sendq_flush(cp);
-        cp = cp2;
-    }
-    cp = LIST_FIRST(ircd.connections.clients);
-    while (cp != NULL) {
-        cp2 = LIST_NEXT(cp, lp);
-        sendq_flush(cp);
-        cp = cp2;
-    }
-
-    /* servers too */
-    cp = LIST_FIRST(ircd.connections.servers);
+    /* only connections with something to send are on the writers list, and
+     * sendq_pop() takes them off again once they've been drained. */
+    cp = LIST_FIRST(ircd.connections.writers);
     while (cp != NULL) {
-        cp2 = LIST_NEXT(cp, lp);
-        sendq_flush(cp);
+        cp2 = LIST_NEXT(cp, wlp);
+        /* servers we are bursting to get the next part of the burst once
+         * they've taken in enough of the last one */
+        if (sendq_flush(cp) && cp->srv != NULL && cp->srv->burst != NULL)
+            server_burst(cp->srv);
         cp = cp2;
     }
 
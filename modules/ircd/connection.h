@@ -36,6 +36,8 @@ struct connection {
 
     time_t  signon;                 /* time of connection (not registration) */
     time_t  last;                   /* last update to this item */
+    timer_ref_t ping_timer;         /* our ping/timeout check timer, see
+                                       connection_ping_schedule() */
     int     flood;                  /* flood level (clients only) */
 
     struct {
@@ -50,6 +52,11 @@ struct connection {
 #define IRCD_CONNFL_DNS            (IRCD_CONNFL_DNS_PTR | IRCD_CONNFL_DNS_ADDR)
 #define IRCD_CONNFL_IDENT           0x4
 #define IRCD_CONNFL_STAGE2          0x8
+#define IRCD_CONNFL_STAGE3          0x10 /* set once the connection has
+                                            registered as a client or
+                                            server */
+#define IRCD_CONNFL_WRITER          0x20 /* set while the connection is on
+                                            the writers list */
 #define IRCD_CONN_DONE(x)                                                     \
     (((x)->flags & (IRCD_CONNFL_DNS | IRCD_CONNFL_IDENT)) ==                  \
      (IRCD_CONNFL_DNS | IRCD_CONNFL_IDENT))
@@ -64,8 +71,9 @@ struct connection {
                                              observe send queue limits on the
                                              connection (mostly useful for
                                              sending synchronization data to
-                                             servers).  it is not unset until
-                                             sendq drops to 0. */
+                                             servers).  it is set for the
+                                             whole of a server's burst, and
+                                             unset once it has synched. */
 #ifdef HAVE_OPENSSL
 #define IRCD_CONNFL_SSLINIT         0x800 /* set when we're waiting for the
                                              first data event for an initiating
@@ -77,13 +85,20 @@ struct connection {
                                              buffer are 'dirty' (typically
                                              an overflow command which must
                                              be discarded) */
+#define IRCD_CONNFL_SENDQEXCEEDED  0x2000 /* set when something could not be
+                                             queued because the connection
+                                             was over its sendq limit.  the
+                                             connection is dropped the next
+                                             time it is flushed. */
 
     int     flags;                  /* connection flags (DO NOT PUT
                                        CLIENT/SERVER FLAGS HERE) */
 
     int     sendq_items;            /* items on the send queue */
-    STAILQ_HEAD(, sendq_item) sendq;/* and te queue itself */
+    size_t  sendq_bytes;            /* bytes waiting in the send queue */
+    STAILQ_HEAD(sendq_list, sendq_item) sendq; /* and te queue itself */
     LIST_ENTRY(connection) lp;
+    LIST_ENTRY(connection) wlp;     /* entry in ircd.connections.writers */
 };
 
 void set_connection_protocol(connection_t *, protocol_t *);
@@ -91,10 +106,12 @@ void clear_connection_objects(connection_t *);
 void destroy_connection(connection_t *, char *);
 int close_unknown_connections(char *);
 int sendq_flush(connection_t *);
+void connection_ping_schedule(connection_t *);
 
 HOOK_FUNCTION(connection_lookup_hook);
 HOOK_FUNCTION(connection_ident_hook);
 HOOK_FUNCTION(ircd_connection_datahook);
+HOOK_FUNCTION(connection_ping_hook);
 HOOK_FUNCTION(ircd_writer_hook);
 
 #endif
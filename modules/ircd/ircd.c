@@ -33,85 +33,16 @@ struct ircd_struct ircd;
 union cptr_u cptr;
 server_t *sptr;
 
-/* the 'timer fuzz' is the fuzziness of the ircd timer hook.  this is the
- * number of seconds between each execution of the timer hook.  the reason you
- * might not want to run the timer hook at every pass (or second) is because it
- * mostly performs timeouts and other reaping of resources, and on a small
- * server the usage isn't as critical.  on large servers every second can mean
- * tens or even hundreds of timeouts and resource regains. */
-#define TIMER_FUZZ_LOW 15
-#define TIMER_FUZZ_LOWCNT 512
-#define TIMER_FUZZ_MED 10
-#define TIMER_FUZZ_MEDCNT 2048
-#define TIMER_FUZZ_HIGH 5
-static time_t timer_fuzz = TIMER_FUZZ_LOW;
+/* the ircd timer hook only handles autoconnects now, ping timeouts are
+ * handled by each connection's own timer (see connection_ping_schedule()) so
+ * this is never more than a walk over a (short) list of server connect
+ * blocks.  this is the number of seconds between runs. */
+#define IRCD_TIMER_INTERVAL 15
 static timer_ref_t timer_ref;
 
 HOOK_FUNCTION(ircd_timer_hook) {
-    time_t now = me.now;
-    connection_t *cp, *cp2;
     struct server_connect *scp;
-    time_t fuzz;
-
-    /* see if we want to adjust the timer fuzziness this go-round */
-    if (ircd.stats.serv.curclients <= TIMER_FUZZ_LOWCNT)
-        fuzz = TIMER_FUZZ_LOW;
-    else if (ircd.stats.serv.curclients <= TIMER_FUZZ_MEDCNT)
-        fuzz = TIMER_FUZZ_MED;
-    else
-        fuzz = TIMER_FUZZ_HIGH;
-    if (timer_fuzz != fuzz) {
-        timer_fuzz = fuzz;
-        adjust_timer(timer_ref, -1, timer_fuzz);
-    }
-
-    /* time out dead clients in stage2/clients based on their class */
-    cp = LIST_FIRST(ircd.connections.stage2);
-    while (cp != NULL) {
-        cp2 = LIST_NEXT(cp, lp);
-        /* for stage2, drop connections 4x faster than normal, since
-         * connections should *not* sit in a stage2 situation */
-        if ((now - cp->last) > (cp->cls->freq / 4))
-            destroy_connection(cp, "Ping timeout");
-        cp = cp2;
-    }
-
-    cp = LIST_FIRST(ircd.connections.clients);
-    while (cp != NULL) {
-        cp2 = LIST_NEXT(cp, lp);
-        if ((now - cp->last) > cp->cls->freq)
-            destroy_connection(cp, "Ping timeout");
-        /* if 1/2 of the pingfreq time has elapsed, drop them a PING */
-        else if ((now - cp->last) > (int)((float)cp->cls->freq * 0.5) &&
-                !CONN_PINGSENT(cp)) {
-            /* use sendto_one_target here so that there is no prefix added,
-             * apparently most clients balk at the prefix */
-            sendto_one_target(cp->cli, NULL, NULL, NULL, "PING", ":%s",
-                    ircd.me->name);
-            cp->flags |= IRCD_CONNFL_PINGSENT;
-        }
-        cp = cp2;
-    }
-
-    cp = LIST_FIRST(ircd.connections.servers);
-    while (cp != NULL) {
-        cp2 = LIST_NEXT(cp, lp);
-        /* disconnect them. */
-        if ((now - cp->last) > cp->cls->freq)
-            destroy_connection(cp, "Ping timeout");
-        /* if 1/2 of the pingfreq time have elapsed, drop them a PING */
-        else if ((now - cp->last) > (int)((float)cp->cls->freq * 0.5) &&
-                !CONN_PINGSENT(cp)) {
-            /* use sendto_one_from here so that there is no prefix added,
-             * apparently most clients balk at the prefix */
-            sendto_serv_from(cp->srv, NULL, NULL, NULL, "PING", ":%s",
-                    ircd.me->name);
-            cp->flags |= IRCD_CONNFL_PINGSENT;
-        }
-        cp = cp2;
-    }
 
-    /* now check for autoconnects */
     LIST_FOREACH(scp, ircd.lists.server_connects, lp) {
         /* if a connection isn't in progress and it has been long enough since
          * we last connected and the server isn't already on the network, go
@@ -126,6 +57,7 @@ HOOK_FUNCTION(ircd_timer_hook) {
 }
 
 HOOK_FUNCTION(ircd_reload_hook) {
+    connection_t *cp;
 
     /* if the configuration parser fails, we have a bit of a nasty problem.
      * we hope, mostly, that nothing is broken by doing this. */
@@ -137,6 +69,15 @@ HOOK_FUNCTION(ircd_reload_hook) {
     free(ircd.sends);
     ircd.sends = malloc(sizeof(char) * maxsockets);
 
+    /* class ping frequencies may have changed, so re-figure everyone's ping
+     * timer */
+    LIST_FOREACH(cp, ircd.connections.stage2, lp)
+        connection_ping_schedule(cp);
+    LIST_FOREACH(cp, ircd.connections.clients, lp)
+        connection_ping_schedule(cp);
+    LIST_FOREACH(cp, ircd.connections.servers, lp)
+        connection_ping_schedule(cp);
+
     return NULL;
 }
 
@@ -256,12 +197,14 @@ MODULE_LOADER(ircd) {
     get_module_savedata(savelist, "ircd.network_full", ircd.network_full);
     get_module_savedata(savelist, "ircd.statsfile", ircd.statsfile);
     get_module_savedata(savelist, "ircd.started", &ircd.started);
+    get_module_savedata(savelist, "ircd.serial", &ircd.serial);
     if (!get_module_savedata(savelist, "ircd.connections",
                 &ircd.connections)) {
         LIST_ALLOC(ircd.connections.stage1);
         LIST_ALLOC(ircd.connections.stage2);
         LIST_ALLOC(ircd.connections.clients);
         LIST_ALLOC(ircd.connections.servers);
+        LIST_ALLOC(ircd.connections.writers);
     }
     if (!get_module_savedata(savelist, "ircd.lists", &ircd.lists)) {
         LIST_ALLOC(ircd.lists.listeners);
@@ -365,6 +308,7 @@ MODULE_LOADER(ircd) {
         ircd.events.register_client = create_event(EVENT_FL_NORETURN);
         ircd.events.unregister_client = create_event(EVENT_FL_NORETURN);
         ircd.events.client_nick = create_event(EVENT_FL_NORETURN);
+        ircd.events.client_host = create_event(EVENT_FL_NORETURN);
         ircd.events.client_oper = create_event(EVENT_FL_NORETURN);
         ircd.events.client_deoper = create_event(EVENT_FL_NORETURN);
         ircd.events.channel_create = create_event(EVENT_FL_NORETURN);
@@ -382,8 +326,8 @@ MODULE_LOADER(ircd) {
     }
     ircd.events.started = create_event(EVENT_FL_HOOKONCE);
 
-    /* grab the timer hook to see if connections have timed out */
-    timer_ref = create_timer(-1, timer_fuzz, ircd_timer_hook, NULL);
+    /* grab the timer hook to handle autoconnects */
+    timer_ref = create_timer(-1, IRCD_TIMER_INTERVAL, ircd_timer_hook, NULL);
     /* grab the 'afterpoll' hook to do write-outs */
     add_hook(me.events.afterpoll, ircd_writer_hook);
     /* grab reload events */
@@ -456,6 +400,9 @@ MODULE_LOADER(ircd) {
         CMSG("771", "%s :%s");
     }
         
+    if (!get_module_savedata(savelist, "ircd.heaps", &ircd.heaps))
+        sendq_create_heaps();
+
     if (!get_module_savedata(savelist, "ircd.hashes", &ircd.hashes)) {
         EXPORT_SYM(nickcmp);
         EXPORT_SYM(chancmp);
@@ -484,10 +431,14 @@ MODULE_LOADER(ircd) {
     }
 
     if (reload) {
-        LIST_FOREACH(cp, ircd.connections.clients, lp)
+        LIST_FOREACH(cp, ircd.connections.clients, lp) {
             add_hook(cp->sock->datahook, ircd_connection_datahook);
-        LIST_FOREACH(cp, ircd.connections.servers, lp)
+            connection_ping_schedule(cp);
+        }
+        LIST_FOREACH(cp, ircd.connections.servers, lp) {
             add_hook(cp->sock->datahook, ircd_connection_datahook);
+            connection_ping_schedule(cp);
+        }
         LIST_FOREACH(isp, ircd.lists.listeners, lp)
             add_hook(isp->datahook, ircd_listen_hook);
     }
@@ -553,9 +504,12 @@ MODULE_UNLOADER(ircd) {
     cp = LIST_FIRST(ircd.connections.clients);
     while (cp != NULL) {
         cp2 = LIST_NEXT(cp, lp);
-        if (reload)
+        if (reload) {
             remove_hook(cp->sock->datahook, ircd_connection_datahook);
-        else {
+            /* the timer callback is going away with us */
+            destroy_timer(cp->ping_timer);
+            cp->ping_timer = TIMER_INVALID;
+        } else {
             cp->cli->flags |= IRCD_CLIENT_KILLED;
             destroy_connection(cp, "module unloaded");
         }
@@ -564,9 +518,11 @@ MODULE_UNLOADER(ircd) {
     cp = LIST_FIRST(ircd.connections.servers);
     while (cp != NULL) {
         cp2 = LIST_NEXT(cp, lp);
-        if (reload)
+        if (reload) {
             remove_hook(cp->sock->datahook, ircd_connection_datahook);
-        else
+            destroy_timer(cp->ping_timer);
+            cp->ping_timer = TIMER_INVALID;
+        } else
             destroy_connection(cp, "module unloaded");
         cp = cp2;
     }
@@ -604,6 +560,8 @@ MODULE_UNLOADER(ircd) {
                 ircd.statsfile);
         add_module_savedata(savelist, "ircd.started", sizeof(ircd.started),
                 &ircd.started);
+        add_module_savedata(savelist, "ircd.serial", sizeof(ircd.serial),
+                &ircd.serial);
         add_module_savedata(savelist, "ircd.ascstart", sizeof(ircd.ascstart),
                 ircd.ascstart);
         add_module_savedata(savelist, "ircd.stats", sizeof(ircd.stats),
@@ -620,6 +578,8 @@ MODULE_UNLOADER(ircd) {
                 sizeof(ircd.connections), &ircd.connections);
         add_module_savedata(savelist, "ircd.hashes", sizeof(ircd.hashes),
                 &ircd.hashes);
+        add_module_savedata(savelist, "ircd.heaps", sizeof(ircd.heaps),
+                &ircd.heaps);
         add_module_savedata(savelist, "ircd.mdext", sizeof(ircd.mdext),
                 &ircd.mdext);
         add_module_savedata(savelist, "ircd.maps", sizeof(ircd.maps),
@@ -645,6 +605,7 @@ MODULE_UNLOADER(ircd) {
         destroy_event(ircd.events.register_client);
         destroy_event(ircd.events.unregister_client);
         destroy_event(ircd.events.client_nick);
+        destroy_event(ircd.events.client_host);
         destroy_event(ircd.events.channel_create);
         destroy_event(ircd.events.channel_destroy);
         destroy_event(ircd.events.channel_add);
@@ -662,11 +623,14 @@ MODULE_UNLOADER(ircd) {
         destroy_hash_table(ircd.hashes.command);
         destroy_hash_table(ircd.hashes.channel);
 
+        sendq_destroy_heaps();
+
         /* And lists... */
         LIST_FREE(ircd.connections.stage1);
         LIST_FREE(ircd.connections.stage2);
         LIST_FREE(ircd.connections.clients);
         LIST_FREE(ircd.connections.servers);
+        LIST_FREE(ircd.connections.writers);
 
         LIST_FREE(ircd.lists.listeners);
         LIST_FREE(ircd.lists.servers);
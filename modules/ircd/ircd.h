@@ -83,6 +83,12 @@ extern struct ircd_struct {
      * anyways, again, is this a hack or the best way? */
     char    *sends;
 
+    /* every client, server, channel and channel membership is stamped with
+     * the next value of this counter when it is created.  server bursts use
+     * it to tell what already existed when they started (see
+     * server_burst()). */
+    uint64_t serial;
+
     struct {
         struct {
             int            curclients;        /* network-wide current/max clients */
@@ -140,6 +146,9 @@ extern struct ircd_struct {
         struct        chanmode *pfxmap[256];        /* map to chanmodes from their
                                            prefixes.  useful for fast lookups
                                            and such. */
+        unsigned char pfxtab[CHANMODE_PFXTAB_SIZE][18]; /* the prefixes for
+                                           each set of chanlink flags, see
+                                           chanlink_prefixes() */
     } cmodes;
 
     struct {
@@ -164,6 +173,8 @@ extern struct ircd_struct {
                                        clients being destroyed */
         event_t *client_nick;            /* hooked when a client changes its
                                        nickname. */
+        event_t *client_host;            /* hooked when a client's hostname
+                                       is changed (masked, crypted..) */
         event_t *client_oper;            /* hooked when a client goes +o */
         event_t *client_deoper;            /* hooked when a client goes -o */
         event_t *channel_create;    /* hooked when a channel record is
@@ -207,6 +218,10 @@ extern struct ircd_struct {
         /* server connections are here, so they aren't handled with client
          * connections (which are (assumed)stages 1/2, and (known) stage3) */
         LIST_HEAD(, connection) *servers;
+
+        /* connections (of any stage) which have something in their sendq.
+         * the writer only has to look at these. */
+        LIST_HEAD(, connection) *writers;
     } connections;
 
     /* things in here define the size of their respective hashes */
@@ -217,6 +232,13 @@ extern struct ircd_struct {
         hashtable_t *channel;
     } hashes;
 
+    /* heaps for sendq items and blocks, see send.c */
+    struct {
+        heap_t *sendq_item;
+        heap_t *sendq_block[SENDQ_BLOCK_HEAPS];
+        heap_t *sendq_chunk;
+    } heaps;
+
     struct {
         struct mdext_header *channel;
         struct mdext_header *class;
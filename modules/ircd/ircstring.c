@@ -108,13 +108,19 @@ int istr_okay(unsigned char map[256], const unsigned char *string) {
     return 1;
 }
 
+/* the strings compared are usually the same byte-for-byte (hash lookups
+ * only compare keys which hashed the same), so the map is only consulted
+ * where the bytes differ. */
 int istrcmp(unsigned char map[256], const unsigned char *one,
         const unsigned char *two) {
-    while (map[*one] == map[*two++])
-        if (*one++ == '\0')
+    while (*one == *two || map[*one] == map[*two]) {
+        if (*one == '\0')
             return 0;
+        one++;
+        two++;
+    }
 
-    return (*one - *(two - 1));
+    return (*one - *two);
 }
 
 int istrncmp(unsigned char map[256], const unsigned char *one,
@@ -123,10 +129,12 @@ int istrncmp(unsigned char map[256], const unsigned char *one,
         return 0;
 
     do {
-        if (map[*one] != map[*two++])
-            return (*one - *(two - 1));
-        if (*one++ == '\0')
+        if (*one != *two && map[*one] != map[*two])
+            return (*one - *two);
+        if (*one == '\0')
             break;
+        one++;
+        two++;
     } while (--len != 0);
 
     return 0;
@@ -25,7 +25,7 @@ uint64_t protocol_flags = PROTOCOL_SFL_SJOIN | PROTOCOL_SFL_NOQUIT |
     PROTOCOL_SFL_TSMODE | PROTOCOL_SFL_TS;
 
 /* parser for packets */
-static int packet_parse(connection_t *cp);
+static int packet_parse(connection_t *, char *);
 void setup(connection_t *);
 void register_user(connection_t *, client_t *);
 void sync_channel(connection_t *, channel_t *);
@@ -47,17 +47,17 @@ MODULE_UNLOADER(bahamut14) {
 
 #include "shared/rfc1459_io.c"
 
-/* now parse buf.  buf should either be:
+/* now parse line.  line should either be:
  * :prefix COMMAND arg1 arg2 arg3 ... :last arg[\r]\n
  * or:
  * COMMAND arg1 arg2 arg3 ... :last arg[\r]\n */
-static int packet_parse(connection_t *cp) {
+static int packet_parse(connection_t *cp, char *line) {
     char *s, *s2;
     int i;
     int client = 0;
 
     sptr = cp->srv; /* originates from this server */
-    s = cp->buf;
+    s = line;
     cp->stats.precv++;
     if (*s == ':') {
         s++;
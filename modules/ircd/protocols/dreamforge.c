@@ -24,7 +24,7 @@ MODULE_REGISTER("$Rev: 703 $");
 uint64_t protocol_flags = PROTOCOL_SFL_SHORTAKILL;
 
 /* parser for packets */
-static int packet_parse(connection_t *cp);
+static int packet_parse(connection_t *, char *);
 void setup(connection_t *);
 void register_user(connection_t *, client_t *);
 void sync_channel(connection_t *, channel_t *);
@@ -46,17 +46,17 @@ MODULE_UNLOADER(dreamforge) {
 
 #include "shared/rfc1459_io.c"
 
-/* now parse buf.  buf should either be:
+/* now parse line.  line should either be:
  * :prefix COMMAND arg1 arg2 arg3 ... :last arg[\r]\n
  * or:
  * COMMAND arg1 arg2 arg3 ... :last arg[\r]\n */
-static int packet_parse(connection_t *cp) {
+static int packet_parse(connection_t *cp, char *line) {
     char *s, *s2;
     int i;
     int client = 0;
 
     sptr = cp->srv; /* originates from this server */
-    s = cp->buf;
+    s = line;
     cp->stats.precv++;
     if (*s == ':') {
         s++;
@@ -163,8 +163,9 @@ void sync_channel(connection_t *conn, channel_t *chan) {
 
     /* send a JOIN for each client */
     LIST_FOREACH(clp, &chan->users, lpchan) {
-        if (cli_uplink(clp->cli) == conn)
-            continue; /* move along */
+        if (cli_uplink(clp->cli) == conn ||
+                SERVER_BURST_SKIP(conn->srv, clp))
+            continue; /* move along (or added after the burst began) */
 
         sendto_serv_from(conn->srv, clp->cli, NULL, chan->name, "JOIN", NULL);
     }
@@ -183,7 +184,8 @@ void sync_channel(connection_t *conn, channel_t *chan) {
             /* a prefix-type mode, walk the channel users list and see who has
              * this mode, then send along the buffer! */
             LIST_FOREACH(clp, &chan->users, lpchan) {
-                if (cli_uplink(clp->cli) == conn)
+                if (cli_uplink(clp->cli) == conn ||
+                        SERVER_BURST_SKIP(conn->srv, clp))
                     continue;
 
                 if (chanlink_ismode(clp, *s)) {
@@ -19,17 +19,17 @@ MODULE_REGISTER("$Rev: 818 $");
 */
 
 /* parser for packets */
-static int packet_parse(connection_t *cp);
+static int packet_parse(connection_t *, char *);
 void setup(connection_t *);
 
 #define RFC1459_SEND_MSG_LONG
 #include "shared/rfc1459_io.c"
 
-/* now parse buf.  buf should either be:
+/* now parse line.  line should either be:
  * :prefix COMMAND arg1 arg2 arg3 ... :last arg[\r]\n
  * or:
  * COMMAND arg1 arg2 arg3 ... :last arg[\r]\n */
-static int packet_parse(connection_t *cp) {
+static int packet_parse(connection_t *cp, char *line) {
     char *s, *s2;
     int i;
 
@@ -37,7 +37,7 @@ static int packet_parse(connection_t *cp) {
     cptr.cli = cp->cli;
     sptr = ircd.me;
 
-    s = cp->buf;
+    s = line;
     cp->stats.precv++;
 
     /* devour leading whitespace */
@@ -15,17 +15,22 @@ HOOK_FUNCTION(input);
 struct send_msg *output(struct protocol_sender *, char *, char *, char *,
         va_list);
 
-/* input as much data as we can from the user. */
+/* input as much data as we can from the user.  lines are parsed straight
+ * out of the buffer by walking a cursor along it, and whatever partial line
+ * is left over is moved to the front of the buffer once, when we are done
+ * with everything the last read gave us.  the buffer may be larger than
+ * MAX_PACKET_LEN (see the read-buffer class option), but lines are still
+ * limited to that length. */
 HOOK_FUNCTION(input) {
     isocket_t *sp = (isocket_t *)data;
     connection_t *cp = (connection_t *)sp->udata;
     int ret = 0;
-    char *s;
+    char *line, *end, *s;
     bool dirtybuffer;
 
     /* If we were force-called (ep is NULL) we assume there is data in our
      * buffer.  Jump into the loop. */
-    if ((ep == NULL && cp->buflen != 0) || (cp->buflen == cp->bufsize))
+    if (ep == NULL && cp->buflen != 0)
         goto loop_entrance;
 
     while ((ret = socket_read(sp, cp->buf + cp->buflen,
@@ -34,69 +39,59 @@ loop_entrance:
         cp->buflen += ret;
         cp->stats.recv += ret;
 
-        while (cp->buflen > 0) {
+        line = cp->buf;
+        end = cp->buf + cp->buflen;
+        while (line < end) {
             dirtybuffer = false;
-            /* if the buffer is full but no terminating character (\n) is
-               found, we cheat */
-            if (cp->buflen == cp->bufsize) {
-                /* actually, we might have lots of commands in here, try to
-                 * find a \n without overruning the buffer.  If we do, sally
-                 * forth undeterred, if we don't, trim the message */
-                s = cp->buf;
-                while (s < cp->buf + cp->bufsize && *s != '\n')
-                    s++;
-
-                /* A command without a newline, add it and note that the
-                 * future contents of the buffer are dirty (handled below
-                 * when we pass out the data) */
-                if (s == cp->buf + cp->bufsize) {
-                    cp->buf[cp->bufsize - 1] = '\n';
-                    s = cp->buf + cp->bufsize - 1;
-                    dirtybuffer = true;
-                }
-            } else {
-                cp->buf[cp->buflen] = '\0';
-                s = strchr(cp->buf, '\n');
-                if (s == NULL)
-                    break; /* no separator found, try reading some more */
-            }
+            s = memchr(line, '\n', end - line);
+            /* if the line is too long we cheat: cut it off at the maximum
+             * length and note that the rest of it is dirty (handled below
+             * when we pass out the data) */
+            if ((s == NULL && end - line >= MAX_PACKET_LEN) ||
+                    (s != NULL && s - line >= MAX_PACKET_LEN)) {
+                s = line + MAX_PACKET_LEN - 1;
+                dirtybuffer = true;
+            } else if (s == NULL)
+                break; /* no separator found, try reading some more */
 
             /* null-terminate and get rid of the [\r]\n sequence. */
-            if (s > cp->buf && *(s - 1) == '\r')
+            if (s > line && *(s - 1) == '\r')
                 *(s - 1) = '\0';
             else
                 *s = '\0';
 
             log_debug("[%s] <%s< %s", ircd.me->name,
                     (cp->cli != NULL ? cp->cli->nick :
-                     (cp->srv != NULL ? cp->srv->name : "")), cp->buf);
+                     (cp->srv != NULL ? cp->srv->name : "")), line);
             /* Don't parse the packet if the buffer is dirty, otherwise do
              * call the parser. */
             if (!(cp->flags & IRCD_CONNFL_DIRTYBUFFER))
             {
-                if ((ret = packet_parse(cp)) == IRCD_CONNECTION_CLOSED)
+                if ((ret = packet_parse(cp, line)) == IRCD_CONNECTION_CLOSED)
                     return (void *)ret; /* connection closed, stop immediately */
             } else
                 cp->flags &= ~IRCD_CONNFL_DIRTYBUFFER;
 
-            s++; /* increment s, now we see if our packet contains more data */
-            if (s - cp->buf < cp->buflen) {
-                cp->buflen -= s - cp->buf;
-                memmove(cp->buf, s, cp->buflen);
-                cp->buf[cp->buflen] = '\0';
-            } else {
-                cp->buflen = 0; /* all done here! */
-                *cp->buf = '\0'; /* zero it out */
-            }
+            line = s + 1; /* now we see if our packet contains more data */
 
             /* If the buffer is marked dirty, set the flag now on the
              * connection (since we have passed off the previous command) */
             if (dirtybuffer)
                 cp->flags |= IRCD_CONNFL_DIRTYBUFFER;
 
-            if (ret == IRCD_PROTOCOL_CHANGED)
+            if (ret == IRCD_PROTOCOL_CHANGED) {
+                /* the new protocol expects to find the rest of the data at
+                 * the front of the buffer. */
+                cp->buflen = end - line;
+                memmove(cp->buf, line, cp->buflen);
                 return (void *)ret;
+            }
         }
+
+        /* move whatever is left to the front of the buffer. */
+        cp->buflen = end - line;
+        if (cp->buflen > 0 && line != cp->buf)
+            memmove(cp->buf, line, cp->buflen);
     }
 
     /* if there are any errors they will be picked up elsewhere */
@@ -7,17 +7,34 @@
  * files with respect to protocol line lengths)
  */
 
+/* the lines sent here are put together by hand and queued with sendto(),
+ * instead of going through output(), since a burst sends a great many of
+ * them.  this sends off a MODE line for the modes/arguments in 'modes' and
+ * 'args'. */
+static void sync_channel_modes(connection_t *conn, channel_t *chan,
+        char *modes, char *args) {
+    char line[MAX_PACKET_LEN];
+    int len;
+
+    len = snprintf(line, MAX_PACKET_LEN - 2, ":%s MODE %s %ld %s %s",
+            ircd.me->name, chan->name, (long)chan->created, modes, args);
+    if (len > MAX_PACKET_LEN - 3)
+        len = MAX_PACKET_LEN - 3;
+    line[len++] = '\r';
+    line[len++] = '\n';
+    sendto(conn, line, len);
+}
+
 /* syncing channels is quite the pain as well.  this routine is really bloated
  * and complicated, mainly because channels just have a lot of data. */
 void sync_channel(connection_t *conn, channel_t *chan) {
     struct chanlink *clp;
     char modes[64], *m;
     char buf[BUF_SIZE]; /* hope this doesn't get overrun ;) */
-    unsigned char *s;
+    char line[MAX_PACKET_LEN];
+    unsigned char *s, *pfx;
     int optused;
-    int len, cnt;
-    int sjs; /* set to 1 when we've sent the initial (moded) SJOIN for each
-                channel. */
+    int len, hlen, cnt;
     void *state; /* state for chanmode_query */
 
     /* send an SJOIN for each channel.  this can be very irritating for
@@ -27,42 +44,39 @@ void sync_channel(connection_t *conn, channel_t *chan) {
      * make sure we only send for nicks that are on *our* side.  if we've
      * parsed SJOINs before, we can't verywell be sending back their users!
      * so we borrow the *_uplink functions from send.c to see where each
-     * person comes from. */
-
-    sjs = 0;
-    len = 0;
+     * person comes from.  every line starts the same way, so the start is
+     * made once and the nicks (and their prefixes, from the table kept for
+     * chanlink flags) are copied in after it. */
+    hlen = snprintf(line, MAX_PACKET_LEN, ":%s SJOIN %ld %s + :",
+            ircd.me->name, (long)chan->created, chan->name);
+    if (hlen + BUF_SIZE + 2 > MAX_PACKET_LEN)
+        hlen = MAX_PACKET_LEN - BUF_SIZE - 2; /* can't happen.. */
+    len = hlen;
     LIST_FOREACH(clp, &chan->users, lpchan) {
-        if (cli_uplink(clp->cli) == conn)
-            continue; /* move along */
+        if (cli_uplink(clp->cli) == conn ||
+                SERVER_BURST_SKIP(conn->srv, clp))
+            continue; /* move along (or added after the burst began) */
 
-        /* the '20' is the number of possible prefixes (16) plus some extra
-         * space for spaces and junk */
-        if (BUF_SIZE - len <= ircd.limits.nicklen + 20) {
-            /* if our buffer might be full, send this off. */
-            if (sjs)
-                sendto_serv(conn->srv, "SJOIN", "%d %s + :%s", chan->created,
-                        chan->name, buf);
-            else {
-                sendto_serv(conn->srv, "SJOIN", "%d %s + :%s", chan->created,
-                        chan->name, buf);
-                sjs = 1;
-            }
-
-            len = 0;
+        pfx = chanlink_prefixes(clp);
+        if (len - hlen + *pfx + clp->cli->nicklen + 1 > BUF_SIZE) {
+            /* if our buffer is full, send this off.  the last space is
+             * replaced by the line ending */
+            line[len - 1] = '\r';
+            line[len++] = '\n';
+            sendto(conn, line, len);
+            len = hlen;
         }
-        len += sprintf(&buf[len], "%s%s ",
-                chanmode_getprefixes(chan, clp->cli), clp->cli->nick);
+        memcpy(line + len, pfx + 1, *pfx);
+        len += *pfx;
+        memcpy(line + len, clp->cli->nick, clp->cli->nicklen);
+        len += clp->cli->nicklen;
+        line[len++] = ' ';
     }
     /* leftovers? do the send here too */
-    if (len) {
-        if (sjs)
-            sendto_serv(conn->srv, "SJOIN", "%d %s + :%s", chan->created,
-                    chan->name, buf);
-        else {
-            sendto_serv(conn->srv, "SJOIN", "%d %s + :%s", chan->created,
-                    chan->name, buf);
-            sjs = 1;
-        }
+    if (len > hlen) {
+        line[len - 1] = '\r';
+        line[len++] = '\n';
+        sendto(conn, line, len);
     }
     /* now send modes.  this code is based somewhat on the reset code in
      * commands/mode.c */
@@ -82,8 +96,7 @@ void sync_channel(connection_t *conn, channel_t *chan) {
             if (optused < 0) {
                 /* no space.. send what we have and try again */
                 *m = '\0';
-                sendto_serv(conn->srv, "MODE", "%s %d %s %s", chan->name,
-                        chan->created, modes, buf);
+                sync_channel_modes(conn, chan, modes, buf);
                 m = modes + 1;
                 len = cnt = 0;
                 *buf = '\0';
@@ -99,8 +112,7 @@ void sync_channel(connection_t *conn, channel_t *chan) {
             }
             if (cnt == 6) {
                 *m = '\0';
-                sendto_serv(conn->srv, "MODE", "%s %d %s %s", chan->name,
-                        chan->created, modes, buf);
+                sync_channel_modes(conn, chan, modes, buf);
                 m = modes + 1;
                 len = cnt = 0;
                 *buf = '\0';
@@ -113,8 +125,7 @@ void sync_channel(connection_t *conn, channel_t *chan) {
     /* send off any spares. */
     if (cnt) {
         *m = '\0';
-        sendto_serv(conn->srv, "MODE", "%s %d %s %s", chan->name,
-                chan->created, modes, buf);
+        sync_channel_modes(conn, chan, modes, buf);
     }
 }
 
@@ -35,12 +35,53 @@ static inline void sendto_common(connection_t *cp, client_t *cli,
  * to use the functions provided below, and won't run into the middleman
  * structure (sendq_item) much at all. */
 
+static const int sendq_block_sizes[SENDQ_BLOCK_HEAPS] = SENDQ_BLOCK_SIZES;
+
+/* these create and destroy the sendq heaps.  they are called when the ircd
+ * module is loaded and unloaded (but not across reloads) */
+void sendq_create_heaps(void) {
+    char name[32];
+    int i;
+
+    ircd.heaps.sendq_item = create_heap(sizeof(struct sendq_item), 1024,
+            "sendq_item");
+    for (i = 0;i < SENDQ_BLOCK_HEAPS;i++) {
+        snprintf(name, 32, "sendq_block/%d", sendq_block_sizes[i]);
+        ircd.heaps.sendq_block[i] = create_heap(sizeof(struct sendq_block) +
+                sendq_block_sizes[i], 256, name);
+    }
+    ircd.heaps.sendq_chunk = create_heap(sizeof(struct sendq_block) +
+            SENDQ_CHUNK_SIZE, 16, "sendq_chunk");
+}
+
+void sendq_destroy_heaps(void) {
+    int i;
+
+    destroy_heap(ircd.heaps.sendq_item);
+    for (i = 0;i < SENDQ_BLOCK_HEAPS;i++)
+        destroy_heap(ircd.heaps.sendq_block[i]);
+    destroy_heap(ircd.heaps.sendq_chunk);
+}
+
 /* create a new sendq block.  this creates a block with zero references, and
  * the given message and length */
 struct sendq_block *create_sendq_block(char *msg, int len) {
-    struct sendq_block *bp = malloc(sizeof(struct sendq_block));
+    struct sendq_block *bp;
+    int i;
 
-    bp->msg = malloc(len);
+    for (i = 0;i < SENDQ_BLOCK_HEAPS;i++) {
+        if (len <= sendq_block_sizes[i])
+            break;
+    }
+    if (i < SENDQ_BLOCK_HEAPS) {
+        bp = heap_alloc(ircd.heaps.sendq_block[i]);
+        bp->heap = ircd.heaps.sendq_block[i];
+    } else {
+        bp = malloc(sizeof(struct sendq_block) + len);
+        bp->heap = NULL;
+    }
+
+    bp->msg = (char *)(bp + 1);
     bp->len = len;
     bp->refs = 0;
 
@@ -49,38 +90,125 @@ struct sendq_block *create_sendq_block(char *msg, int len) {
     return bp;
 }
 
+void free_sendq_block(struct sendq_block *bp) {
+
+    if (bp->heap != NULL)
+        heap_free(bp->heap, bp);
+    else
+        free(bp);
+}
+
 /* these allow you to add/remove sendq blocks. push adds the given block to
  * the end of the list and increments ref.  pop takes off the first item
  * (make sure you are done with it!), decrements ref, and if ref is zero,
- * does the various freeing necessary */
+ * does the various freeing necessary.  held messages are only counted in
+ * the burst's held_bytes until server_burst() lets them go. */
 void sendq_push(struct sendq_block *bp, connection_t *cp) {
-    struct sendq_item *sip = malloc(sizeof(struct sendq_item));
+    struct sendq_item *sip = heap_alloc(ircd.heaps.sendq_item);
+    struct sendq_list *sqp = &cp->sendq;
     sip->block = bp;
     sip->offset = 0;
 
+    if (SENDQ_HELD(cp)) {
+        sqp = &cp->srv->burst->held;
+        cp->srv->burst->held_bytes += bp->len;
+    } else
+        SENDQ_ADD_BYTES(cp, bp->len);
     bp->refs++;
-    if (STAILQ_FIRST(&cp->sendq) == NULL)
-        STAILQ_INSERT_HEAD(&cp->sendq, sip, lp);
+    if (STAILQ_FIRST(sqp) == NULL)
+        STAILQ_INSERT_HEAD(sqp, sip, lp);
     else
-        STAILQ_INSERT_TAIL(&cp->sendq, sip, lp);
+        STAILQ_INSERT_TAIL(sqp, sip, lp);
 
     cp->sendq_items++;
+    if (!(cp->flags & IRCD_CONNFL_WRITER)) {
+        LIST_INSERT_HEAD(ircd.connections.writers, cp, wlp);
+        cp->flags |= IRCD_CONNFL_WRITER;
+    }
 }
 /* this will almost certainly result in a core if sendq_pop is called when
- * there is no sendq.  assume this risk at the benefit of speed */
+ * there is no sendq.  assume this risk at the benefit of speed.  once the
+ * sendq is empty the connection is taken off the writers list, unless we
+ * are bursting to it, in which case the writer hook still needs to see it. */
 void sendq_pop(connection_t *cp) {
     struct sendq_item *sip = STAILQ_FIRST(&cp->sendq);
     struct sendq_block *bp = sip->block;
 
     STAILQ_REMOVE_HEAD(&cp->sendq, lp); /* remove the first entry */
-    free(sip);
+    SENDQ_SUB_BYTES(cp, bp->len - sip->offset);
+    heap_free(ircd.heaps.sendq_item, sip);
 
     bp->refs--;
-    if (bp->refs == 0) {
-        free(bp->msg);
-        free(bp);
+    if (bp->refs == 0)
+        free_sendq_block(bp);
+    if (--cp->sendq_items == 0 &&
+            (cp->srv == NULL || cp->srv->burst == NULL)) {
+        LIST_REMOVE(cp, wlp);
+        cp->flags &= ~IRCD_CONNFL_WRITER;
+    }
+}
+
+/* this marks a connection which couldn't take a message because it is over
+ * its sendq limit.  the message is lost, so the connection has to go.  it
+ * is dropped by sendq_flush(), which is sure to see it since the
+ * connection is put on the writers list. */
+void sendq_exceeded(connection_t *cp) {
+
+    cp->flags |= IRCD_CONNFL_SENDQEXCEEDED;
+    if (!(cp->flags & IRCD_CONNFL_WRITER)) {
+        LIST_INSERT_HEAD(ircd.connections.writers, cp, wlp);
+        cp->flags |= IRCD_CONNFL_WRITER;
+    }
+}
+
+/* this queues a single message for the connection.  for chunked sendqs short
+ * messages are copied straight into the connection's chunks, otherwise a
+ * new block is made for the message. */
+void sendq_push_msg(connection_t *cp, char *msg, int len) {
+
+    if (SENDQ_FULL(cp) || SENDQ_HELD_FULL(cp, len)) {
+        sendq_exceeded(cp);
+        return;
+    }
+    if (SENDQ_COPY(cp, len))
+        sendq_append(cp, msg, len);
+    else
+        sendq_push(create_sendq_block(msg, len), cp);
+}
+
+/* this copies the given message onto the end of the connection's sendq.  if
+ * the last thing in the sendq is a chunk with enough room the message goes
+ * there, otherwise a new chunk is started.  chunks belong to their
+ * connection and are never shared, so they can keep growing until they are
+ * written out. */
+void sendq_append(connection_t *cp, char *msg, int len) {
+    struct sendq_list *sqp =
+        (SENDQ_HELD(cp) ? &cp->srv->burst->held : &cp->sendq);
+    struct sendq_item *sip = STAILQ_LAST(sqp, sendq_item, lp);
+    struct sendq_block *bp;
+
+    if (len > SENDQ_CHUNK_SIZE) {
+        sendq_push(create_sendq_block(msg, len), cp);
+        return;
     }
-    cp->sendq_items--;
+
+    if (sip == NULL || sip->block->heap != ircd.heaps.sendq_chunk ||
+            sip->block->len + len > SENDQ_CHUNK_SIZE) {
+        bp = heap_alloc(ircd.heaps.sendq_chunk);
+        bp->heap = ircd.heaps.sendq_chunk;
+        bp->msg = (char *)(bp + 1);
+        bp->len = 0;
+        bp->refs = 0;
+        sendq_push(bp, cp);
+    } else
+        bp = sip->block;
+
+    memcpy(bp->msg + bp->len, msg, len);
+    bp->len += len;
+    if (SENDQ_HELD(cp))
+        cp->srv->burst->held_bytes += len;
+    else
+        SENDQ_ADD_BYTES(cp, len);
 }
 
 /*****************************************************************************
@@ -138,16 +266,42 @@ server_t *srv_server_uplink(server_t *srv) {
 }
 
 /* this macro is used below to clear out temporary structures after doing a
- * round of sends. */
+ * round of sends.  cached blocks which were only ever copied into chunked
+ * sendqs are not referenced by anything, and are freed here. */
 #define CLEAR_SEND_TEMPS() do {                                                \
     protocol_t *_pp;                                                        \
     LIST_FOREACH(_pp, ircd.lists.protocols, lp) {                        \
+        if (_pp->tmpmsg != NULL && _pp->tmpmsg->refs == 0)                \
+            free_sendq_block(_pp->tmpmsg);                                \
         _pp->tmpmsg = NULL;                                                \
     }                                                                        \
     memset(ircd.sends, 0, maxsockets);                                        \
 } while (0)
 
-#define CACHE_MSG(proto) (!(proto)->flags & PROTOCOL_MFL_NOCACHE)
+#define CACHE_MSG(proto) (!((proto)->flags & PROTOCOL_MFL_NOCACHE))
+
+/* this is used by the various multi-target send functions below to queue a
+ * message on a connection.  for protocols which allow it the formatted
+ * message is kept in a block which is shared by every connection in that
+ * protocol for the rest of the round (see CLEAR_SEND_TEMPS()). */
+static inline void sendq_push_cached(connection_t *conn, struct send_msg *sm) {
+    protocol_t *pp = conn->proto;
+
+    if (SENDQ_FULL(conn) || SENDQ_HELD_FULL(conn, sm->len)) {
+        sendq_exceeded(conn);
+        return;
+    }
+    if (!CACHE_MSG(pp))
+        sendq_push_msg(conn, sm->msg, sm->len);
+    else {
+        if (pp->tmpmsg == NULL)
+            pp->tmpmsg = create_sendq_block(sm->msg, sm->len);
+        if (SENDQ_COPY(conn, pp->tmpmsg->len))
+            sendq_append(conn, pp->tmpmsg->msg, pp->tmpmsg->len);
+        else
+            sendq_push(pp->tmpmsg, conn);
+    }
+}
 /* this function is used by several consumers, below, to send a message to a
  * single connection without any kind of coalescing involved. */
 static inline void sendto_common(connection_t *cp, client_t *cli,
@@ -237,11 +391,7 @@ void sendto_serv_butone(server_t *one, client_t *cli, server_t *srv, char *to,
             sm = conn->proto->output(&ps, cmd, to, msg, vl);
             va_end(vl);
         }
-        if (CACHE_MSG(conn->proto)) {
-            conn->proto->tmpmsg = create_sendq_block(sm->msg, sm->len);
-            sendq_push(conn->proto->tmpmsg, conn);
-        } else
-            sendq_push(create_sendq_block(sm->msg, sm->len), conn);
+        sendq_push_cached(conn, sm);
     }
 
     CLEAR_SEND_TEMPS();
@@ -270,11 +420,7 @@ void sendto_serv_pflag_butone(uint64_t flag, bool pos, server_t *one,
             sm = conn->proto->output(&ps, cmd, to, msg, vl);
             va_end(vl);
         }
-        if (CACHE_MSG(conn->proto)) {
-            conn->proto->tmpmsg = create_sendq_block(sm->msg, sm->len);
-            sendq_push(conn->proto->tmpmsg, conn);
-        } else
-            sendq_push(create_sendq_block(sm->msg, sm->len), conn);
+        sendq_push_cached(conn, sm);
     }
 
     CLEAR_SEND_TEMPS();
@@ -305,11 +451,7 @@ void sendto_channel(channel_t *chan, client_t *cli, server_t *srv, char *cmd,
             sm = conn->proto->output(&ps, cmd, chan->name, msg, vl);
             va_end(vl);
         }
-        if (CACHE_MSG(conn->proto)) {
-            conn->proto->tmpmsg = create_sendq_block(sm->msg, sm->len);
-            sendq_push(conn->proto->tmpmsg, conn);
-        } else
-            sendq_push(create_sendq_block(sm->msg, sm->len), conn);
+        sendq_push_cached(conn, sm);
     }
 
     CLEAR_SEND_TEMPS();
@@ -340,11 +482,7 @@ void sendto_channel_local(channel_t *chan, client_t *cli, server_t *srv,
             sm = conn->proto->output(&ps, cmd, chan->name, msg, vl);
             va_end(vl);
         }
-        if (CACHE_MSG(conn->proto)) {
-            conn->proto->tmpmsg = create_sendq_block(sm->msg, sm->len);
-            sendq_push(conn->proto->tmpmsg, conn);
-        } else
-            sendq_push(create_sendq_block(sm->msg, sm->len), conn);
+        sendq_push_cached(conn, sm);
     }
 
     CLEAR_SEND_TEMPS();
@@ -379,11 +517,7 @@ void sendto_channel_remote(channel_t *chan, client_t *cli, server_t *srv,
             sm = conn->proto->output(&ps, cmd, chan->name, msg, vl);
             va_end(vl);
         }
-        if (CACHE_MSG(conn->proto)) {
-            conn->proto->tmpmsg = create_sendq_block(sm->msg, sm->len);
-            sendq_push(conn->proto->tmpmsg, conn);
-        } else
-            sendq_push(create_sendq_block(sm->msg, sm->len), conn);
+        sendq_push_cached(conn, sm);
     }
 
     CLEAR_SEND_TEMPS();
@@ -417,11 +551,7 @@ void sendto_channel_butone(channel_t *chan, client_t *one, client_t *cli,
             sm = conn->proto->output(&ps, cmd, chan->name, msg, vl);
             va_end(vl);
         }
-        if (CACHE_MSG(conn->proto)) {
-            conn->proto->tmpmsg = create_sendq_block(sm->msg, sm->len);
-            sendq_push(conn->proto->tmpmsg, conn);
-        } else
-            sendq_push(create_sendq_block(sm->msg, sm->len), conn);
+        sendq_push_cached(conn, sm);
     }
 
     CLEAR_SEND_TEMPS();
@@ -468,11 +598,7 @@ void sendto_channel_prefixes_butone(channel_t *chan, client_t *one,
             sm = conn->proto->output(&ps, cmd, pname, msg, vl);
             va_end(vl);
         }
-        if (CACHE_MSG(conn->proto)) {
-            conn->proto->tmpmsg = create_sendq_block(sm->msg, sm->len);
-            sendq_push(conn->proto->tmpmsg, conn);
-        } else
-            sendq_push(create_sendq_block(sm->msg, sm->len), conn);
+        sendq_push_cached(conn, sm);
     }
 
     CLEAR_SEND_TEMPS();
@@ -527,11 +653,7 @@ void sendto_common_channels(client_t *cli, server_t *srv, char *cmd,
                     sm = conn->proto->output(&ps, cmd, NULL, msg, vl);
                     va_end(vl);
                 }
-                if (CACHE_MSG(conn->proto)) {
-                    conn->proto->tmpmsg = create_sendq_block(sm->msg, sm->len);
-                    sendq_push(conn->proto->tmpmsg, conn);
-                } else
-                    sendq_push(create_sendq_block(sm->msg, sm->len), conn);
+                sendq_push_cached(conn, sm);
             }
         }
     }
@@ -547,6 +669,7 @@ void sendto_match_butone(client_t *one, client_t *cli, server_t *srv,
     struct send_msg *sm = NULL;
     int host = 0; /* 1 if hostmask, 0 if servermask */
     char *pat = mask + 1;
+    matcher_t *mp;
     client_t *cp;
     connection_t *conn;
     va_list vl;
@@ -556,6 +679,7 @@ void sendto_match_butone(client_t *one, client_t *cli, server_t *srv,
         host = 1;
         pat++;
     }
+    mp = create_matcher(pat, 0);
 
     /* walk the list of clients for the network, do matches as necessary.  a
      * lot of matches for non-local clients are luckily pre-empted if we're
@@ -572,7 +696,7 @@ void sendto_match_butone(client_t *one, client_t *cli, server_t *srv,
             continue; /* pseudo-client */
         if (ircd.sends[conn->sock->fd])
             continue; /* already sent this way */
-        if ((host ? !match(pat, cp->host) : !match(pat, cp->server->name)))
+        if (!matcher_match(mp, (host ? cp->host : cp->server->name)))
             continue; /* not a match */
         ircd.sends[conn->sock->fd] = 1;
 
@@ -582,13 +706,10 @@ void sendto_match_butone(client_t *one, client_t *cli, server_t *srv,
             sm = conn->proto->output(&ps, cmd, mask, msg, vl);
             va_end(vl);
         }
-        if (CACHE_MSG(conn->proto)) {
-            conn->proto->tmpmsg = create_sendq_block(sm->msg, sm->len);
-            sendq_push(conn->proto->tmpmsg, conn);
-        } else
-            sendq_push(create_sendq_block(sm->msg, sm->len), conn);
+        sendq_push_cached(conn, sm);
     }
 
+    destroy_matcher(mp);
     CLEAR_SEND_TEMPS();
 }
 
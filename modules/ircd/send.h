@@ -20,13 +20,83 @@ struct sendq_item {
 };
 
 struct sendq_block {
-    char    *msg;   /* message */
+    char    *msg;   /* message (stored just after the block itself) */
     int            len;    /* length of message */
     int            refs;   /* number of clients referring to this message */
+    heap_t  *heap;  /* the heap the block came from, or NULL if it was
+                       malloc'd */
 };
 
+/* sendq items come out of a heap, as do sendq blocks.  blocks carry their
+ * message inline, so there is a block heap for each of a few message sizes,
+ * listed here.  blocks for messages longer than the last size are simply
+ * malloc'd. */
+#define SENDQ_BLOCK_HEAPS 4
+#define SENDQ_BLOCK_SIZES {64, 128, 256, 512}
+
+/* connections in classes with chunked sendqs have messages copied into
+ * SENDQ_CHUNK_SIZE byte chunks of their own instead of queueing a reference
+ * to a (shared) block for each message.  messages longer than
+ * SENDQ_CHUNK_COPYMAX are still queued by reference. */
+#define SENDQ_CHUNK_SIZE 16384
+#define SENDQ_CHUNK_COPYMAX 1024
+#define SENDQ_COPY(cp, len)                                                   \
+    ((cp)->cls->sendq_chunked && (len) <= SENDQ_CHUNK_COPYMAX)
+
+/* these keep the queued byte counts of a connection and its class up to
+ * date.  everything which adds to or removes from a sendq must use them. */
+#define SENDQ_CLASS_ADD(cls, n) do {                                        \
+    (cls)->stats.queued += (n);                                             \
+    if ((cls)->stats.queued > (cls)->stats.peak)                            \
+        (cls)->stats.peak = (cls)->stats.queued;                            \
+} while (0)
+#define SENDQ_ADD_BYTES(cp, n) do {                                         \
+    (cp)->sendq_bytes += (n);                                               \
+    (cp)->cls->stats.total += (n);                                          \
+    SENDQ_CLASS_ADD((cp)->cls, n);                                          \
+} while (0)
+#define SENDQ_SUB_BYTES(cp, n) do {                                         \
+    (cp)->sendq_bytes -= (n);                                               \
+    (cp)->cls->stats.queued -= (n);                                         \
+} while (0)
+
+/* this is true if the connection has gone over its class's byte limit.
+ * nothing more is queued for such connections.  they are marked with
+ * IRCD_CONNFL_SENDQEXCEEDED instead, and sendq_flush() drops them, so a
+ * flood of output can't use more memory than the limit allows even if the
+ * connection isn't flushed for a while. */
+#define SENDQ_FULL(cp)                                                      \
+    (!((cp)->flags & IRCD_CONNFL_NOSENDQ) && (cp)->cls->sendq_bytes > 0 &&  \
+     (cp)->sendq_bytes > (size_t)(cp)->cls->sendq_bytes)
+
+/* this is true if messages for the connection should be held back rather
+ * than queued, which is the case for servers we are still sending servers
+ * and clients to, except while the burst itself is being sent (see
+ * server_burst()). */
+#define SENDQ_HELD(cp)                                                      \
+    ((cp)->srv != NULL && (cp)->srv->burst != NULL &&                       \
+     !((cp)->srv->burst->flags &                                            \
+         (SERVER_BURST_SENDING | SERVER_BURST_CHANNELS | SERVER_BURST_PASS)))
+
+/* held messages don't count towards the sendq until they are let go, but
+ * there is a limit to how much we will hold: the class's byte limit if it
+ * has one, or SENDQ_HELD_MAX if not.  a server which goes over it is
+ * dropped as if its sendq had been exceeded. */
+#define SENDQ_HELD_MAX 4194304
+#define SENDQ_HELD_FULL(cp, len)                                            \
+    (SENDQ_HELD(cp) && (cp)->srv->burst->held_bytes + (len) >               \
+     ((cp)->cls->sendq_bytes > 0 ? (size_t)(cp)->cls->sendq_bytes :         \
+      (size_t)SENDQ_HELD_MAX))
+
+void sendq_create_heaps(void);
+void sendq_destroy_heaps(void);
+
 struct sendq_block *create_sendq_block(char *, int);
+void free_sendq_block(struct sendq_block *);
 void sendq_push(struct sendq_block *, connection_t *);
+void sendq_push_msg(connection_t *, char *, int);
+void sendq_exceeded(connection_t *);
+void sendq_append(connection_t *, char *, int);
 void sendq_pop(connection_t *);
 
 /*******************************************************************************
@@ -50,7 +120,7 @@ server_t *srv_server_uplink(server_t *);
  * this is handy for 'pseudo-clients' which are placed in client lists for
  * convience. */
 #define sendto(conn, msg, len) do {                                         \
-    sendq_push(create_sendq_block(msg, len), conn);                         \
+    sendq_push_msg(conn, msg, len);                                         \
 } while (0)
 
 void sendto_one(client_t *, char *, char *, ...) __PRINTF(3);
@@ -17,8 +17,11 @@
 IDSTRING(rcsid, "$Id: server.c 832 2009-02-22 00:50:59Z wd $");
 
 /* extra prototypes */
-static void server_sendnicks(server_t *, server_t *);
-static void server_sendchans(server_t *);
+static server_t *server_burst_next(server_t *, server_t *);
+static void server_burst_client(server_t *, client_t *);
+static bool server_burst_pending(server_t *, client_t *);
+static void server_burst_release(server_t *);
+static void server_burst_done(server_t *, bool);
 
 /* this function creates a new server and links it to the given connection, if
  * any is specified. */
@@ -26,6 +29,8 @@ server_t *create_server(connection_t *conn) {
     server_t *sp = malloc(sizeof(server_t));
     memset(sp, 0, sizeof(server_t));
     sp->conn = conn;
+    LIST_INIT(&sp->children);
+    LIST_INIT(&sp->clients);
 
     if (conn != NULL) {
         conn->srv = sp;
@@ -47,8 +52,8 @@ server_t *create_server(connection_t *conn) {
 static int destroy_server_count = 0;
 static char destroy_server_splitmsg[512];
 void destroy_server(server_t *srv, char *msg) {
-    client_t *cp, *cp2;
-    server_t *sp, *sp2;
+    client_t *cp;
+    server_t *sp;
         
     /* if this is our initial call, create the split message and send a SQUIT
      * back to any other servers behind us. */
@@ -60,41 +65,31 @@ void destroy_server(server_t *srv, char *msg) {
         /* First remove all its attached servers, this runs recursively and
          * will send out SQUITs and QUITs and all that gack for servers that
          * are NOQUIT-dumb */
-        sp = LIST_FIRST(ircd.lists.servers);
-        while (sp != NULL) {
-            sp2 = LIST_NEXT(sp, lp);
-            if (sp->parent == srv)
-                destroy_server(sp, msg);
-            sp = sp2;
-        }
-
-        /* Now remove all the clients from this server */
-        cp = LIST_FIRST(ircd.lists.clients);
-        while (cp != NULL) {
-            cp2 = LIST_NEXT(cp, lp);
-            if (cp->server == srv) {
-                cp->flags |= IRCD_CLIENT_KILLED;
-                /* Send out QUITs for servers that are not 'NOQUIT' enabled.
-                 * In doing so we send QUITs to *everything* that doesn't do
-                 * NOQUIT, including the source of the SQUIT! The only place
-                 * we don't send towards is srv, since we believe this will
-                 * be handled properly downstream.  That is, NOQUIT makes
-                 * the strange assumption that every server in the path of a
-                 * SQUIT knows all about the server being squit, but other
-                 * servers not in the path might not.  Why/how this makes
-                 * sense is a mystery to me, and this is *really* spammy. */
-                if (CLIENT_REGISTERED(cp))
-                    sendto_serv_pflag_butone(PROTOCOL_SFL_NOQUIT, false, srv,
-                            cp, NULL, NULL, "QUIT", ":%s",
-                            destroy_server_splitmsg);
-                destroy_client(cp, destroy_server_splitmsg);
-            }
-            cp = cp2;
+        while ((sp = LIST_FIRST(&srv->children)) != NULL)
+            destroy_server(sp, msg);
+
+        /* Now remove all the clients from this server.  destroy_client()
+         * takes them off the server's list. */
+        while ((cp = LIST_FIRST(&srv->clients)) != NULL) {
+            cp->flags |= IRCD_CLIENT_KILLED;
+            /* Send out QUITs for servers that are not 'NOQUIT' enabled.  In
+             * doing so we send QUITs to *everything* that doesn't do NOQUIT,
+             * including the source of the SQUIT! The only place we don't
+             * send towards is srv, since we believe this will be handled
+             * properly downstream.  That is, NOQUIT makes the strange
+             * assumption that every server in the path of a SQUIT knows all
+             * about the server being squit, but other servers not in the
+             * path might not.  Why/how this makes sense is a mystery to me,
+             * and this is *really* spammy. */
+            sendto_serv_pflag_butone(PROTOCOL_SFL_NOQUIT, false, srv, cp,
+                    NULL, NULL, "QUIT", ":%s", destroy_server_splitmsg);
+            destroy_client(cp, destroy_server_splitmsg);
         }
 
         ircd.stats.servers--;
         if (srv->conn != NULL)
             ircd.stats.serv.servers--;
+        server_burst_forget_server(srv);
 
         /* Send the SQUIT for this server, last but not least. */
         /* Some servers are really dumb.  For servers which properly support
@@ -113,12 +108,15 @@ void destroy_server(server_t *srv, char *msg) {
 
         /* Lastly, remove 'srv' from the list of servers */
         LIST_REMOVE(srv, lp);
+        LIST_REMOVE(srv, lpchild);
     }
 
     /* If this server is ours we have to close the connection.  We try first
      * to flush the sendq.  If sendq_flush returns 0 it has closed the
      * connection for us (socket error), otherwise we close it ourself. */
     if (MYSERVER(srv)) {
+        if (srv->burst != NULL)
+            server_burst_done(srv, false);
         srv->conn->srv = NULL;
         if (sendq_flush(srv->conn))
             destroy_connection(srv->conn, msg);
@@ -230,6 +228,8 @@ void server_introduce(server_t *srv) {
 int server_establish(server_t *srv) {
     log_debug("server_establish called");
 
+    if (srv->burst != NULL)
+        return 1; /* still sending the nick/channel burst */
     if (!(srv->flags & IRCD_SERVER_BNICKCHAN)) {
         /* send out an 'established' notice. */
         sendto_flag(SFLAG("GNOTICE"),
@@ -239,17 +239,16 @@ int server_establish(server_t *srv) {
         sendto_serv_butone(srv, NULL, ircd.me, NULL, "GNOTICE",
                 ":Link with %s established: TS link", srv->name);
         srv->conn->flags |= IRCD_CONNFL_NOSENDQ;
-        /* all the work for this function is done by 'server_sendnicks',
-         * defined below.  just call it for ourself and let it do all the work.
-         * we have to pass 'srv' so it knows who to send to and what server not
-         * to establish! */
-        server_sendnicks(srv, ircd.me);
-        server_sendchans(srv);
-        sendto_serv_from(srv, NULL, NULL, NULL, "PING", ":%s", ircd.me->name);
-        sendto_flag(SFLAG("GNOTICE"),
-                "Sent nick/channel burst to %s (%d messages)", srv->name,
-                srv->conn->sendq_items);
-        srv->flags |= IRCD_SERVER_BNICKCHAN;
+        /* the burst itself is sent a slice at a time by server_burst(),
+         * defined below.  we send the first slice here, and the writer hook
+         * sends the rest as the server reads them.  it sets
+         * IRCD_SERVER_BNICKCHAN when it is done. */
+        srv->burst = calloc(1, sizeof(struct server_burst));
+        srv->burst->serial = ircd.serial;
+        srv->burst->server = ircd.me;
+        STAILQ_INIT(&srv->burst->held);
+        SLIST_INIT(&srv->burst->nicks);
+        server_burst(srv);
         return 1;
     } else if (!(srv->flags & IRCD_SERVER_BMISC)) {
         /* burst other stuff */
@@ -284,13 +283,16 @@ void server_register(server_t *sp) {
     sendto_serv_butone(sp, NULL, uplink, NULL, "SERVER", "%s %d :%s", sp->name,
             sp->hops + 1, sp->info);
 
+    sp->serial = ++ircd.serial;
     LIST_INSERT_HEAD(ircd.lists.servers, sp, lp);
+    LIST_INSERT_HEAD(&uplink->children, sp, lpchild);
 
     ircd.stats.servers++;
     if (sp->conn != NULL) {
         ircd.stats.serv.servers++;
         LIST_REMOVE(sp->conn, lp);
         LIST_INSERT_HEAD(ircd.connections.servers, sp->conn, lp);
+        sp->conn->flags |= IRCD_CONNFL_STAGE3;
         
         /* clean out the password area */
         if (sp->conn->pass != NULL) {
@@ -302,45 +304,238 @@ void server_register(server_t *sp) {
     sp->flags |= IRCD_SERVER_REGISTERED;
 }
 
-/* this sends nicks in a recursive fashion.  given a server to start from,
- * find all servers whose parents are 'from' and call server_sendnicks() for
- * them (which will recurse until you hit the leaves).  do not send data for
- * 'to', of course */
-void server_sendnicks(server_t *to, server_t *from) {
-    server_t *sp;
+/* this sends the next slice of our nick/channel burst to 'to'.  the burst
+ * walks the server tree (from us outwards) sending each server and its
+ * clients, then sends all of our channels.  we stop once the server has
+ * SERVER_BURST_QUEUE bytes waiting to be written, and the writer hook calls
+ * us again when it has drained them, so a large burst is never built all at
+ * once.  until the servers and clients are done anything else sent to the
+ * server is held back (see sendq_push()), since it may be about clients the
+ * server doesn't know yet.  after that it is sent along with the channels. */
+void server_burst(server_t *to) {
+    struct server_burst *bp = to->burst;
+    connection_t *conn = to->conn;
     client_t *cp;
+    channel_t *chp;
+
+    bp->flags |= SERVER_BURST_SENDING;
+    while (conn->sendq_bytes < SERVER_BURST_QUEUE) {
+        if (bp->flags & SERVER_BURST_CHANNELS) {
+            if ((chp = bp->channel) == NULL) {
+                server_burst_done(to, true);
+                return;
+            }
+            bp->channel = LIST_NEXT(chp, lp);
+            if (!SERVER_BURST_SKIP(to, chp)) {
+                conn->proto->sync_channel(conn, chp);
+                bp->channels++;
+            }
+        } else if (bp->server == NULL) {
+            /* the server knows everyone now, let go of what was held */
+            server_burst_release(to);
+            bp->flags |= SERVER_BURST_CHANNELS;
+            bp->channel = LIST_FIRST(ircd.lists.channels);
+        } else if (!(bp->flags & SERVER_BURST_ENTERED)) {
+            /* introduce the server (unless it is us) before its clients */
+            if (bp->server != ircd.me)
+                sendto_serv_from(to, NULL, bp->server->parent, NULL,
+                        "SERVER", "%s %d :%s", bp->server->name,
+                        bp->server->hops, bp->server->info);
+            bp->client = LIST_FIRST(&bp->server->clients);
+            bp->flags |= SERVER_BURST_ENTERED;
+        } else if ((cp = bp->client) != NULL) {
+            bp->client = LIST_NEXT(cp, lpsrv);
+            if (!SERVER_BURST_SKIP(to, cp)) {
+                server_burst_client(to, cp);
+                bp->clients++;
+            }
+        } else {
+            bp->server = server_burst_next(to, bp->server);
+            bp->flags &= ~SERVER_BURST_ENTERED;
+        }
+    }
+    bp->flags &= ~SERVER_BURST_SENDING;
+    socket_monitor(conn->sock, SOCKET_FL_WRITE);
+}
 
-    if (!MYSERVER(to)) {
-        log_warn("server_establish(%s) called with non-local server as dest",
-                to->name);
+/* this finds the server to burst after 'sp'.  the servers are walked in
+ * preorder so that every server is sent after its parent.  'to' and
+ * anything created since the burst started are skipped. */
+static server_t *server_burst_next(server_t *to, server_t *sp) {
+    server_t *next;
+
+    LIST_FOREACH(next, &sp->children, lpchild) {
+        if (next != to && !SERVER_BURST_SKIP(to, next))
+            return next;
+    }
+    while (sp != ircd.me) {
+        for (next = LIST_NEXT(sp, lpchild);next != NULL;
+                next = LIST_NEXT(next, lpchild)) {
+            if (next != to && !SERVER_BURST_SKIP(to, next))
+                return next;
+        }
+        sp = sp->parent;
+    }
+
+    return NULL;
+}
+
+/* this introduces a client.  if it has changed its nick since the burst
+ * began it is introduced by the nick it had then, and the held NICK
+ * messages bring it up to date. */
+static void server_burst_client(server_t *to, client_t *cli) {
+    struct server_burst *bp = to->burst;
+    struct server_burst_nick *bnp;
+    char nick[NICKLEN + 1];
+
+    SLIST_FOREACH(bnp, &bp->nicks, lp) {
+        if (bnp->cli == cli)
+            break;
+    }
+    if (bnp == NULL) {
+        to->conn->proto->register_user(to->conn, cli);
         return;
     }
 
-    /* send data for ourself, if 'from' == ircd.me (us), don't send a SERVER
-     * command, otherwise, introduce the server and all users on that server */
-    if (from != ircd.me)
-        sendto_serv_from(to, NULL, from->parent, NULL, "SERVER", "%s %d :%s",
-                from->name, from->hops, from->info);
-    LIST_FOREACH(cp, ircd.lists.clients, lp) {
-        if (!CLIENT_REGISTERED(cp) || cp->server != from)
+    strcpy(nick, cli->nick);
+    strcpy(cli->nick, bnp->nick);
+    to->conn->proto->register_user(to->conn, cli);
+    strcpy(cli->nick, nick);
+    SLIST_REMOVE(&bp->nicks, bnp, server_burst_nick, lp);
+    free(bnp);
+}
+
+/* this returns true if 'cli' has not been sent in the burst to 'to' yet,
+ * but will be. */
+static bool server_burst_pending(server_t *to, client_t *cli) {
+    struct server_burst *bp = to->burst;
+    server_t *sp;
+    client_t *cp;
+
+    if (bp->server == NULL || SERVER_BURST_SKIP(to, cli))
+        return false;
+    if (cli->server == bp->server) {
+        if (!(bp->flags & SERVER_BURST_ENTERED))
+            return true;
+        for (cp = bp->client;cp != NULL;cp = LIST_NEXT(cp, lpsrv)) {
+            if (cp == cli)
+                return true;
+        }
+        return false;
+    }
+    for (sp = server_burst_next(to, bp->server);sp != NULL;
+            sp = server_burst_next(to, sp)) {
+        if (sp == cli->server)
+            return true;
+    }
+    return false;
+}
+
+/* this moves the messages held back during a burst into the sendq, where
+ * they are counted from now on. */
+static void server_burst_release(server_t *srv) {
+    struct server_burst *bp = srv->burst;
+
+    STAILQ_CONCAT(&srv->conn->sendq, &bp->held);
+    SENDQ_ADD_BYTES(srv->conn, bp->held_bytes);
+    bp->held_bytes = 0;
+}
+
+/* this finishes off a burst.  whatever was held back goes into the sendq
+ * behind the burst.  if the burst was sent in full we PING the server so we
+ * know when it has taken everything in. */
+static void server_burst_done(server_t *srv, bool finished) {
+    struct server_burst *bp = srv->burst;
+    struct server_burst_nick *bnp;
+    connection_t *conn = srv->conn;
+
+    server_burst_release(srv);
+    srv->burst = NULL;
+    if (conn->sendq_items == 0 && conn->flags & IRCD_CONNFL_WRITER) {
+        LIST_REMOVE(conn, wlp);
+        conn->flags &= ~IRCD_CONNFL_WRITER;
+    }
+
+    if (finished) {
+        sendto_serv_from(srv, NULL, NULL, NULL, "PING", ":%s", ircd.me->name);
+        sendto_flag(SFLAG("GNOTICE"),
+                "Sent nick/channel burst to %s (%d clients, %d channels)",
+                srv->name, bp->clients, bp->channels);
+        srv->flags |= IRCD_SERVER_BNICKCHAN;
+    }
+    while ((bnp = SLIST_FIRST(&bp->nicks)) != NULL) {
+        SLIST_REMOVE_HEAD(&bp->nicks, lp);
+        free(bnp);
+    }
+    free(bp);
+}
+
+/* this is called by client_change_nick() before a client's nick changes.
+ * bursts which have yet to send the client remember its old nick. */
+void server_burst_nick(client_t *cli) {
+    connection_t *cp;
+    struct server_burst_nick *bnp;
+
+    LIST_FOREACH(cp, ircd.connections.servers, lp) {
+        if (cp->srv == NULL || cp->srv->burst == NULL ||
+                !server_burst_pending(cp->srv, cli))
             continue;
-        to->conn->proto->register_user(to->conn, cp);
+        SLIST_FOREACH(bnp, &cp->srv->burst->nicks, lp) {
+            if (bnp->cli == cli)
+                break;
+        }
+        if (bnp != NULL)
+            continue; /* we want the nick it had first */
+        bnp = malloc(sizeof(struct server_burst_nick));
+        bnp->cli = cli;
+        strcpy(bnp->nick, cli->nick);
+        SLIST_INSERT_HEAD(&cp->srv->burst->nicks, bnp, lp);
     }
-    /* then introduce all the servers on that from, and all their users, and
-     * all the servers on that server, ... */
-    LIST_FOREACH(sp, ircd.lists.servers, lp) {
-        if (sp->parent == from && sp != to)
-            server_sendnicks(to, sp);
+}
+
+/* these are called when clients, servers, and channels go away, and move the
+ * place of any burst which was about to send them along. */
+void server_burst_forget_client(client_t *cli) {
+    connection_t *cp;
+    struct server_burst *bp;
+    struct server_burst_nick *bnp;
+
+    LIST_FOREACH(cp, ircd.connections.servers, lp) {
+        if (cp->srv == NULL || (bp = cp->srv->burst) == NULL)
+            continue;
+        if (bp->client == cli)
+            bp->client = LIST_NEXT(cli, lpsrv);
+        SLIST_FOREACH(bnp, &bp->nicks, lp) {
+            if (bnp->cli == cli) {
+                SLIST_REMOVE(&bp->nicks, bnp, server_burst_nick, lp);
+                free(bnp);
+                break;
+            }
+        }
     }
 }
+void server_burst_forget_server(server_t *srv) {
+    connection_t *cp;
+    struct server_burst *bp;
 
-/* this sends our current list of channels to the specified server.  we are
- * careful to only send info from our side of the network, as well. */
-void server_sendchans(server_t *to) {
-    channel_t *chp;
+    LIST_FOREACH(cp, ircd.connections.servers, lp) {
+        if (cp->srv == NULL || (bp = cp->srv->burst) == NULL ||
+                bp->server != srv)
+            continue;
+        /* its children and clients are already gone */
+        bp->server = server_burst_next(cp->srv, srv);
+        bp->client = NULL;
+        bp->flags &= ~SERVER_BURST_ENTERED;
+    }
+}
+void server_burst_forget_channel(channel_t *chan) {
+    connection_t *cp;
 
-    LIST_FOREACH(chp, ircd.lists.channels, lp)
-        to->conn->proto->sync_channel(to->conn, chp);
+    LIST_FOREACH(cp, ircd.connections.servers, lp) {
+        if (cp->srv != NULL && cp->srv->burst != NULL &&
+                cp->srv->burst->channel == chan)
+            cp->srv->burst->channel = LIST_NEXT(chan, lp);
+    }
 }
 
 /* server connectory stuff lives below here.  we keep our own internal list of
@@ -476,11 +671,13 @@ int server_connect(struct server_connect *scp, char *uport) {
                                             temporarily. */
     cp->signon = me.now;
     cp->last = me.now;
+    cp->ping_timer = TIMER_INVALID;
     set_connection_protocol(cp, proto);
 
     /* put it on the stage2 list.  technically it should stay as stage2 until
      * the negotiation is finished and server_register() is called. */
     LIST_INSERT_HEAD(ircd.connections.stage2, cp, lp);
+    connection_ping_schedule(cp);
 
     sp = cp->srv;
     /* now just fill in the server structure.. */
@@ -23,6 +23,9 @@ struct server {
                                    any.  */
     struct server *parent;        /* parent server.  NULL if this is our own
                                    server structure (in the ircd uberstruct) */
+    LIST_HEAD(, server) children; /* registered servers linked to this one */
+    LIST_HEAD(, client) clients;  /* registered clients on this server */
+    int            nclients;        /* the number of clients in the list above */
         
 #define IRCD_SERVER_INTRODUCED        0x0001        /* defined if we have introduced
                                            ourselves (sent PASS/SERVER/...) */
@@ -69,8 +72,54 @@ struct server {
 #define SERVER_SUPPORTS(srv, flag) ((srv)->pflags & (flag))
     int            pflags;
 
+    uint64_t serial;                /* see ircd.serial */
+    struct server_burst *burst;        /* set while we are sending our
+                                           nick/channel burst */
+
     LIST_ENTRY(server) lp;
+    LIST_ENTRY(server) lpchild;        /* entry in our parent's children */
+};
+
+/* this holds our place in a nick/channel burst to one of our servers.  the
+ * burst is sent a slice at a time (see server_burst()).  while servers and
+ * clients are being sent anything else sent to the server is kept in 'held',
+ * and is queued once they are all done, ahead of the channels.  anything
+ * created after the burst started (anything with a serial higher than the
+ * one here) is left out of it, since the messages which created it are
+ * sent along anyhow. */
+struct server_burst_nick {
+    client_t *cli;
+    char    nick[NICKLEN + 1];        /* the nick it had when the burst began */
+    SLIST_ENTRY(server_burst_nick) lp;
+};
+struct server_burst {
+    uint64_t serial;                /* ircd.serial when the burst started */
+    server_t *server;                /* the server whose clients we're sending,
+                                   NULL once all servers are done */
+    client_t *client;                /* the next client on 'server' */
+    channel_t *channel;                /* the next channel to send */
+#define SERVER_BURST_ENTERED        0x01        /* 'server' has been introduced */
+#define SERVER_BURST_CHANNELS        0x02        /* nicks done, doing channels */
+#define SERVER_BURST_SENDING        0x04        /* in server_burst() right now */
+#define SERVER_BURST_PASS           0x08        /* don't hold the message being
+                                           sent (see SENDQ_HELD()) */
+    int            flags;
+
+    struct sendq_list held;        /* messages sent to the server meanwhile */
+    size_t  held_bytes;                /* and their size */
+    /* clients which changed their nick before we got to them.  the held
+     * messages know them by their old nick, so that's what we send. */
+    SLIST_HEAD(, server_burst_nick) nicks;
+
+    int            clients;                /* clients/channels sent so far */
+    int            channels;
 };
+/* true if 'obj' (a client, server, channel, or chanlink) should be left out
+ * of the burst we are sending to 'srv'. */
+#define SERVER_BURST_SKIP(srv, obj)                                           \
+    ((srv)->burst != NULL && (obj)->serial > (srv)->burst->serial)
+/* the most we let a burst put in a server's sendq at once */
+#define SERVER_BURST_QUEUE 32768
 
 /* this structure is used to specify connectory for servers.  typically used
  * with auto-connects. */
@@ -95,6 +144,11 @@ void server_set_flags(server_t *);
 void server_introduce(server_t *);
 int server_establish(server_t *);
 void server_register(server_t *);
+void server_burst(server_t *);
+void server_burst_nick(client_t *);
+void server_burst_forget_client(client_t *);
+void server_burst_forget_server(server_t *);
+void server_burst_forget_channel(channel_t *);
 
 struct server_connect *create_server_connect(char *);
 struct server_connect *find_server_connect(char *);
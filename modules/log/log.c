@@ -8,6 +8,9 @@
  * allows output from the log events to be sorted based on module and output to
  * files as well as syslog.  It also allows the user to define the output
  * format for files.
+ *
+ * Output to files is buffered in memory and written out in batches, so
+ * that the daemon does not wait on the disk for every line it logs.
  */
 
 #include <syslog.h>
@@ -27,6 +30,8 @@ MODULE_REGISTER("1.0");
 typedef struct log_hook {
     char    *module;            /* module name pattern */
     char    *msg;               /* message pattern */
+    matcher_t *modm;            /* compiled forms of the two patterns */
+    matcher_t *msgm;            /* above (NULL if they are unset) */
     enum logtypes level;        /* level to match at (or 0) */
 
 #define LOG_FL_DEFUNCT  0x01    /* defunct log rule (some non-recoverable error
@@ -37,11 +42,24 @@ typedef struct log_hook {
 #define LOG_FL_FILE     0x20    /* log to a file */
     int     flags;
     char    filename[PATH_MAX]; /* name of the file we will log to */
-    FILE    *file;              /* file to log to (NULL is syslog) */
+    int     fd;                 /* file to log to (-1 if not open) */
     int     prio;               /* priority (syslog only) */
     time_t  last;               /* last time we logged .. */
     time_t  rotate;             /* time to rotate (0 is never) */
     char    *ts_fmt;            /* timestamp formatting */
+    time_t  ts_time;            /* the time 'ts' was made for.  it is only */
+    char    ts[128];            /* re-formatted when the second changes */
+
+    /* lines for the file are kept in this ring buffer until they are
+     * written out, which saves a write for every line.  the writes are
+     * ordinary (blocking) ones, so the buffer only fills up if the file
+     * stops taking data (a full disk, say).  lines are then dropped and
+     * counted. */
+    char    *buf;
+    size_t  bufsize;            /* size of the buffer */
+    size_t  head;               /* offset of the oldest byte */
+    size_t  len;                /* number of bytes waiting to be written */
+    unsigned long dropped;      /* lines dropped since the last write */
 
     TAILQ_ENTRY(log_hook) lp;
 } log_hook_t;
@@ -49,15 +67,51 @@ typedef struct log_hook {
 /* some default configs we look for */
 #define LOG_TS_FMT "[%Y-%m-%d %H:%M:%S]"
 #define LOG_FILE_FMT "%Y-%m-%d.%H%M"
+#define LOG_BUFFER_SIZE 65536
+#define LOG_FLUSH_TIME 1
 static time_t default_rotate;
 static char *default_ts_fmt;
 static char default_log_dir[PATH_MAX];
+static size_t log_buffer_size;
+static time_t log_flush_time;
+static timer_ref_t log_flush_timer = TIMER_INVALID;
 
 static TAILQ_HEAD(, log_hook) log_hook_list;
 static conf_list_t **log_confdata;
 
+/* the rules which could apply to messages from a given module at each level
+ * are worked out the first time the module logs something, and kept in a
+ * 'route' for the module.  routes are thrown away whenever the rules are
+ * changed.  module names longer than LOG_ROUTE_NAMELEN are not given routes,
+ * and messages from them are checked against the whole list. */
+#define LOG_ROUTE_NAMELEN 64
+#define LOG_LEVELS 5
+#define LOG_LEVEL_IDX(level) ((level) <= LOGTYPE_ERROR ? (int)(level) : 4)
+struct log_route {
+    char    module[LOG_ROUTE_NAMELEN + 1];
+    struct {
+        log_hook_t **rules;     /* the rules, in order */
+        int     nrules;
+        bool    wanted;         /* false if nothing would be recorded */
+    } levels[LOG_LEVELS];
+
+    LIST_ENTRY(log_route) lp;
+};
+static LIST_HEAD(, log_route) log_route_list;
+static hashtable_t *log_routes;
+
 static HOOK_FUNCTION(log_log_hook);
 static HOOK_FUNCTION(log_reload_hook);
+static HOOK_FUNCTION(log_flush_hook);
+
+static bool log_log_filter(enum logtypes, const char *);
+static bool log_hook_apply(log_hook_t *, struct log_event_data *);
+static struct log_route *log_route_get(const char *);
+static void log_route_clear(void);
+
+static void log_file_write(log_hook_t *, time_t, struct log_event_data *);
+static void log_file_add(log_hook_t *, const char *, size_t);
+static void log_file_flush(log_hook_t *);
 
 static int log_parse_conf(conf_list_t *);
 static log_hook_t *log_hook_create(void);
@@ -66,120 +120,312 @@ static void log_hook_destroy(log_hook_t *);
 /* this is the actual executor function.  it takes a log entry and scans
  * through each log hook until it finds one that matches.   when one matches it
  * logs in the appropriate direction and stops unless that match has the pass
- * bit set.  pretty simple. :) */
+ * bit set.  pretty simple. :)  the rules to scan come from the route for the
+ * message's module, so only the message pattern is left to check. */
 static HOOK_FUNCTION(log_log_hook) {
     struct log_event_data *ldp = (struct log_event_data *)data;
+    struct log_route *rp;
     log_hook_t *lhp;
-    time_t last;
+    int i, idx;
+
+    if ((rp = log_route_get(ldp->module)) != NULL) {
+        idx = LOG_LEVEL_IDX(ldp->level);
+        for (i = 0;i < rp->levels[idx].nrules;i++) {
+            lhp = rp->levels[idx].rules[i];
+            if (lhp->flags & LOG_FL_DEFUNCT)
+                continue; /* skip this entry */
+
+            if ((lhp->msgm == NULL || matcher_match(lhp->msgm, ldp->msg)) &&
+                    !log_hook_apply(lhp, ldp))
+                return NULL;
+        }
+        return NULL;
+    }
 
     TAILQ_FOREACH(lhp, &log_hook_list, lp) {
         if (lhp->flags & LOG_FL_DEFUNCT)
             continue; /* skip this entry */
 
-        if ((lhp->module == NULL || match(lhp->module, ldp->module)) &&
-                (lhp->msg == NULL || match(lhp->msg, ldp->msg)) &&
-                (lhp->level == 0 || lhp->level == ldp->level)) {
-            /* a match! */
-
-            last = lhp->last;
-            lhp->last = me.now;
-
-            if (lhp->flags & LOG_FL_IGNORE)
-                return NULL; /* nothing to do now */
-
-            if (lhp->flags & LOG_FL_FILE) {
-                char fname[PATH_MAX];
-                char timestr[PATH_MAX];
-                struct tm *tmp;
-
-                tmp = localtime(&me.now);
-                /* Check to see if rotation must occur.. */
-                *fname = '\0';
-                if (lhp->rotate &&
-                    (last / lhp->rotate != lhp->last / lhp->rotate)) {
-                    time_t rtime;
-                    
-                    /* we need to rotate.. */
-                    if (lhp->file != NULL) {
-                        fclose(lhp->file);
-                        lhp->file = NULL;
-                    }
-
-                    /* let us modify tmp by giving it the time with the
-                     * excessive goo shaved off so that we get filenames
-                     * with ts rounded to when they 'should' have been
-                     * opened. */
-                    rtime = lhp->last - (lhp->last % lhp->rotate);
-                    tmp = localtime(&rtime);
-                    
-                    strftime(timestr, PATH_MAX, LOG_FILE_FMT, tmp);
-                    snprintf(fname, PATH_MAX, "%s.%s", lhp->filename,
-                            timestr);
-                }
-                
-                if (lhp->file == NULL) {
-                    if (*fname == '\0')
-                        strcpy(fname, lhp->filename);
-
-                    if ((lhp->file = fopen(fname, "a")) == NULL) {
-                        /* Be sure to set DEFUNCT *first* to avoid nasty log
-                         * recursion!  This way when we come back around to
-                         * this rule we will not hit it again. */
-                        lhp->flags |= LOG_FL_DEFUNCT;
-                        log_error("cannot open logfile %s: %s",
-                                lhp->filename, strerror(errno));
-                    }
-                }
-
-                if (lhp->file != NULL) {
-                    tmp = localtime(&lhp->last);
-                    strftime(timestr, PATH_MAX, lhp->ts_fmt, tmp);
-                    if (fprintf(lhp->file, "%s %s: %s%s%s\n",
-                            timestr, log_conv_str(ldp->level),
-                            ldp->module, (*ldp->module != '\0' ? ": " : ""),
-                            ldp->msg) < 0) {
-                    lhp->flags |= LOG_FL_DEFUNCT;
-                    fclose(lhp->file);
-                    lhp->file = NULL;
-                    /* XXX: might be nice to give more info.. :/ */
-                    log_error("an error occured while doing file logging: %s",
-                            strerror(errno));
-                    } else
-                        fflush(lhp->file);
-                }
+        if ((lhp->modm == NULL || matcher_match(lhp->modm, ldp->module)) &&
+                (lhp->msgm == NULL || matcher_match(lhp->msgm, ldp->msg)) &&
+                (lhp->level == 0 || lhp->level == ldp->level) &&
+                !log_hook_apply(lhp, ldp))
+            return NULL;
+    }
+
+    return NULL;
+}
+
+/* this tells log_vmsg() whether a message would be recorded anywhere.  it
+ * only answers 'no' when the route for the module says so. */
+static bool log_log_filter(enum logtypes level, const char *module) {
+    struct log_route *rp;
+
+    if ((rp = log_route_get(module)) == NULL)
+        return true;
+    return rp->levels[LOG_LEVEL_IDX(level)].wanted;
+}
+
+/* log a message which has matched a rule.  returns false if no further
+ * rules should be looked at. */
+static bool log_hook_apply(log_hook_t *lhp, struct log_event_data *ldp) {
+    time_t last;
+
+    last = lhp->last;
+    lhp->last = me.now;
+
+    if (lhp->flags & LOG_FL_IGNORE)
+        return false; /* nothing to do now */
+
+    if (lhp->flags & LOG_FL_FILE)
+        log_file_write(lhp, last, ldp);
+    if (lhp->flags & LOG_FL_SYSLOG) {
+        /* we need to deduce the priority if it wasn't specified */
+        int prio;
+
+        if ((prio = lhp->prio) == 0) {
+            switch (ldp->level) {
+                case LOGTYPE_DEBUG:
+                    prio = LOG_DEBUG;
+                    break;
+                case LOGTYPE_WARN:
+                    prio = LOG_WARNING;
+                    break;
+                case LOGTYPE_ERROR:
+                    prio = LOG_ERR;
+                    break;
+                default:
+                case LOGTYPE_NOTICE:
+                    prio = LOG_INFO;
+                    break;
             }
-            if (lhp->flags & LOG_FL_SYSLOG) {
-                /* we need to deduce the priority if it wasn't specified */
-                int prio;
-
-                if ((prio = lhp->prio) == 0) {
-                    switch (ldp->level) {
-                        case LOGTYPE_DEBUG:
-                            prio = LOG_DEBUG;
-                            break;
-                        case LOGTYPE_WARN:
-                            prio = LOG_WARNING;
-                            break;
-                        case LOGTYPE_ERROR:
-                            prio = LOG_ERR;
-                            break;
-                        default:
-                        case LOGTYPE_NOTICE:
-                            prio = LOG_INFO;
-                            break;
-                    }
-                }
-
-                syslog(prio, "%s%s%s", ldp->module,
-                        (*ldp->module != '\0' ? ": " : ""), ldp->msg);
+        }
+
+        syslog(prio, "%s%s%s", ldp->module,
+                (*ldp->module != '\0' ? ": " : ""), ldp->msg);
 
+    }
+
+    return (lhp->flags & LOG_FL_PASS);
+}
+
+/* find (or make) the route for a module.  for each level this is the list
+ * of rules whose module and level fit, and whether any of them could record
+ * the message.  that is the case unless a rule which ignores every message
+ * comes before any rule which records them.  (defunct rules are left in,
+ * they are skipped when the route is used.) */
+static struct log_route *log_route_get(const char *module) {
+    struct log_route *rp;
+    log_hook_t *lhp;
+    enum logtypes level;
+    int i, n;
+
+    if (strlen(module) > LOG_ROUTE_NAMELEN)
+        return NULL;
+    if ((rp = hash_find(log_routes, (void *)module)) != NULL)
+        return rp;
+
+    rp = calloc(1, sizeof(struct log_route));
+    strcpy(rp->module, module);
+    for (i = 0;i < LOG_LEVELS;i++) {
+        level = (i < LOG_LEVELS - 1 ? (enum logtypes)i : LOGTYPE_UNKNOWN);
+        n = 0;
+        TAILQ_FOREACH(lhp, &log_hook_list, lp)
+            n++;
+        rp->levels[i].rules = malloc(sizeof(log_hook_t *) * (n + 1));
+
+        TAILQ_FOREACH(lhp, &log_hook_list, lp) {
+            if ((lhp->modm != NULL && !matcher_match(lhp->modm, module)) ||
+                    (lhp->level != 0 && lhp->level != level))
+                continue;
+            rp->levels[i].rules[rp->levels[i].nrules++] = lhp;
+        }
+        for (n = 0;n < rp->levels[i].nrules;n++) {
+            lhp = rp->levels[i].rules[n];
+            if (!(lhp->flags & LOG_FL_IGNORE)) {
+                rp->levels[i].wanted = true;
+                break;
             }
+            if (lhp->msgm == NULL)
+                break;
+        }
+    }
+    hash_insert(log_routes, rp);
+    LIST_INSERT_HEAD(&log_route_list, rp, lp);
 
-            if ((lhp->flags & LOG_FL_PASS) == 0)
-                return NULL;
+    return rp;
+}
+
+static void log_route_clear(void) {
+    struct log_route *rp;
+    int i;
+
+    while (!LIST_EMPTY(&log_route_list)) {
+        rp = LIST_FIRST(&log_route_list);
+        LIST_REMOVE(rp, lp);
+        hash_delete(log_routes, rp);
+        for (i = 0;i < LOG_LEVELS;i++)
+            free(rp->levels[i].rules);
+        free(rp);
+    }
+}
+
+/* this adds a log line to the buffer of a file rule.  it handles rotation
+ * and (re)opening the file first, if need be.  the buffer is written out
+ * when it is half full, when the flush timer goes off, or at once for
+ * errors (which may well be followed by the process exiting). */
+static void log_file_write(log_hook_t *lhp, time_t last,
+        struct log_event_data *ldp) {
+    char fname[PATH_MAX];
+    char timestr[PATH_MAX];
+    char line[LOG_MSG_MAXLEN + 256];
+    struct tm *tmp;
+    int len;
+
+    /* Check to see if rotation must occur.. */
+    *fname = '\0';
+    if (lhp->rotate && (last / lhp->rotate != lhp->last / lhp->rotate)) {
+        time_t rtime;
+
+        /* we need to rotate.. */
+        if (lhp->fd != -1) {
+            log_file_flush(lhp);
+            close(lhp->fd);
+            lhp->fd = -1;
         }
+
+        /* give localtime the time with the excessive goo shaved off so
+         * that we get filenames with ts rounded to when they 'should' have
+         * been opened. */
+        rtime = lhp->last - (lhp->last % lhp->rotate);
+        tmp = localtime(&rtime);
+
+        strftime(timestr, PATH_MAX, LOG_FILE_FMT, tmp);
+        snprintf(fname, PATH_MAX, "%s.%s", lhp->filename, timestr);
     }
 
+    if (lhp->fd == -1) {
+        if (*fname == '\0')
+            strcpy(fname, lhp->filename);
+
+        if ((lhp->fd = open(fname, O_WRONLY | O_APPEND | O_CREAT,
+                        0666)) == -1) {
+            /* Be sure to set DEFUNCT *first* to avoid nasty log recursion!
+             * This way when we come back around to this rule we will not
+             * hit it again. */
+            lhp->flags |= LOG_FL_DEFUNCT;
+            log_error("cannot open logfile %s: %s", lhp->filename,
+                    strerror(errno));
+            return;
+        }
+    }
+    if (lhp->buf == NULL) {
+        lhp->bufsize = log_buffer_size;
+        lhp->buf = malloc(lhp->bufsize);
+    }
+
+    if (lhp->ts_time != lhp->last) {
+        tmp = localtime(&lhp->last);
+        strftime(lhp->ts, sizeof(lhp->ts), lhp->ts_fmt, tmp);
+        lhp->ts_time = lhp->last;
+    }
+
+    /* if lines were dropped let the reader know, once there is room */
+    if (lhp->dropped) {
+        len = snprintf(line, sizeof(line), "%s %s: log: %lu lines dropped "
+                "(the file could not be written)\n",
+                lhp->ts, log_conv_str(LOGTYPE_WARN), lhp->dropped);
+        if (lhp->len + len <= lhp->bufsize) {
+            lhp->dropped = 0;
+            log_file_add(lhp, line, len);
+        }
+    }
+
+    len = snprintf(line, sizeof(line), "%s %s: %s%s%s\n", lhp->ts,
+            log_conv_str(ldp->level), ldp->module,
+            (*ldp->module != '\0' ? ": " : ""), ldp->msg);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    if (lhp->dropped || lhp->len + len > lhp->bufsize)
+        lhp->dropped++;
+    else
+        log_file_add(lhp, line, len);
+
+    if (ldp->level == LOGTYPE_ERROR || lhp->len >= lhp->bufsize / 2)
+        log_file_flush(lhp);
+    else if (lhp->len && log_flush_timer == TIMER_INVALID)
+        log_flush_timer = create_timer(0, log_flush_time, log_flush_hook,
+                NULL);
+}
+
+/* copy 'len' bytes onto the end of the ring.  the caller makes sure they
+ * fit. */
+static void log_file_add(log_hook_t *lhp, const char *s, size_t len) {
+    size_t tail = (lhp->head + lhp->len) % lhp->bufsize;
+    size_t n = lhp->bufsize - tail;
+
+    if (n > len)
+        n = len;
+    memcpy(lhp->buf + tail, s, n);
+    memcpy(lhp->buf, s + n, len - n);
+    lhp->len += len;
+}
+
+/* write out as much of the buffer as the file will take.  whatever is left
+ * over (after a short write) waits for the next try. */
+static void log_file_flush(log_hook_t *lhp) {
+    struct iovec iov[2];
+    int iovcnt = 1;
+    ssize_t ret;
+
+    if (lhp->fd == -1 || lhp->len == 0)
+        return;
+
+    iov[0].iov_base = lhp->buf + lhp->head;
+    if (lhp->head + lhp->len > lhp->bufsize) {
+        iov[0].iov_len = lhp->bufsize - lhp->head;
+        iov[1].iov_base = lhp->buf;
+        iov[1].iov_len = lhp->len - iov[0].iov_len;
+        iovcnt = 2;
+    } else
+        iov[0].iov_len = lhp->len;
+
+    if ((ret = writev(lhp->fd, iov, iovcnt)) == -1) {
+        if (errno == EINTR)
+            return;
+        lhp->flags |= LOG_FL_DEFUNCT;
+        close(lhp->fd);
+        lhp->fd = -1;
+        lhp->head = lhp->len = 0;
+        /* XXX: might be nice to give more info.. :/ */
+        log_error("an error occured while doing file logging: %s",
+                strerror(errno));
+        return;
+    }
+    lhp->head = (lhp->head + ret) % lhp->bufsize;
+    lhp->len -= ret;
+    if (lhp->len == 0)
+        lhp->head = 0;
+}
+
+/* write out any buffered lines.  if some could not be written, try again
+ * later. */
+static HOOK_FUNCTION(log_flush_hook) {
+    log_hook_t *lhp;
+    bool left = false;
+
+    log_flush_timer = TIMER_INVALID;
+    TAILQ_FOREACH(lhp, &log_hook_list, lp) {
+        log_file_flush(lhp);
+        if (lhp->len)
+            left = true;
+    }
+    if (left)
+        log_flush_timer = create_timer(0, log_flush_time, log_flush_hook,
+                NULL);
+
     return NULL;
 }
 
@@ -198,7 +444,8 @@ static int log_parse_conf(conf_list_t *conf) {
     conf_list_t *clp = NULL;
     log_hook_t *lhp;
 
-    /* nuke the current list of hooks */
+    /* nuke the current list of hooks (and the routes made from them) */
+    log_route_clear();
     while (!TAILQ_EMPTY(&log_hook_list))
         log_hook_destroy(TAILQ_FIRST(&log_hook_list));
 
@@ -208,6 +455,7 @@ static int log_parse_conf(conf_list_t *conf) {
         /* Make a hook that dumps to syslog. */
         lhp = log_hook_create();
         lhp->flags |= LOG_FL_SYSLOG;
+        log_route_clear();
 
         return 1;
     }
@@ -263,6 +511,16 @@ static int log_parse_conf(conf_list_t *conf) {
 
     default_rotate = str_conv_time(conf_find_entry("rotate", conf, 1), 0);
 
+    /* the buffer must at least hold a couple of maximum-length lines */
+    log_buffer_size = str_conv_int(conf_find_entry("buffer", conf, 1),
+            LOG_BUFFER_SIZE);
+    if (log_buffer_size < 2 * (LOG_MSG_MAXLEN + 256))
+        log_buffer_size = 2 * (LOG_MSG_MAXLEN + 256);
+    log_flush_time = str_conv_time(conf_find_entry("flush", conf, 1),
+            LOG_FLUSH_TIME);
+    if (log_flush_time < 1)
+        log_flush_time = 1;
+
     if ((s = conf_find_entry("syslog-identity", conf, 1)) == NULL)
         s = me.execname;
     openlog(s, LOG_PID, facility);
@@ -275,10 +533,14 @@ static int log_parse_conf(conf_list_t *conf) {
          * this doesn't get hooked. :) */
         lhp->flags |= LOG_FL_DEFUNCT;
 
-        if ((s = conf_find_entry("module", clp, 1)) != NULL)
+        if ((s = conf_find_entry("module", clp, 1)) != NULL) {
             lhp->module = strdup(s);
-        if ((s = conf_find_entry("message", clp, 1)) != NULL)
+            lhp->modm = create_matcher(s, 0);
+        }
+        if ((s = conf_find_entry("message", clp, 1)) != NULL) {
             lhp->msg = strdup(s);
+            lhp->msgm = create_matcher(s, 0);
+        }
         if ((s = conf_find_entry("level", clp, 1)) != NULL)
             lhp->level = str_conv_log(s);
 
@@ -332,6 +594,8 @@ static int log_parse_conf(conf_list_t *conf) {
          * reloading the rules we want to do this. */
         lhp->flags &= ~LOG_FL_DEFUNCT;
     }
+    /* routes may have been made while the rules were being set up */
+    log_route_clear();
 
     return 1;
 }
@@ -340,6 +604,7 @@ static log_hook_t *log_hook_create(void) {
     log_hook_t *lhp = malloc(sizeof(log_hook_t));
 
     memset(lhp, 0, sizeof(log_hook_t));
+    lhp->fd = -1;
     
     if (TAILQ_EMPTY(&log_hook_list))
         TAILQ_INSERT_HEAD(&log_hook_list, lhp, lp);
@@ -351,24 +616,40 @@ static log_hook_t *log_hook_create(void) {
 
 static void log_hook_destroy(log_hook_t *lhp) {
 
+    /* writing out what is left may log an error, make sure that doesn't
+     * come back here. */
+    lhp->flags |= LOG_FL_DEFUNCT;
     TAILQ_REMOVE(&log_hook_list, lhp, lp);
 
     if (lhp->module != NULL)
         free(lhp->module);
     if (lhp->msg != NULL)
         free(lhp->msg);
-    if (lhp->file != NULL)
-        fclose(lhp->file);
+    destroy_matcher(lhp->modm);
+    destroy_matcher(lhp->msgm);
+    log_file_flush(lhp);
+    if (lhp->fd != -1)
+        close(lhp->fd);
+    if (lhp->buf != NULL)
+        free(lhp->buf);
     if (lhp->ts_fmt != NULL)
         free(lhp->ts_fmt);
     free(lhp);
+
+    /* and routes may still point at it */
+    log_route_clear();
 }
 
 MODULE_LOADER(log) {
 
     log_confdata = confdata;
-    if (!log_parse_conf(*confdata))
+    log_routes = create_hash_table(32, offsetof(struct log_route, module),
+            LOG_ROUTE_NAMELEN + 1, HASH_FL_NOCASE | HASH_FL_STRING,
+            "strncasecmp");
+    if (!log_parse_conf(*confdata)) {
+        destroy_hash_table(log_routes);
         return 0;
+    }
 
     add_hook(me.events.read_conf, log_reload_hook);
 
@@ -377,25 +658,30 @@ MODULE_LOADER(log) {
     add_hook(me.events.log_warn, log_log_hook);
     add_hook(me.events.log_error, log_log_hook);
     add_hook(me.events.log_unknown, log_log_hook);
+    log_add_filter(log_log_hook, log_log_filter);
 
     return 1;
 }
 
 MODULE_UNLOADER(log) {
 
-    while (!TAILQ_EMPTY(&log_hook_list))
-        log_hook_destroy(TAILQ_FIRST(&log_hook_list));
-
-    if (default_ts_fmt != NULL)
-        free(default_ts_fmt);
-
     remove_hook(me.events.read_conf, log_reload_hook);
 
+    log_remove_filter(log_log_hook);
     remove_hook(me.events.log_debug, log_log_hook);
     remove_hook(me.events.log_notice, log_log_hook);
     remove_hook(me.events.log_warn, log_log_hook);
     remove_hook(me.events.log_error, log_log_hook);
     remove_hook(me.events.log_unknown, log_log_hook);
+
+    while (!TAILQ_EMPTY(&log_hook_list))
+        log_hook_destroy(TAILQ_FIRST(&log_hook_list));
+    destroy_hash_table(log_routes);
+
+    if (log_flush_timer != TIMER_INVALID)
+        destroy_timer(log_flush_timer);
+    if (default_ts_fmt != NULL)
+        free(default_ts_fmt);
 }
 
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */
@@ -1,24 +1,73 @@
 /*
  * db.c: database wrapper
- * 
+ *
  * Copyright 2002 the Ithildin Project.
  * See the COPYING file for more information on licensing and use.
- * 
+ *
  * This file contains the routines for the services database.  Included in it
  * are wrappers for finding various things (nicknames, memos, and whatnot).
+ *
+ * The database on disk is a snapshot file plus a journal.  Every change to a
+ * nickname is appended to the journal as it happens, so nothing is lost
+ * between syncs.  A sync starts a fresh journal and forks off a child to
+ * write a new snapshot from its copy of memory, which keeps the server from
+ * stalling while a large database is written out.
  */
 
 #include <ithildin/stand.h>
 
+#include <sys/wait.h>
+
 #include "services.h"
 
 IDSTRING(rcsid, "$Id: db.c 579 2005-08-21 06:38:18Z wd $");
 
-static void db_read_file(char *);
-static void db_write_file(char *);
+/* Both the snapshot and the journal begin with DB_MAGIC, followed by
+ * records.  Each record is a four byte length (counting everything after
+ * the length itself), a type byte, and then the fields for that type.
+ * Numbers are eight bytes, least significant first, and strings are a two
+ * byte length followed by the bytes of the string.  Nick records carry the
+ * whole nickname, so replaying one over an existing entry simply replaces
+ * it. */
+#define DB_MAGIC "ithildin services db 2\n"
+#define DB_MAGICLEN (sizeof(DB_MAGIC) - 1)
+
+#define DB_REC_MAIL 'M'                /* address, last */
+#define DB_REC_NICK 'N'                /* name, user, host, pass, email, info,
+                                   parent, last, regtime, flags, intflags,
+                                   access count, access masks */
+#define DB_REC_DROP 'D'                /* name */
+
+struct db_buf {
+    unsigned char *data;
+    size_t  len;
+    size_t  size;
+};
+
+struct db_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+    bool    bad;
+};
+
+static struct db_buf db_jbuf;        /* buffer for journal records */
+static timer_ref_t db_reaper;        /* timer waiting on the snapshot writer */
+
+static void db_read_text(char *);
+static off_t db_read_file(char *);
+static size_t db_load(const unsigned char *, size_t);
+static int db_write_file(char *);
+static void db_journal_path(char *, const char *);
+static void db_journal_open(void);
+static int db_expire(void);
+static void db_compact(void);
+static HOOK_FUNCTION(db_reap_hook);
 
 int db_start(void) {
     conf_list_t *clp;
+    char jfile[PATH_MAX + 16];
+    off_t len;
+    struct stat st;
 
     /* set up our hash tables */
     services.db.hash.mail = create_hash_table(2, offsetof(struct regnick,
@@ -26,9 +75,49 @@ int db_start(void) {
             "strcasecmp");
     services.db.hash.nick = create_hash_table(128, offsetof(struct regnick,
                 name), NICKLEN, HASH_FL_NOCASE|HASH_FL_STRING, "nickcmp");
+    hash_set_foldmap(services.db.hash.nick, ircd.maps.nick);
 
     services.db.last = me.now;
-    db_read_file(services.db.file);
+    services.db.journal = -1;
+    services.db.writer = 0;
+
+    /* the snapshot first.  a file without our header is from before the
+     * journal existed, and is read as text. */
+    if ((len = db_read_file(services.db.file)) == -2)
+        db_read_text(services.db.file);
+    else if (len == -1 && errno != ENOENT)
+        log_warn("could not open database file %s: %s", services.db.file,
+                strerror(errno));
+
+    /* then any journal left over from a snapshot which never finished, and
+     * the current journal.  if the server went down in the middle of a
+     * write the last record may be short, and it is cut off here so that
+     * new records are not appended after the fragment. */
+    db_journal_path(jfile, ".old");
+    db_read_file(jfile);
+    db_journal_path(jfile, "");
+    if ((len = db_read_file(jfile)) == -2 && stat(jfile, &st) == 0 &&
+            st.st_size > 0) {
+        /* not something we wrote, or its header never made it.  either
+         * way the records in it can't be trusted to be records, so move it
+         * out of the way rather than appending to it or throwing it out. */
+        char bfile[PATH_MAX + 16];
+
+        db_journal_path(bfile, ".bad");
+        log_error("database journal %s has no valid header, moving it to "
+                "%s", jfile, bfile);
+        if (rename(jfile, bfile) == -1)
+            log_error("could not rename database journal %s: %s", jfile,
+                    strerror(errno));
+        else
+            db_journal_open();
+    } else {
+        if (len >= 0 && stat(jfile, &st) == 0 && st.st_size != len) {
+            log_warn("database journal %s is damaged, truncating it", jfile);
+            truncate(jfile, len);
+        }
+        db_journal_open();
+    }
 
     if ((clp = conf_find_list("administrators", *services.confhead, 1)) !=
             NULL) {
@@ -46,19 +135,331 @@ int db_start(void) {
     return 1;
 }
 
-void db_cleanup(void) {
+/* the nick map may have changed, keep the nick table hashing names the same
+ * way nickcmp() compares them. */
+HOOK_FUNCTION(db_reload_hook) {
 
-    db_sync();
+    if (services.db.hash.nick != NULL)
+        hash_set_foldmap(services.db.hash.nick, ircd.maps.nick);
+    return NULL;
+}
+
+/* on a reload the journal and any snapshot writer carry over in the saved
+ * database structure, but the timer watching the writer does not. */
+void db_resume(void) {
+
+    if (services.db.writer > 0)
+        db_reaper = create_timer(-1, 1, db_reap_hook, NULL);
+}
+
+void db_cleanup(bool reload) {
+
+    if (db_reaper != 0) {
+        destroy_timer(db_reaper);
+        db_reaper = 0;
+    }
+    if (reload)
+        return;
+
+    /* we're going away for good.  everything is already in the journal, so
+     * there's no need for another snapshot, but let one which is being
+     * written finish. */
+    if (services.db.writer > 0)
+        waitpid(services.db.writer, NULL, 0);
+    services.db.writer = 0;
+    if (services.db.journal != -1)
+        close(services.db.journal);
+    services.db.journal = -1;
+    free(db_jbuf.data);
+    db_jbuf.data = NULL;
+    db_jbuf.size = db_jbuf.len = 0;
 }
 
 void db_sync(void) {
+    int expired;
+
+    if (services.db.writer > 0) {
+        log_warn("database snapshot from the last sync is still being "
+                "written, skipping this one");
+        return;
+    }
 
     services.db.last = me.now;
-    db_write_file(services.db.file);
+    expired = db_expire();
+    send_opnotice(NULL, "performing db sync/expiry...  %d nicks expired",
+            expired);
+    db_compact();
+}
+
+/* Functions to build records.  db_rec_start() leaves space for the length,
+ * which db_rec_end() fills in. */
+static void db_put(struct db_buf *bp, const void *data, size_t len) {
+
+    if (bp->len + len > bp->size) {
+        while (bp->len + len > bp->size)
+            bp->size = (bp->size ? bp->size * 2 : 1024);
+        bp->data = realloc(bp->data, bp->size);
+    }
+    memcpy(bp->data + bp->len, data, len);
+    bp->len += len;
+}
+
+static void db_put_int(struct db_buf *bp, int64_t val) {
+    unsigned char b[8];
+    uint64_t v = (uint64_t)val;
+    int i;
+
+    for (i = 0; i < 8; i++, v >>= 8)
+        b[i] = v & 0xff;
+    db_put(bp, b, 8);
+}
+
+static void db_put_str(struct db_buf *bp, const char *str) {
+    size_t len = strlen(str);
+    unsigned char b[2];
+
+    b[0] = len & 0xff;
+    b[1] = (len >> 8) & 0xff;
+    db_put(bp, b, 2);
+    db_put(bp, str, len);
+}
+
+static size_t db_rec_start(struct db_buf *bp, int type) {
+    size_t start = bp->len;
+    unsigned char b[5] = { 0, 0, 0, 0, type };
+
+    db_put(bp, b, 5);
+    return start;
+}
+
+static void db_rec_end(struct db_buf *bp, size_t start) {
+    uint32_t len = bp->len - start - 4;
+    int i;
+
+    for (i = 0; i < 4; i++, len >>= 8)
+        bp->data[start + i] = len & 0xff;
+}
+
+static void db_put_nick(struct db_buf *bp, regnick_t *np) {
+    struct regnick_access *rap;
+    char mask[USERLEN + HOSTLEN + 2];
+    size_t start = db_rec_start(bp, DB_REC_NICK);
+    int64_t count = 0;
+
+    db_put_str(bp, np->name);
+    db_put_str(bp, np->user);
+    db_put_str(bp, np->host);
+    db_put_str(bp, np->pass);
+    db_put_str(bp, (np->email != NULL ? np->email->address : ""));
+    db_put_str(bp, np->info);
+    db_put_str(bp, (np->parent != NULL ? np->parent->name : ""));
+    db_put_int(bp, np->last);
+    db_put_int(bp, np->regtime);
+    db_put_int(bp, np->flags);
+    db_put_int(bp, np->intflags & ~NICK_IFL_NOSAVE);
+    SLIST_FOREACH(rap, &np->alist, lp)
+        count++;
+    db_put_int(bp, count);
+    SLIST_FOREACH(rap, &np->alist, lp) {
+        snprintf(mask, sizeof(mask), "%s@%s", rap->user, rap->host);
+        db_put_str(bp, mask);
+    }
+    db_rec_end(bp, start);
+}
+
+/* Functions to take records apart.  Running off the end of a record marks
+ * the reader bad, and the record is then ignored. */
+static int64_t db_get_int(struct db_reader *rp) {
+    uint64_t v = 0;
+    int i;
+
+    if (rp->end - rp->p < 8) {
+        rp->bad = true;
+        return 0;
+    }
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | rp->p[i];
+    rp->p += 8;
+    return (int64_t)v;
+}
+
+static char *db_get_str(struct db_reader *rp, char *buf, size_t size) {
+    size_t len;
+
+    *buf = '\0';
+    if (rp->end - rp->p < 2) {
+        rp->bad = true;
+        return buf;
+    }
+    len = rp->p[0] | (rp->p[1] << 8);
+    rp->p += 2;
+    if ((size_t)(rp->end - rp->p) < len) {
+        rp->bad = true;
+        return buf;
+    }
+    memcpy(buf, rp->p, (len < size ? len : size - 1));
+    buf[(len < size ? len : size - 1)] = '\0';
+    rp->p += len;
+    return buf;
 }
 
+/* Replay a nick record.  If the nick already exists everything it had is
+ * cleared out first, so the record can be applied any number of times. */
+static void db_load_nick(struct db_reader *rp) {
+    char name[NICKLEN + 1], user[USERLEN + 1], host[HOSTLEN + 1];
+    char pass[PASSWDLEN + 1], email[HOSTLEN * 2 + 1], info[GCOSLEN + 1];
+    char parent[NICKLEN + 1], mask[USERLEN + HOSTLEN + 2];
+    int64_t last, regtime, flags, intflags, count;
+    struct regnick_access *rap;
+    regnick_t *np, *np2;
+
+    db_get_str(rp, name, sizeof(name));
+    db_get_str(rp, user, sizeof(user));
+    db_get_str(rp, host, sizeof(host));
+    db_get_str(rp, pass, sizeof(pass));
+    db_get_str(rp, email, sizeof(email));
+    db_get_str(rp, info, sizeof(info));
+    db_get_str(rp, parent, sizeof(parent));
+    last = db_get_int(rp);
+    regtime = db_get_int(rp);
+    flags = db_get_int(rp);
+    intflags = db_get_int(rp);
+    count = db_get_int(rp);
+    if (rp->bad || *name == '\0')
+        return;
+
+    if ((np = db_find_nick(name)) == NULL)
+        np = regnick_create(name);
+    else {
+        while ((rap = SLIST_FIRST(&np->alist)) != NULL)
+            regnick_access_del(np, rap);
+        if (np->email != NULL && --np->email->nicks == 0)
+            destroy_mail_contact(np->email);
+        np->email = NULL;
+        if (np->parent != NULL)
+            LIST_REMOVE(np, linklp);
+        np->parent = NULL;
+    }
+
+    strcpy(np->user, user);
+    strcpy(np->host, host);
+    strcpy(np->pass, pass);
+    strcpy(np->info, info);
+    np->last = last;
+    np->regtime = regtime;
+    np->flags = flags;
+    np->intflags = (intflags & ~NICK_IFL_NOSAVE) |
+        (np->intflags & NICK_IFL_NOSAVE);
+
+    if (*email != '\0') {
+        if ((np->email = db_find_mail(email)) == NULL)
+            np->email = create_mail_contact(email);
+        np->email->nicks++;
+    }
+    /* parents are always written before their children, so the lookup
+     * only fails if the parent was dropped, in which case so was this. */
+    if (*parent != '\0' && (np2 = db_find_nick(parent)) != NULL &&
+            np2 != np) {
+        np->parent = np2;
+        LIST_INSERT_HEAD(&np2->links, np, linklp);
+    }
+
+    while (count-- > 0 && !rp->bad) {
+        db_get_str(rp, mask, sizeof(mask));
+        if (!rp->bad)
+            regnick_access_add(np, mask);
+    }
+}
+
+/* load all the whole records in the buffer, returning the number of bytes
+ * they took up. */
+static size_t db_load(const unsigned char *data, size_t len) {
+    const unsigned char *p = data, *end = data + len;
+    struct db_reader rd;
+    char name[HOSTLEN * 2 + 1];
+    struct mail_contact *mcp;
+    regnick_t *np;
+    uint32_t rlen;
+
+    while (end - p >= 5) {
+        rlen = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        if (rlen < 1 || (size_t)(end - p - 4) < rlen)
+            break;
+        rd.p = p + 5;
+        rd.end = p + 4 + rlen;
+        rd.bad = false;
+
+        switch (p[4]) {
+            case DB_REC_MAIL:
+                db_get_str(&rd, name, sizeof(name));
+                if (rd.bad || *name == '\0')
+                    break;
+                if ((mcp = db_find_mail(name)) == NULL)
+                    mcp = create_mail_contact(name);
+                mcp->last = db_get_int(&rd);
+                break;
+            case DB_REC_NICK:
+                db_load_nick(&rd);
+                break;
+            case DB_REC_DROP:
+                db_get_str(&rd, name, NICKLEN + 1);
+                if (!rd.bad && (np = db_find_nick(name)) != NULL)
+                    regnick_destroy(np);
+                break;
+            default:
+                log_warn("unknown database record type %d", p[4]);
+                break;
+        }
+
+        p += 4 + rlen;
+    }
+
+    return p - data;
+}
+
+/* Read in a snapshot or journal file.  This returns the length of the part
+ * of the file made up of whole records, -1 if the file couldn't be read, or
+ * -2 if it isn't in our format. */
+static off_t db_read_file(char *file) {
+    int fd;
+    struct stat st;
+    unsigned char *data;
+    size_t got = 0;
+    ssize_t ret;
+    off_t len;
+
+    if ((fd = open(file, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    data = malloc(st.st_size + 1);
+    while (got < (size_t)st.st_size) {
+        if ((ret = read(fd, data + got, st.st_size - got)) <= 0) {
+            if (ret == -1 && errno == EINTR)
+                continue;
+            break;
+        }
+        got += ret;
+    }
+    close(fd);
+
+    if (got < DB_MAGICLEN || memcmp(data, DB_MAGIC, DB_MAGICLEN)) {
+        free(data);
+        return -2;
+    }
+    len = DB_MAGICLEN + db_load(data + DB_MAGICLEN, got - DB_MAGICLEN);
+    free(data);
+
+    return len;
+}
+
+/* This reads the text database written by older versions.  It is only used
+ * once, the first snapshot written afterwards replaces it. */
 /* XXX: this function assumes that the database file is IN PROPER FORMAT! */
-static void db_read_file(char *file) {
+static void db_read_text(char *file) {
     FILE *fp;
     char rbuf[16384];
     char *s, *s2;
@@ -139,93 +540,329 @@ static void db_read_file(char *file) {
             mcp->last = strtol(s2, NULL, 10);
         }
     }
+    fclose(fp);
 }
 
-/* Extra functions for the db write.. */
-static inline void db_write_nick(FILE *, regnick_t *);
-
-/* This function writes the database into a single file.  It actually creates a
- * file with a slightly different name, writes it in full, then performs an
- * a rename operation.  Also, the function performs expire checks while it goes
- * through the lists (why not?) */
-static void db_write_file(char *file) {
-    char *nfile = strdup(file);
+/* This function writes a snapshot of the database.  It actually creates a
+ * file with a slightly different name, writes it in full, then performs a
+ * rename operation.  It is run in the child process forked by
+ * db_compact(), so it must not touch anything the parent shares with it
+ * (sockets, the log), and it returns 0 with errno set on failure. */
+static int db_write_file(char *file) {
+    char nfile[PATH_MAX];
     FILE *fp;
+    struct db_buf buf = { NULL, 0, 0 };
     struct mail_contact *mcp;
-    regnick_t *np, *np2;
-    int nicks, chans;
-    int ex_nicks, ex_chans;
-    time_t started = me.now;
-    
-    send_opnotice(NULL, "performing db sync/expiry...");
+    regnick_t *np;
+    size_t start;
+    int err;
 
     /* tweak the filename ;) */
+    strlcpy(nfile, file, PATH_MAX);
     nfile[strlen(nfile) - 1]++;
-    if ((fp = fopen(nfile, "w")) == NULL) {
-        log_error("could not write database to %s: %s", nfile,
+    if ((fp = fopen(nfile, "w")) == NULL)
+        return 0;
+    fwrite(DB_MAGIC, 1, DB_MAGICLEN, fp);
+
+    /* write mail contacts out.. */
+    LIST_FOREACH(mcp, &services.db.list.mail, lp) {
+        buf.len = 0;
+        start = db_rec_start(&buf, DB_REC_MAIL);
+        db_put_str(&buf, mcp->address);
+        db_put_int(&buf, mcp->last);
+        db_rec_end(&buf, start);
+        fwrite(buf.data, 1, buf.len, fp);
+    }
+
+    /* now write nicks, making sure parents come before their children. */
+    LIST_FOREACH(np, &services.db.list.nicks, lp) {
+        if (np->parent != NULL && !(np->parent->intflags & NICK_IFL_SYNCED)) {
+            buf.len = 0;
+            db_put_nick(&buf, np->parent);
+            fwrite(buf.data, 1, buf.len, fp);
+            np->parent->intflags |= NICK_IFL_SYNCED;
+        }
+        if (!(np->intflags & NICK_IFL_SYNCED)) {
+            buf.len = 0;
+            db_put_nick(&buf, np);
+            fwrite(buf.data, 1, buf.len, fp);
+            np->intflags |= NICK_IFL_SYNCED;
+        }
+    }
+    free(buf.data);
+
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+        err = errno;
+        fclose(fp);
+        unlink(nfile);
+        errno = err;
+        return 0;
+    }
+    if (fclose(fp) == EOF || rename(nfile, file) == -1) {
+        err = errno;
+        unlink(nfile);
+        errno = err;
+        return 0;
+    }
+
+    return 1;
+}
+
+static void db_journal_path(char *buf, const char *suffix) {
+
+    snprintf(buf, PATH_MAX + 16, "%s.journal%s", services.db.file, suffix);
+}
+
+/* open the journal for appending, giving it a header if it's new. */
+static void db_journal_open(void) {
+    char jfile[PATH_MAX + 16];
+    struct stat st;
+
+    db_journal_path(jfile, "");
+    if ((services.db.journal = open(jfile, O_WRONLY | O_APPEND | O_CREAT,
+                    0600)) == -1) {
+        log_error("could not open database journal %s: %s", jfile,
                 strerror(errno));
-        exit_process(NULL, NULL);
+        return;
+    }
+    if (fstat(services.db.journal, &st) == 0 && st.st_size == 0 &&
+            write(services.db.journal, DB_MAGIC, DB_MAGICLEN) !=
+            DB_MAGICLEN) {
+        /* records behind a missing or partial header would be unreadable,
+         * so go without a journal rather than write them. */
+        log_error("could not write database journal %s: %s", jfile,
+                strerror(errno));
+        ftruncate(services.db.journal, 0);
+        close(services.db.journal);
+        services.db.journal = -1;
+    }
+}
+
+/* write out the records waiting in db_jbuf.  if that fails part way the
+ * fragment is cut back off, since replay stops at the first bad record and
+ * would lose everything written after it.  if even that fails the journal
+ * is given up on until the next sync. */
+static void db_journal_write(void) {
+    size_t done = 0;
+    ssize_t ret;
+    off_t start;
+
+    if (services.db.journal == -1) {
+        db_jbuf.len = 0;
+        return;
     }
 
-    nicks = ex_nicks = chans = ex_chans = 0;
+    start = lseek(services.db.journal, 0, SEEK_END);
+    while (done < db_jbuf.len) {
+        if ((ret = write(services.db.journal, db_jbuf.data + done,
+                        db_jbuf.len - done)) == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("could not write to database journal: %s",
+                    strerror(errno));
+            if (start == -1 || ftruncate(services.db.journal, start) == -1) {
+                log_error("could not remove partial record from database "
+                        "journal, journaling stopped: %s", strerror(errno));
+                send_opnotice(NULL, "database journal could not be "
+                        "written!  changes will not be saved until the "
+                        "next sync.");
+                close(services.db.journal);
+                services.db.journal = -1;
+            }
+            break;
+        }
+        done += ret;
+    }
+    db_jbuf.len = 0;
+}
 
-    /* write mail contacts out.. */
-    LIST_FOREACH(mcp, &services.db.list.mail, lp)
-        fprintf(fp, "mail %s %d\n", mcp->address, mcp->last);
-
-    /* now write nicks.. */
-    np = LIST_FIRST(&services.db.list.nicks);
-    while (np != NULL) {
-        np2 = LIST_NEXT(np, lp);
-        if (me.now - np->last >= services.expires.nick &&
-                !(np->intflags & NICK_IFL_HELD)) {
-            regnick_t *np_e;
-
-            /* count the children nicks.. */
-            while ((np_e = LIST_FIRST(&np->links)) != NULL)
-                ex_nicks++;
-            regnick_destroy(np);
-            ex_nicks++;
+/* record the current state of a nickname in the journal.  this should be
+ * called after every change to a nickname which is saved in the db. */
+void db_journal_nick(regnick_t *np) {
+
+    db_put_nick(&db_jbuf, np);
+    db_journal_write();
+}
+
+/* record that a nickname (and any nicks linked to it) is being dropped.
+ * this must be called before the nickname is destroyed. */
+void db_journal_drop(regnick_t *np) {
+    size_t start = db_rec_start(&db_jbuf, DB_REC_DROP);
+
+    db_put_str(&db_jbuf, np->name);
+    db_rec_end(&db_jbuf, start);
+    db_journal_write();
+}
+
+#define db_expired(np)                                                        \
+    (me.now - (np)->last >= services.expires.nick &&                        \
+     !((np)->intflags & NICK_IFL_HELD))
+
+static int regnick_count(regnick_t *np) {
+    regnick_t *np2;
+    int count = 1;
+
+    LIST_FOREACH(np2, &np->links, linklp)
+        count += regnick_count(np2);
+    return count;
+}
+
+/* Drop expired nicknames.  Dropping a nick takes its children with it, so
+ * nicks whose parents are also expiring are left to their parents. */
+static int db_expire(void) {
+    regnick_t *np, *np2, **expire;
+    int i, num = 0, count = 0;
+
+    LIST_FOREACH(np, &services.db.list.nicks, lp) {
+        if (db_expired(np))
+            num++;
+    }
+    if (num == 0)
+        return 0;
+
+    expire = malloc(sizeof(regnick_t *) * num);
+    num = 0;
+    LIST_FOREACH(np, &services.db.list.nicks, lp) {
+        if (!db_expired(np))
             continue;
+        for (np2 = np->parent; np2 != NULL; np2 = np2->parent) {
+            if (db_expired(np2))
+                break;
         }
+        if (np2 == NULL)
+            expire[num++] = np;
+    }
 
-        if (np->parent != NULL && !(np->parent->intflags & NICK_IFL_SYNCED)) {
-            db_write_nick(fp, np->parent);
-            nicks++;
+    for (i = 0; i < num; i++) {
+        count += regnick_count(expire[i]);
+        db_journal_drop(expire[i]);
+        regnick_destroy(expire[i]);
+    }
+    free(expire);
+
+    return count;
+}
+
+/* add the records in one journal on to the end of another. */
+static int db_journal_append(char *to, char *from) {
+    int ifd, ofd;
+    char buf[16384];
+    ssize_t ret;
+    off_t skip = DB_MAGICLEN;
+    int ok = 1;
+
+    if ((ifd = open(from, O_RDONLY)) == -1)
+        return (errno == ENOENT);
+    if ((ofd = open(to, O_WRONLY | O_APPEND)) == -1) {
+        close(ifd);
+        return 0;
+    }
+    lseek(ifd, skip, SEEK_SET);
+    while ((ret = read(ifd, buf, sizeof(buf))) != 0) {
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            ok = 0;
+            break;
         }
-        if (!(np->intflags & NICK_IFL_SYNCED)) {
-            db_write_nick(fp, np);
-            nicks++;
+        if (write(ofd, buf, ret) != ret) {
+            ok = 0;
+            break;
         }
+    }
+    close(ifd);
+    close(ofd);
+
+    return ok;
+}
 
-        np = np2;
+/* Start a new snapshot.  The current journal is set aside (everything in it
+ * will be in the snapshot) and a new one started for changes from here on.
+ * If the last snapshot failed, its set-aside journal is still there, and
+ * the current one is added on to it. */
+static void db_compact(void) {
+    char jfile[PATH_MAX + 16], ofile[PATH_MAX + 16];
+    pid_t pid;
+
+    db_journal_path(jfile, "");
+    db_journal_path(ofile, ".old");
+    if (services.db.journal != -1)
+        close(services.db.journal);
+    if (access(ofile, F_OK) == 0) {
+        if (!db_journal_append(ofile, jfile)) {
+            log_error("could not add database journal %s to %s: %s", jfile,
+                    ofile, strerror(errno));
+            db_journal_open();
+            return;
+        }
+        unlink(jfile);
+    } else if (rename(jfile, ofile) == -1 && errno != ENOENT) {
+        log_error("could not rename database journal %s: %s", jfile,
+                strerror(errno));
+        db_journal_open();
+        return;
     }
-    LIST_FOREACH(np, &services.db.list.nicks, lp)
-        np->intflags &= ~NICK_IFL_SYNCED;
+    db_journal_open();
 
-    fclose(fp);
-    rename(nfile, file);
-    free(nfile);
+    if ((pid = fork()) == -1) {
+        log_error("could not fork to write the database: %s",
+                strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        isocket_t *sp;
+
+        /* the child.  let go of the parent's sockets and journal first, so
+         * that connections the parent closes really go away while we're
+         * writing.  they're closed bare, shutting down an ssl session here
+         * would end the parent's session too. */
+        LIST_FOREACH(sp, &allsockets, intlp) {
+            if (sp->fd != -1)
+                close(sp->fd);
+        }
+        if (services.db.journal != -1)
+            close(services.db.journal);
+
+        /* write the snapshot, and if that worked the old journal is no
+         * longer needed.  failures are passed back through the exit
+         * status. */
+        if (!db_write_file(services.db.file))
+            _exit(errno != 0 ? errno : EIO);
+        unlink(ofile);
+        _exit(0);
+    }
 
-    send_opnotice(NULL, "db sync finished.  %d/%d nicks written/expired, "
-            "%d/%d chans written/expired, in %s", nicks, ex_nicks, chans,
-            ex_chans, time_conv_str(time(NULL) - started));
+    services.db.writer = pid;
+    db_reaper = create_timer(-1, 1, db_reap_hook, NULL);
 }
 
-static inline void db_write_nick(FILE *fp, regnick_t *np) {
-    struct regnick_access *rap;
-
-    fprintf(fp, "nick %s %s %s %s %s %d %d %lld %lld", np->name, np->user,
-            np->host, np->pass, np->email->address, np->last, np->regtime,
-            np->flags, (np->intflags & ~NICK_IFL_NOSAVE));
-    if (np->parent != NULL)
-        fprintf(fp, " %s", np->parent->name);
-    fprintf(fp, "\n");
-    fprintf(fp, "nick.info %s\n", np->info);
+/* check on the child writing a snapshot, and report on it when it's done. */
+static HOOK_FUNCTION(db_reap_hook) {
+    int status;
+    pid_t ret;
+
+    if ((ret = waitpid(services.db.writer, &status, WNOHANG)) == 0 ||
+            (ret == -1 && errno == EINTR))
+        return NULL;
+
+    destroy_timer(db_reaper);
+    db_reaper = 0;
+    services.db.writer = 0;
+
+    if (ret == -1)
+        log_warn("lost track of the database writer: %s", strerror(errno));
+    else if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        send_opnotice(NULL, "db sync finished in %s",
+                time_conv_str(me.now - services.db.last));
+    else {
+        log_error("could not write database to %s: %s", services.db.file,
+                (WIFEXITED(status) ? strerror(WEXITSTATUS(status)) :
+                 "writer was killed"));
+        send_opnotice(NULL, "db sync failed!  changes are still kept in "
+                "the journal.");
+    }
 
-    SLIST_FOREACH(rap, &np->alist, lp)
-        fprintf(fp, "nick.access %s@%s\n", rap->user, rap->host);
-    np->intflags |= NICK_IFL_SYNCED;
+    return NULL;
 }
 
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */
@@ -17,8 +17,14 @@
     (regnick_t *)hash_find(services.db.hash.nick, _nick)
 
 int db_start(void);
-void db_cleanup(void);
+void db_resume(void);
+void db_cleanup(bool);
 void db_sync(void);
+HOOK_FUNCTION(db_reload_hook);
+
+/* These record changes to nicknames in the journal as they are made. */
+void db_journal_nick(regnick_t *);
+void db_journal_drop(regnick_t *);
 
 #endif
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */
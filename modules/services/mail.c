@@ -110,7 +110,11 @@ void mail_send(void) {
     LIST_FOREACH(np, &services.db.list.nicks, lp) {
         if (!regnick_activated(np) && !(np->intflags & NICK_IFL_MAILED))
             mail_send_for(np);
-        np->intflags |= NICK_IFL_MAILED;
+        /* only journal the nicks which actually changed */
+        if (!(np->intflags & NICK_IFL_MAILED)) {
+            np->intflags |= NICK_IFL_MAILED;
+            db_journal_nick(np);
+        }
     }
 }
 
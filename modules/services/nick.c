@@ -380,6 +380,7 @@ HOOK_FUNCTION(nick_register_hook) {
                 has_access_to_nick(cli, np, NICK_IFL_ACCESS)) {
             scdp->nick = np;
             np->flags |= NICK_IFL_MASKACCESS;
+            db_journal_nick(np);
         } else
             return NULL; /* nick is not registered.. */
 
@@ -390,6 +391,7 @@ HOOK_FUNCTION(nick_register_hook) {
         if (scdp->nick != NULL) {
             scdp->nick->last = me.now;
             scdp->nick->flags &= ~(NICK_IFL_MASKACCESS | NICK_IFL_IDACCESS);
+            db_journal_nick(scdp->nick);
         }
     }
 
@@ -498,6 +500,7 @@ static SERVICES_COMMAND(ns_access) {
             return;
         }
         regnick_access_add(np, argv[2]);
+        db_journal_nick(np);
         send_reply(cli, &services.nick, MSG_FMT(cli, replies[RPL_ACCESS_ADD]),
                 argv[2]);
         return;
@@ -517,6 +520,7 @@ static SERVICES_COMMAND(ns_access) {
         }
 
         regnick_access_del(np, rap);
+        db_journal_nick(np);
         send_reply(cli, &services.nick, MSG_FMT(cli, replies[RPL_ACCESS_DEL]),
                 argv[2]);
         return;
@@ -535,6 +539,7 @@ static SERVICES_COMMAND(ns_access) {
     if (!strcasecmp(argv[1], "WIPE")) {
         while (!SLIST_EMPTY(&np->alist))
             regnick_access_del(np, SLIST_FIRST(&np->alist));
+        db_journal_nick(np);
         send_reply(cli, &services.nick, MSG_FMT(cli,
                     replies[RPL_ACCESS_WIPE]), np->name);
         return;
@@ -574,7 +579,8 @@ static SERVICES_COMMAND(ns_auth) {
     np->flags = 0;
     np->intflags |= NICK_IFL_ACTIVATED;
     np->intflags &= ~NICK_IFL_MAILED;
-    
+    db_journal_nick(np);
+
     send_reply(cli, &services.nick, MSG_FMT(cli, replies[RPL_AUTH_FINISHED]),
             np->name, ircd.network_full);
 }
@@ -604,6 +610,7 @@ static SERVICES_COMMAND(ns_drop) {
     send_reply(cli, &services.nick, MSG_FMT(cli, replies[RPL_DROP_OK]),
             np->name);
     scdp->nick = NULL;
+    db_journal_drop(np);
     regnick_destroy(np);
 }
 
@@ -736,6 +743,8 @@ static SERVICES_COMMAND(ns_register) {
                         mcp->address);
                 return;
             }
+            if (mcp == NULL)
+                mcp = create_mail_contact(argv[2]);
 
             np = regnick_create(cli->nick);
             strcpy(np->user, cli->user);
@@ -755,6 +764,7 @@ static SERVICES_COMMAND(ns_register) {
             np->flags = rand();
             np->flags = ((uint64_t)rand()) << 32;
 #endif
+            db_journal_nick(np);
 
             send_reply(cli, &services.nick, MSG_FMT(cli,
                         replies[RPL_REGISTER_SENDING]), np->email);
@@ -802,6 +812,7 @@ static SERVICES_COMMAND(ns_register) {
     /* Don't forget to add them to the parent.. */
     np->parent = scdp->nick;
     LIST_INSERT_HEAD(&scdp->nick->links, np, linklp);
+    db_journal_nick(np);
 
     send_reply(cli, &services.nick, MSG_FMT(cli, replies[RPL_REGISTER_LINKED]),
             np->name, scdp->nick->name);
@@ -862,6 +873,7 @@ static SERVICES_COMMAND(ns_set) {
                         replies[RPL_SET_INVALID]), argv[oarg], "EMAIL");
             return;
         }
+        db_journal_nick(np);
         send_reply(cli, &services.nick, MSG_FMT(cli, replies[RPL_SET]),
                 "email address", np->name,
                 (np->flags & NICK_FL_SHOWEMAIL ? "public" : "private"));
@@ -886,6 +898,7 @@ static SERVICES_COMMAND(ns_set) {
                             replies[RPL_SET_INVALID]), argv[oarg], "PROTECT");
                 return;
         }
+        db_journal_nick(np);
         send_reply(cli, &services.nick, MSG_FMT(cli, replies[RPL_SET]),
                 "protection", np->name,
                 (np->flags & NICK_FL_PROTECT ? "on" : "off"));
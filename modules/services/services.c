@@ -75,6 +75,7 @@ MODULE_LOADER(services) {
 
     memset(&services, 0, sizeof(services));
     services.confhead = confdata;
+    services.db.journal = -1;
 
     /* overwrite the version string... */
     snprintf(ircd.version, GCOSLEN, "%s+services%s", me.version,
@@ -119,6 +120,9 @@ MODULE_LOADER(services) {
     command_add_hook("PRIVMSG", 1, services_privmsg_hook, 0);
     add_hook(ircd.events.register_client, nick_register_hook);
     add_hook(ircd.events.unregister_client, nick_register_hook);
+    /* this is added after ircd's own reload hook, so the nick map is up to
+     * date by the time ours is called */
+    add_hook(me.events.read_conf, db_reload_hook);
 
     if (!reload && !services_parse_conf(*services.confhead))
         return 0;
@@ -139,6 +143,8 @@ MODULE_LOADER(services) {
     /* and we need to start the database engine.. */
     if (!reload && !db_start())
         return 0;
+    else if (reload)
+        db_resume();
 
     return 1;
 }
@@ -146,10 +152,13 @@ MODULE_LOADER(services) {
 MODULE_UNLOADER(services) {
 
     /* make sure to do any pending database cleanup.. */
-    db_cleanup();
+    db_cleanup(reload);
 
     destroy_mdext_item(ircd.mdext.client, services.mdext.client);
     command_remove_hook("PRIVMSG", 1, services_privmsg_hook);
+    remove_hook(ircd.events.register_client, nick_register_hook);
+    remove_hook(ircd.events.unregister_client, nick_register_hook);
+    remove_hook(me.events.read_conf, db_reload_hook);
 
     if (reload) {
         add_module_savedata(savelist, "services.db", sizeof(services.db),
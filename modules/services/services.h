@@ -43,6 +43,10 @@ extern struct services_struct {
                                                database file. */
         time_t        last;                            /* time the database was last
                                                synchronized. */
+        int     journal;                    /* descriptor of the change
+                                               journal, or -1 */
+        pid_t   writer;                     /* child writing a snapshot, or 0
+                                               if there isn't one. */
 
         struct {
             LIST_HEAD(, mail_contact) mail;
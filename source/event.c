@@ -70,7 +70,10 @@ void **hook_event(event_t *ep, void *data) {
             continue; /* either deferred for deletion or newly added */
         }
 
-        ret = hookreturns[i++] = hp->function(ep, data);
+        /* the hook may add hooks of its own, which can move hookreturns
+         * out from under us, so don't touch it until the hook is done. */
+        ret = hp->function(ep, data);
+        hookreturns[i++] = ret;
         if (ep->flags & EVENT_FL_CONDITIONAL) {
             if (ret == (void *)HOOK_COND_ALWAYSOK) {
                 /* short-circuit success value.  stop here */
@@ -100,8 +103,11 @@ void **hook_event(event_t *ep, void *data) {
          * properly. */
         if (returned == (void **)HOOK_COND_FAIL && econd != NULL)
             returned = (void **)econd;
-    } else
+    } else {
         hook_num_returns = i;
+        if (!(ep->flags & EVENT_FL_NORETURN))
+            returned = hookreturns; /* see above */
+    }
 
     /* trash the hooks which are deferred (will be all of them if this is a
      * 'hookonce' event. */
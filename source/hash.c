@@ -14,7 +14,29 @@
 IDSTRING(rcsid, "$Id: hash.c 726 2006-05-07 07:24:49Z wd $");
 
 static void resize_hash_table(hashtable_t *table, uint32_t elems);
-static unsigned int hash_get_key_hash(hashtable_t *, void *, size_t);
+static uint32_t hash_get_key_hash(hashtable_t *, void *, size_t);
+static void hash_place(hashtable_t *, void *, uint32_t, int);
+static void hash_migrate(hashtable_t *, uint32_t);
+
+/* tables are open-addressed: entries are kept right in an array of slots,
+ * and a key which collides is put in the next free slot after its own.  to
+ * keep those runs short there are HASH_SLOTS slots for every bucket the
+ * table is said to have (so tables are never more than 60% full). */
+#define HASH_SLOTS 2
+
+/* when a table grows the entries are not all moved at once, which would
+ * stall the server for large tables.  instead each insert/delete/find
+ * moves this many of the old slots to the new array. */
+#define HASH_MIGRATE_STEP 16
+
+/* old slots whose entries have been moved (or deleted) are marked with this,
+ * so lookups in the old array still walk past them. */
+static char hash_moved_ent;
+#define HASH_MOVED ((void *)&hash_moved_ent)
+
+#define HASH_KEY(table, ent) (&((char *)(ent))[(table)->keyoffset])
+#define HASH_CMPFUNC(table)                                                   \
+    ((int (*)(void *, void *, size_t))getsym((table)->cmpsym))
 
 /*
  * This function creates a hashtable with 'elems' buckets (well, not really,
@@ -36,6 +58,7 @@ hashtable_t *create_hash_table(uint32_t elems, size_t offset, size_t len,
 	int flags, const char *cmpname) {
     hashtable_t *htp = malloc(sizeof(hashtable_t));
     uint32_t real_elems = 0x80;
+    int i;
     
     /* Take elems and begin shifting real_elems to the left until it is
      * larger than, or equal in size to, elems.  If it is equal just stop,
@@ -59,73 +82,174 @@ hashtable_t *create_hash_table(uint32_t elems, size_t offset, size_t len,
 
     htp->size = real_elems;
     htp->entries = 0;
+    htp->mask = real_elems * HASH_SLOTS - 1;
+    htp->old = NULL;
+    htp->oldmask = htp->oldentries = htp->migrate = 0;
     htp->keyoffset = offset;
     htp->keylen = len;
 #ifdef DEBUG_CODE
     htp->max_per_bucket = 1;
-    htp->empty_buckets = real_elems;
+    htp->empty_buckets = htp->mask + 1;
 #endif
     htp->flags = flags;
     if (cmpname != NULL)
 	    htp->cmpsym = import_symbol((char *) cmpname);
     else
         htp->cmpsym = import_symbol("memcmp");
+    for (i = 0;i < 256;i++)
+        htp->fold[i] = (flags & HASH_FL_NOCASE ? tolower(i) : i);
 
-    htp->table = malloc(sizeof(struct hashbucket) * htp->size);
-    memset(htp->table, 0, sizeof(struct hashbucket) * htp->size);
+    htp->table = malloc(sizeof(struct hashent) * (htp->mask + 1));
+    memset(htp->table, 0, sizeof(struct hashent) * (htp->mask + 1));
 
     return htp;
 }
 
-/* hash_table destroyer.  sweep through the given table and kill off every
- * hashent */
+/* hash_table destroyer.  the entries themselves belong to the caller, so
+ * there is only the slot arrays to free. */
 void destroy_hash_table(hashtable_t *table) {
-    struct hashent *hep;
-    int i;
 
-    for (i = 0;i < table->size;i++) {
-        while (!SLIST_EMPTY(&table->table[i])) {
-            hep = SLIST_FIRST(&table->table[i]);
-            SLIST_REMOVE_HEAD(&table->table[i], lp);
-            free(hep);
-        }
-    }
+    if (table->old != NULL)
+        free(table->old);
     free(table->table);
     free(table);
 }
 
-/* this function is used to resize a hash table.  of course, to do this, it has
- * to create a new table and re-hash everything in it, so it's not very
- * efficient, however if used judiciously it should enhance performance, not
- * hinder it.  'elems' is the new size of the table. */
+/* change the fold map for the table.  every entry hashes differently under
+ * a new map, so they all get placed again from scratch. */
+void hash_set_foldmap(hashtable_t *table, const unsigned char *map) {
+    struct hashent *slots;
+    uint32_t i, start;
+
+    table->flags |= HASH_FL_NOCASE;
+    if (!memcmp(table->fold, map, sizeof(table->fold)))
+        return; /* nothing to do */
+    memcpy(table->fold, map, sizeof(table->fold));
+    if (table->entries == 0)
+        return;
+
+    /* get everything into one array, then start over with an empty one. */
+    if (table->old != NULL)
+        hash_migrate(table, table->oldmask + 1);
+    slots = table->table;
+#ifdef DEBUG_CODE
+    table->max_per_bucket = 1;
+    table->empty_buckets = table->mask + 1;
+#endif
+    table->table = malloc(sizeof(struct hashent) * (table->mask + 1));
+    memset(table->table, 0, sizeof(struct hashent) * (table->mask + 1));
+
+    /* like resize_hash_table() below, begin at an empty slot so entries
+     * with the same key keep their order. */
+    start = 0;
+    while (slots[start].ent != NULL)
+        start++;
+    i = start;
+    do {
+        if (slots[i].ent != NULL)
+            hash_place(table, slots[i].ent, hash_get_key_hash(table,
+                        slots[i].ent, table->keyoffset), 0);
+        i = (i + 1) & table->mask;
+    } while (i != start);
+    free(slots);
+}
+
+/* this function is used to resize a hash table.  a new slot array is made
+ * and the old one is kept around; its entries are moved over a few at a
+ * time by hash_migrate() as the table is used.  'elems' is the new size of
+ * the table. */
 static void resize_hash_table(hashtable_t *table, uint32_t elems) {
-    struct hashbucket *oldtable;
-    int oldsize, i;
-    struct hashent *hep;
 
-    /* preserve the old table, then create a new one.  */
-    oldtable = table->table;
-    oldsize = table->size;
+    /* if the last resize hasn't finished moving things yet, finish it now.
+     * this needs the table to double in size again before it happens, so
+     * it is quite unlikely. */
+    if (table->old != NULL)
+        hash_migrate(table, table->oldmask + 1);
+
+    table->old = table->table;
+    table->oldmask = table->mask;
+    table->oldentries = table->entries;
     table->size = elems;
-    table->entries = 0;
+    table->mask = elems * HASH_SLOTS - 1;
 #ifdef DEBUG_CODE
     table->max_per_bucket = 1;
-    table->empty_buckets = elems;
+    table->empty_buckets = table->mask + 1;
 #endif
-    table->table = malloc(sizeof(struct hashbucket) * table->size);
-    memset(table->table, 0, sizeof(struct hashbucket) * table->size);
-
-    /* now walk each bucket in the old table, pulling off individual entries
-     * and re-adding them to the table as we go */
-    for (i = 0;i < oldsize;i++) {
-        while (!SLIST_EMPTY(&oldtable[i])) {
-            hep = SLIST_FIRST(&oldtable[i]);
-            hash_insert(table, hep->ent);
-            SLIST_REMOVE_HEAD(&oldtable[i], lp);
-            free(hep);
+    table->table = malloc(sizeof(struct hashent) * (table->mask + 1));
+    memset(table->table, 0, sizeof(struct hashent) * (table->mask + 1));
+
+    /* start moving things from an empty slot.  that way no run of entries
+     * is split up, and entries with the same key stay in the same order. */
+    table->migrate = 0;
+    while (table->old[table->migrate].ent != NULL)
+        table->migrate++;
+
+    /* moved entries are added after anything already in the new array,
+     * which is fine when newer entries go first.  for tables that want the
+     * oldest entry first just move everything now. */
+    if (table->flags & HASH_FL_INSERTTAIL)
+        hash_migrate(table, table->oldmask + 1);
+}
+
+/* move up to 'count' slots worth of entries from the old slot array into
+ * the current one, and get rid of the old array once it is empty. */
+static void hash_migrate(hashtable_t *table, uint32_t count) {
+    struct hashent *slot;
+
+    while (table->old != NULL && table->oldentries > 0 && count-- > 0) {
+        slot = &table->old[table->migrate];
+        if (slot->ent != NULL && slot->ent != HASH_MOVED) {
+            hash_place(table, slot->ent, slot->hv, 0);
+            slot->ent = HASH_MOVED;
+            table->oldentries--;
         }
+        table->migrate = (table->migrate + 1) & table->oldmask;
+    }
+    if (table->old != NULL && table->oldentries == 0) {
+        free(table->old);
+        table->old = NULL;
     }
-    free(oldtable);
+}
+
+/* put 'ent' (with hash value 'hv') in the first free slot of the current
+ * array at or after its own.  if 'newest' is set the entry goes ahead of
+ * any others with the same key, so that hash_find() returns it first.  this
+ * is done by swapping it into the place of the first such entry, and then
+ * carrying on to place that one instead. */
+static void hash_place(hashtable_t *table, void *ent, uint32_t hv,
+        int newest) {
+    int (*cmpfunc)(void *, void *, size_t) = NULL;
+    struct hashent *slot;
+    uint32_t i = hv & table->mask;
+    void *tmp;
+#ifdef DEBUG_CODE
+    int probe = 1;
+#endif
+
+    while ((slot = &table->table[i])->ent != NULL) {
+        if (newest && slot->hv == hv) {
+            if (cmpfunc == NULL)
+                cmpfunc = HASH_CMPFUNC(table);
+            if (!cmpfunc(HASH_KEY(table, slot->ent), HASH_KEY(table, ent),
+                        table->keylen)) {
+                tmp = slot->ent;
+                slot->ent = ent;
+                ent = tmp;
+            }
+        }
+        i = (i + 1) & table->mask;
+#ifdef DEBUG_CODE
+        probe++;
+#endif
+    }
+    slot->ent = ent;
+    slot->hv = hv;
+
+#ifdef DEBUG_CODE
+    table->empty_buckets--; /* this slot isn't empty now */
+    if (probe > table->max_per_bucket)
+        table->max_per_bucket = probe;
+#endif
 }
 
 /*
@@ -156,163 +280,120 @@ static void resize_hash_table(hashtable_t *table, uint32_t elems) {
   c -= a; c -= b; c ^= (b>>15);                                               \
 }
 
+/* pull four bytes from 'k' into a word, least significant first.  FOLD4
+ * passes each through the table's fold map on the way. */
+#define LOAD4(k)                                                              \
+    ((uint32_t)(k)[0] | ((uint32_t)(k)[1] << 8) |                             \
+     ((uint32_t)(k)[2] << 16) | ((uint32_t)(k)[3] << 24))
+#define FOLD4(k)                                                              \
+    ((uint32_t)fold[(k)[0]] | ((uint32_t)fold[(k)[1]] << 8) |                 \
+     ((uint32_t)fold[(k)[2]] << 16) | ((uint32_t)fold[(k)[3]] << 24))
+
 /* this function allows you to get the hash of a given key.  it must be used in
  * the context of the table, of course.  it is mostly useful for insert/delete
  * below, and also for searching, but the included function should do that for
- * you adequately. */
-uint32_t hash_get_key_hash(hashtable_t *table, void *key,
+ * you adequately.
+ *
+ * string keys are folded, measured and hashed in a single pass: bytes are
+ * gathered (folded) into a block until it holds twelve, which is then mixed
+ * in, so there is no need to strlen() the key first.  fixed length keys are
+ * taken a word at a time. */
+static uint32_t hash_get_key_hash(hashtable_t *table, void *key,
         size_t offset) {
     register uint32_t a, b, c;
-    register uint32_t len;
-    uint32_t length;
-    unsigned char *ckey = (unsigned char *)key + offset;
+    uint32_t length, len;
+    const unsigned char *ckey = (unsigned char *)key + offset;
+    const unsigned char *fold = table->fold;
+    unsigned char blk[12];
+    uint32_t w[3];
 
     /* Set up the internal state */
-    if (table->flags & HASH_FL_STRING) {
-        length = strlen(ckey);
-        if (length > table->keylen)
-            /* they may ask to only hash on the first n bytes ... 
-             * XXX: What if they actually want to hash the LAST n bytes (say
-             * for a filename or URL)?  There ought to be a flag... */
-            length = table->keylen;
-    } else
-        length = table->keylen;
-   
-    len = length;
     a = b = 0x9e3779b9;  /* the golden ratio; an arbitrary value */
     c = 0xb33ff00d;      /* the previous hash value (UNUSED initval
                             functionality) */
 
-    /* XXX: So in order to support case insensitive hashing I simply took
-     * the below code and duped it further down to key generation on those
-     * strings.  I think this will end up with faster conpiled code, though
-     * it is not pleasant to look at..  */
-    if (table->flags & HASH_FL_NOCASE) {
-        while (len >= 12) {
-            a += ( (uint32_t)tolower(ckey[0]) +
-                  ((uint32_t)tolower(ckey[1]) << 8) +
-                  ((uint32_t)tolower(ckey[2]) << 16) +
-                  ((uint32_t)tolower(ckey[3]) << 24));
-            b += ( (uint32_t)tolower(ckey[5]) +
-                  ((uint32_t)tolower(ckey[6]) << 8) +
-                  ((uint32_t)tolower(ckey[7]) << 16) +
-                  ((uint32_t)tolower(ckey[8]) << 24));
-            c += ( (uint32_t)tolower(ckey[9]) +
-                  ((uint32_t)tolower(ckey[10]) << 8) +
-                  ((uint32_t)tolower(ckey[11]) << 16) +
-                  ((uint32_t)tolower(ckey[12]) << 24));
-           mix(a, b, c);
-           ckey += 12; len -= 12;
-        }
-
-        c += length;
-
-        /* deal with the last 11 (or less) bytes */
-        switch (len) { /* all the case statements fall through */
-        case 11: c += ((uint32_t)tolower(ckey[10]) << 24);
-        case 10: c += ((uint32_t)tolower(ckey[9]) << 16);
-        case 9:  c += ((uint32_t)tolower(ckey[8]) << 8);
-           /* the first byte of c is reserved for the length */
-        case 8:  b += ((uint32_t)tolower(ckey[7]) << 24);
-        case 7:  b += ((uint32_t)tolower(ckey[6]) << 16);
-        case 6:  b += ((uint32_t)tolower(ckey[5]) << 8);
-        case 5:  b += ((uint32_t)tolower(ckey[4]));
-        case 4:  b += ((uint32_t)tolower(ckey[3]) << 24);
-        case 3:  b += ((uint32_t)tolower(ckey[2]) << 16);
-        case 2:  b += ((uint32_t)tolower(ckey[1]) << 8);
-        case 1:  b += ((uint32_t)tolower(ckey[0]));
-        /* case 0: nothing left to add */
+    if (table->flags & HASH_FL_STRING) {
+        /* they may ask to only hash on the first n bytes ... 
+         * XXX: What if they actually want to hash the LAST n bytes (say
+         * for a filename or URL)?  There ought to be a flag... */
+        length = len = 0;
+        while (length < table->keylen && ckey[length] != '\0') {
+            blk[len++] = fold[ckey[length++]];
+            if (len == 12) {
+                a += LOAD4(blk);
+                b += LOAD4(blk + 4);
+                c += LOAD4(blk + 8);
+                mix(a, b, c);
+                len = 0;
+            }
         }
-        mix(a, b, c);
     } else {
-        while (len >= 12) {
-            a += ( (uint32_t)ckey[0] +
-                  ((uint32_t)ckey[1] << 8) +
-                  ((uint32_t)ckey[2] << 16) +
-                  ((uint32_t)ckey[3] << 24));
-            b += ( (uint32_t)ckey[5] +
-                  ((uint32_t)ckey[6] << 8) +
-                  ((uint32_t)ckey[7] << 16) +
-                  ((uint32_t)ckey[8] << 24));
-            c += ( (uint32_t)ckey[9] +
-                  ((uint32_t)ckey[10] << 8) +
-                  ((uint32_t)ckey[11] << 16) +
-                  ((uint32_t)ckey[12] << 24));
-           mix(a, b, c);
-           ckey += 12; len -= 12;
+        length = len = table->keylen;
+        if (table->flags & HASH_FL_NOCASE) {
+            while (len >= 12) {
+                a += FOLD4(ckey);
+                b += FOLD4(ckey + 4);
+                c += FOLD4(ckey + 8);
+                mix(a, b, c);
+                ckey += 12; len -= 12;
+            }
+        } else {
+            /* no folding to do, so just copy the words out.  this does
+             * mean the value depends on byte order, but it is never kept
+             * anywhere but in memory. */
+            while (len >= 12) {
+                memcpy(w, ckey, 12);
+                a += w[0];
+                b += w[1];
+                c += w[2];
+                mix(a, b, c);
+                ckey += 12; len -= 12;
+            }
         }
+        memcpy(blk, ckey, len);
+        if (table->flags & HASH_FL_NOCASE) {
+            uint32_t i;
 
-        c += length;
-
-        /* deal with the last 11 (or less) bytes */
-        switch (len) { /* all the case statements fall through */
-        case 11: c += ((uint32_t)ckey[10] << 24);
-        case 10: c += ((uint32_t)ckey[9] << 16);
-        case 9:  c += ((uint32_t)ckey[8] << 8);
-           /* the first byte of c is reserved for the length */
-        case 8:  b += ((uint32_t)ckey[7] << 24);
-        case 7:  b += ((uint32_t)ckey[6] << 16);
-        case 6:  b += ((uint32_t)ckey[5] << 8);
-        case 5:  b += ((uint32_t)ckey[4]);
-        case 4:  b += ((uint32_t)ckey[3] << 24);
-        case 3:  b += ((uint32_t)ckey[2] << 16);
-        case 2:  b += ((uint32_t)ckey[1] << 8);
-        case 1:  b += ((uint32_t)ckey[0]);
-        /* case 0: nothing left to add */
+            for (i = 0;i < len;i++)
+                blk[i] = fold[blk[i]];
         }
-        mix(a, b, c);
     }
 
-    /* just return the hash sized right for the table instead of asking them
-     * to do it.. */
-    return c & (table->size - 1);
+    c += length;
+
+    /* deal with the last 11 (or less) bytes, which are left in blk */
+    switch (len) { /* all the case statements fall through */
+    case 11: c += ((uint32_t)blk[10] << 24);
+    case 10: c += ((uint32_t)blk[9] << 16);
+    case 9:  c += ((uint32_t)blk[8] << 8);
+       /* the first byte of c is reserved for the length */
+    case 8:  b += ((uint32_t)blk[7] << 24);
+    case 7:  b += ((uint32_t)blk[6] << 16);
+    case 6:  b += ((uint32_t)blk[5] << 8);
+    case 5:  b += ((uint32_t)blk[4]);
+    case 4:  b += ((uint32_t)blk[3] << 24);
+    case 3:  b += ((uint32_t)blk[2] << 16);
+    case 2:  b += ((uint32_t)blk[1] << 8);
+    case 1:  b += ((uint32_t)blk[0]);
+    /* case 0: nothing left to add */
+    }
+    mix(a, b, c);
+
+    /* the whole value is returned (and kept with the entry), the callers
+     * below pick their slot from it. */
+    return c;
 }
 
 /* add the entry into the table */
 int hash_insert(hashtable_t *table, void *ent) {
-    unsigned int hash = hash_get_key_hash(table, ent, table->keyoffset);
-    struct hashent *hep = malloc(sizeof(struct hashent));
-
-    hep->hv = hash;
-#ifdef DEBUG_CODE
-    if (SLIST_EMPTY(&table->table[hash]))
-        table->empty_buckets--; /* this bucket isn't empty now */
-    else {
-        /* count the items in the bucket.  of course this is wasteful, that's
-         * why you don't debug code in production. :) */
-        struct hashent *hep2;
-        int cnt = 0;
-        SLIST_FOREACH(hep2, &table->table[hash], lp) {
-            cnt++;
-        }
-        if (cnt > table->max_per_bucket)
-            table->max_per_bucket = cnt;
-    }
-#endif
+    uint32_t hash = hash_get_key_hash(table, ent, table->keyoffset);
 
+    hash_migrate(table, HASH_MIGRATE_STEP);
     table->entries++;
-    hep->ent = ent;
-    if (table->flags & HASH_FL_INSERTTAIL) {
-        /* find the end of the list and insert data there.  this is costly,
-         * and probably not something you want to do unless you're really sure
-         * that it's what you're after... i.e. if you think new entries will
-         * be the least sought for, and you expect a lot of collisions, you
-         * would use this.. otherwise I don't know why.. */
-        struct hashent *hep2;
-
-        hep2 = SLIST_FIRST(&table->table[hash]);
-        while (hep2 != NULL)
-            if (SLIST_NEXT(hep2, lp) == NULL)
-                break;
-            else
-                hep2 = SLIST_NEXT(hep2, lp);
-
-        if (hep2 == NULL)
-            SLIST_INSERT_HEAD(&table->table[hash], hep, lp);
-        else
-            SLIST_INSERT_AFTER(hep2, hep, lp);
-    } else
-        SLIST_INSERT_HEAD(&table->table[hash], hep, lp);
+    /* unless they asked for it, new entries go ahead of old ones with the
+     * same key.  otherwise they go behind them, which is where the probe
+     * ends up anyways. */
+    hash_place(table, ent, hash, !(table->flags & HASH_FL_INSERTTAIL));
 
     /*
      * if the table has 1.2x as many entries as there are buckets, resize it so
@@ -330,7 +411,8 @@ int hash_insert(hashtable_t *table, void *ent) {
      * still not very high, whereas the costs associated with a resize
      * (in terms of memory and resizing operation considerations) are
      * relatively high.  especially when data growth is rapid, the less we
-     * resize the better off we are.
+     * resize the better off we are.  (with HASH_SLOTS slots per bucket this
+     * keeps at least 40% of the slots free, which open addressing needs.)
      *
      * TODO: Allow consumers of hash tables to specify a growth ratio
      * instead of making this static.
@@ -343,87 +425,88 @@ int hash_insert(hashtable_t *table, void *ent) {
 
 /* remove the entry from the table. */
 int hash_delete(hashtable_t *table, void *ent) {
-    unsigned int hash = hash_get_key_hash(table, ent, table->keyoffset);
-    struct hashent *hep;
-
-    SLIST_FOREACH(hep, &table->table[hash], lp) {
-        if (hep->ent == ent)
-            break;
+    uint32_t hash = hash_get_key_hash(table, ent, table->keyoffset);
+    struct hashent *slot;
+    uint32_t i, j, home;
+
+    hash_migrate(table, HASH_MIGRATE_STEP);
+    i = hash & table->mask;
+    while ((slot = &table->table[i])->ent != NULL && slot->ent != ent)
+        i = (i + 1) & table->mask;
+
+    if (slot->ent == NULL) {
+        /* it may not have been moved out of the old slots yet.  there it
+         * is just marked as moved, since nothing is added to them. */
+        if (table->old == NULL)
+            return 0;
+        i = hash & table->oldmask;
+        while ((slot = &table->old[i])->ent != NULL && slot->ent != ent)
+            i = (i + 1) & table->oldmask;
+        if (slot->ent == NULL)
+            return 0;
+
+        slot->ent = HASH_MOVED;
+        table->entries--;
+        if (--table->oldentries == 0) {
+            free(table->old);
+            table->old = NULL;
+        }
+        return 1;
     }
-    if (hep == NULL)
-        return 0;
 
+    /* now close the gap.  walk the run of entries after the slot, and move
+     * back any entry whose own slot is not between the gap and where it
+     * sits now.  the gap moves on to where that entry was, and we are done
+     * once an empty slot is reached. */
+    j = i;
+    while (table->table[(j = (j + 1) & table->mask)].ent != NULL) {
+        home = table->table[j].hv & table->mask;
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            table->table[i] = table->table[j];
+            i = j;
+        }
+    }
+    table->table[i].ent = NULL;
     table->entries--;
-    SLIST_REMOVE(&table->table[hash], hep, hashent, lp);
-    free(hep);
 
 #ifdef DEBUG_CODE
-    if (SLIST_EMPTY(&table->table[hash]))
-        table->empty_buckets++; /* this bucket is empty again. */
+    table->empty_buckets++; /* one more empty slot. */
 #endif
 
     return 1;
 }
 
-/* last, but not least, the find functions.  given the table and the key to
- * look for, it hashes the key, and then calls the compare function in the
- * given table slice until it finds the item, or reaches the end of the
- * list. */
+/* last, but not least, the find function.  given the table and the key to
+ * look for, it hashes the key, and then calls the compare function on each
+ * entry with the same hash value in the run of slots starting at the key's
+ * own until it finds the item or reaches an empty slot.  if the table is
+ * still being resized the old slots are checked the same way afterwards. */
 void *hash_find(hashtable_t *table, void *key) {
-    unsigned int hash = hash_get_key_hash(table, key, 0);
-    struct hashbucket *bucket = &table->table[hash];
-    struct hashent *hep;
-    int (*cmpfunc)(void *, void *, size_t) =
-        (int (*)(void *, void *, size_t))getsym(table->cmpsym);
-
-    SLIST_FOREACH(hep, bucket, lp) {
-        if (hep->hv == hash && !cmpfunc(&((char *)hep->ent)[table->keyoffset],
-                    key, table->keylen))
-            return hep->ent;
+    uint32_t hash = hash_get_key_hash(table, key, 0);
+    struct hashent *slot;
+    uint32_t i;
+    int (*cmpfunc)(void *, void *, size_t) = HASH_CMPFUNC(table);
+
+    hash_migrate(table, HASH_MIGRATE_STEP);
+    i = hash & table->mask;
+    while ((slot = &table->table[i])->ent != NULL) {
+        if (slot->hv == hash && !cmpfunc(HASH_KEY(table, slot->ent), key,
+                    table->keylen))
+            return slot->ent;
+        i = (i + 1) & table->mask;
     }
 
-    return NULL; /* not found */
-}
-
-/* I haven't found a use for this code yet... */
-#if 0
-static struct hashent *hash_find_ent(hashtable_t *, void *);
-static struct hashent *hash_find_ent_next(hashtable_t *, void *, struct hashent *);
-
-/* this function finds the first 'hashent' of the given key, it returns a
- * hashent so that calls to the _next variant can be a bit faster. */
-static struct hashent *hash_find_ent(hashtable_t *table, void *key) {
-    unsigned int hash = hash_get_key_hash(table, key, 0);
-    struct hashbucket *bucket = &table->table[hash];
-    struct hashent *hep;
-    int (*cmpfunc)(void *, void *, size_t) =
-        (int (*)(void *, void *, size_t))getsym(table->cmpsym);
-
-    SLIST_FOREACH(hep, bucket, lp) {
-        if (hep->hv == hash && !cmpfunc(&((char *)hep->ent)[table->keyoffset],
-                    key, table->keylen))
-            return hep;
+    if (table->old != NULL) {
+        i = hash & table->oldmask;
+        while ((slot = &table->old[i])->ent != NULL) {
+            if (slot->ent != HASH_MOVED && slot->hv == hash &&
+                    !cmpfunc(HASH_KEY(table, slot->ent), key, table->keylen))
+                return slot->ent;
+            i = (i + 1) & table->oldmask;
+        }
     }
 
     return NULL; /* not found */
 }
 
-/* this function finds the next entry matching the key after 'ent' */
-static struct hashent *hash_find_ent_next(hashtable_t *table, void *key,
-        struct hashent *ent) {
-    struct hashent *hep = ent;
-    int (*cmpfunc)(void *, void *, size_t) =
-        (int (*)(void *, void *, size_t))getsym(table->cmpsym);
-
-    /* we know where we are .. */
-    while ((hep = SLIST_NEXT(hep, lp)) != NULL) {
-        if (!cmpfunc(&((char *)hep->ent)[table->keyoffset], key,
-                    table->keylen))
-            return hep;
-    }
-
-    return NULL;
-}
-#endif
-    
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */
@@ -0,0 +1,102 @@
+/*
+ * heap.c: block heap allocator
+ *
+ * Copyright 2002 the Ithildin Project.
+ * See the COPYING file for more information on licensing and use.
+ *
+ * This implements the simple 'blockheap' allocator described in
+ * doc/heaps.txt.  Items of a single size are carved out of larger blocks,
+ * and freed items are kept on a list inside the heap to be handed out
+ * again, instead of being returned to the system.
+ */
+
+#include <ithildin/stand.h>
+
+IDSTRING(rcsid, "$Id$");
+
+static void heap_grow(heap_t *);
+
+/* this creates a new heap of items which are 'size' bytes long, allocated
+ * 'count' at a time.  the name is purely informational.  every heap is kept
+ * in me.heaps so that statistics can be gathered. */
+heap_t *create_heap(size_t size, int count, const char *name) {
+    heap_t *hp = malloc(sizeof(heap_t));
+
+    /* free items hold a pointer to the next free item, so items must be
+     * large enough (and aligned well enough) to do that. */
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    memset(hp, 0, sizeof(heap_t));
+    strlcpy(hp->name, name, sizeof(hp->name));
+    hp->size = size;
+    hp->count = (count > 0 ? count : 1);
+    hp->free = NULL;
+    SLIST_INIT(&hp->blocks);
+    LIST_INSERT_HEAD(&me.heaps, hp, lp);
+
+    return hp;
+}
+
+/* this destroys a heap and gives all of its memory back to the system.  any
+ * items still allocated from the heap become invalid. */
+void destroy_heap(heap_t *hp) {
+    struct heap_block *hbp;
+
+    if (hp->stats.used)
+        log_debug("destroying heap %s with %d items in use", hp->name,
+                hp->stats.used);
+    while ((hbp = SLIST_FIRST(&hp->blocks)) != NULL) {
+        SLIST_REMOVE_HEAD(&hp->blocks, lp);
+        free(hbp);
+    }
+    LIST_REMOVE(hp, lp);
+    free(hp);
+}
+
+/* allocate a new block for the heap and thread all of its items onto the
+ * free list. */
+static void heap_grow(heap_t *hp) {
+    struct heap_block *hbp;
+    char *item;
+    int i;
+    size_t hdr = (sizeof(struct heap_block) + sizeof(void *) - 1) &
+        ~(sizeof(void *) - 1);
+
+    hbp = malloc(hdr + hp->size * hp->count);
+    SLIST_INSERT_HEAD(&hp->blocks, hbp, lp);
+    hp->stats.blocks++;
+
+    item = (char *)hbp + hdr;
+    for (i = 0;i < hp->count;i++) {
+        *(void **)item = hp->free;
+        hp->free = item;
+        item += hp->size;
+    }
+}
+
+void *heap_alloc(heap_t *hp) {
+    void *item;
+
+    if (hp->free == NULL)
+        heap_grow(hp);
+
+    item = hp->free;
+    hp->free = *(void **)item;
+
+    hp->stats.allocs++;
+    if (++hp->stats.used > hp->stats.peak)
+        hp->stats.peak = hp->stats.used;
+
+    return item;
+}
+
+void heap_free(heap_t *hp, void *item) {
+
+    *(void **)item = hp->free;
+    hp->free = item;
+    hp->stats.used--;
+}
+
+/* vi:set ts=8 sts=4 sw=4 tw=76 et: */
@@ -82,6 +82,63 @@ void log_msg(enum logtypes type, const char *mod, const char *msg, ...) {
     va_end(ap);
 }
 
+/* the filters registered by hooks on the log events, see log.h */
+struct log_filter {
+    hook_function_t hook;
+    log_filter_t filter;
+
+    SLIST_ENTRY(log_filter) lp;
+};
+static SLIST_HEAD(, log_filter) log_filters =
+    SLIST_HEAD_INITIALIZER(log_filters);
+
+void log_add_filter(hook_function_t hook, log_filter_t filter) {
+    struct log_filter *lfp;
+
+    SLIST_FOREACH(lfp, &log_filters, lp) {
+        if (lfp->hook == hook)
+            break;
+    }
+    if (lfp == NULL) {
+        lfp = malloc(sizeof(struct log_filter));
+        lfp->hook = hook;
+        SLIST_INSERT_HEAD(&log_filters, lfp, lp);
+    }
+    lfp->filter = filter;
+}
+
+void log_remove_filter(hook_function_t hook) {
+    struct log_filter *lfp;
+
+    SLIST_FOREACH(lfp, &log_filters, lp) {
+        if (lfp->hook == hook) {
+            SLIST_REMOVE(&log_filters, lfp, log_filter, lp);
+            free(lfp);
+            return;
+        }
+    }
+}
+
+/* see if any hook on 'ep' might do something with a message.  hooks
+ * without a filter are assumed to want everything. */
+static bool log_wanted(event_t *ep, enum logtypes type, const char *mod) {
+    struct hook *hp;
+    struct log_filter *lfp;
+
+    SLIST_FOREACH(hp, &ep->hooks, lp) {
+        if (hp->flags & HOOK_FL_DEFERRED)
+            continue;
+        SLIST_FOREACH(lfp, &log_filters, lp) {
+            if (lfp->hook == hp->function)
+                break;
+        }
+        if (lfp == NULL || lfp->filter(type, mod))
+            return true;
+    }
+
+    return false;
+}
+
 /* Recursion protection for logged messages.  If we log_*() and then hook an
  * event which generates a log_*() we can end up in serious trouble. :) */
 #define LOG_RECURSE_MAX 10
@@ -91,40 +148,47 @@ void log_vmsg(enum logtypes type, const char *mod, const char *msg,
         va_list ap) {
     static char logmsg[LOG_MSG_MAXLEN];
     struct log_event_data led;
+    event_t *ep;
 
     if (!me.debug && type == LOGTYPE_DEBUG)
         return; /* avoid doing anything for debug messages when we don't
                    want to */
 
-    log_recursed++;
-    if (log_recursed == LOG_RECURSE_MAX) {
-        log_recursed--;
-        return;
-    }
-
-    vsnprintf(logmsg, LOG_MSG_MAXLEN, msg, ap);
-
-    led.level = type;
-    led.module = (mod != NULL ? mod : "");
-    led.msg = logmsg;
-
     switch (type) {
         case LOGTYPE_DEBUG:
-            hook_event(me.events.log_debug, (void *)&led);
+            ep = me.events.log_debug;
             break;
         case LOGTYPE_NOTICE:
-            hook_event(me.events.log_notice, (void *)&led);
+            ep = me.events.log_notice;
             break;
         case LOGTYPE_WARN:
-            hook_event(me.events.log_warn, (void *)&led);
+            ep = me.events.log_warn;
             break;
         case LOGTYPE_ERROR:
-            hook_event(me.events.log_error, (void *)&led);
+            ep = me.events.log_error;
             break;
         default:
-            hook_event(me.events.log_unknown, (void *)&led);
+            ep = me.events.log_unknown;
             break;
     }
+    if (mod == NULL)
+        mod = "";
+    if (!log_wanted(ep, type, mod))
+        return; /* nobody is going to record this, so don't format it */
+
+    log_recursed++;
+    if (log_recursed == LOG_RECURSE_MAX) {
+        log_recursed--;
+        return;
+    }
+
+    vsnprintf(logmsg, LOG_MSG_MAXLEN, msg, ap);
+
+    led.level = type;
+    led.module = mod;
+    led.msg = logmsg;
+
+    hook_event(ep, (void *)&led);
 
     log_recursed--;
 }
@@ -234,7 +234,7 @@ int main(int argc, char **argv) {
     }
 
     /* loop until poll_sockets returns 0 */
-    next = 1; /* fuh */
+    next = 1000; /* fuh */
     while (!me.shutdown && poll_sockets(next)) {
         reap_dead_sockets();
         next = exec_timers();
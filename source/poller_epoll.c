@@ -0,0 +1,70 @@
+/*
+ * poller_epoll.c: Linux epoll() polling mechanism
+ *
+ * Copyright 2002 the Ithildin Project.
+ * See the COPYING file for more information on licensing and use.
+ */
+
+IDSTRING(poller_rcsid, "$Id$");
+
+/* epoll hands back only the sockets which have something pending, along with
+ * the socket pointer we registered in socket_epoll_update(), so unlike the
+ * select and poll versions we never need to look at idle descriptors. */
+int poll_sockets(time_t timeout) {
+    int msec;
+    int ret, i;
+    struct isocket *sp;
+    uint32_t revents;
+
+    socket_run_deferred();
+
+    if (timeout == 0)
+        msec = -1;
+    else if (timeout > INT_MAX)
+        msec = INT_MAX; /* ... fuh */
+    else
+        msec = (int)timeout;
+
+    if ((ret = epoll_wait(epollfd, epoll_events, (int)maxsockets, msec)) == -1
+            && errno != EINTR) {
+        log_error("epoll_wait(%d, %p, %d, %d) error: %s", epollfd,
+                epoll_events, maxsockets, msec, strerror(errno));
+        return 0;
+    } else if (ret <= 0)
+        return 1; /* nothing to do, ho-hum */
+
+    me.now = time(NULL);
+    for (i = 0;i < ret;i++) {
+        sp = epoll_events[i].data.ptr;
+        revents = epoll_events[i].events;
+
+        if (SOCKET_DEAD(sp) || sp->fd < 0)
+            continue; /* closed earlier in this pass.  don't touch. */
+
+        if (revents & EPOLLIN)
+            sp->state |= SOCKET_FL_READ_PENDING;
+        if (revents & EPOLLOUT) {
+            sp->state |= SOCKET_FL_WRITE_PENDING;
+            socket_unmonitor(sp, SOCKET_FL_WRITE);
+        }
+        if (revents & (EPOLLERR | EPOLLHUP)) {
+            int err = 0;
+            socklen_t elen = sizeof(err);
+
+            sp->state |= SOCKET_FL_ERROR_PENDING;
+            /* no need for the bogus write() the poll() poller does, the
+             * kernel will just tell us what went wrong. */
+            if (getsockopt(sp->fd, SOL_SOCKET, SO_ERROR, &err, &elen) == 0 &&
+                    err != 0)
+                sp->err = err;
+            else
+                sp->state |= SOCKET_FL_EOF;
+        }
+
+        if (sp->state & SOCKET_FL_PENDING)
+            socket_event(sp);
+    }
+
+    return 1;
+}
+/* vi:set ts=8 sts=4 sw=4 tw=76 et: */
@@ -8,11 +8,15 @@
 IDSTRING(poller_rcsid, "$Id: poller_kqueue.c 578 2005-08-21 06:37:53Z wd $");
 
 int poll_sockets(time_t timeout) {
-    struct timespec tv = {timeout, 0};
+    struct timespec tv = {timeout / 1000, (timeout % 1000) * 1000000};
     struct kevent *ke = kev_list;
-    int ret = kevent(kqueuefd, kev_change, kev_num_changes, ke,
-            (signed int)maxsockets * 2, (timeout ? &tv : NULL));
+    int ret;
     struct isocket *sp;
+    int nready = 0, i;
+
+    socket_run_deferred();
+    ret = kevent(kqueuefd, kev_change, kev_num_changes, ke,
+            (signed int)maxsockets * 2, (timeout ? &tv : NULL));
 
     if (ret == -1 && errno != EINTR) {
         log_error("kevent(%d, %p, %d, %p, %d, %p) error: %s", kqueuefd,
@@ -31,6 +35,12 @@ int poll_sockets(time_t timeout) {
                     ke[ret].filter, strerror(ke[ret].data));
         else if (ke[ret].udata != NULL) {
             sp = ke[ret].udata;
+            if (SOCKET_DEAD(sp) || sp->fd < 0)
+                continue; /* dead socket. */
+            /* a socket can show up here twice (once for each filter), in
+             * which case the second dispatch below finds nothing pending
+             * and is skipped. */
+            readysockets[nready++] = sp;
             if (ke[ret].filter == EVFILT_READ) {
                 if (ke[ret].flags & EV_EOF) {
                     sp->state |= SOCKET_FL_ERROR_PENDING;
@@ -51,9 +61,10 @@ int poll_sockets(time_t timeout) {
         }
     }
 
-    LIST_FOREACH(sp, &allsockets, intlp) {
+    for (i = 0;i < nready;i++) {
+        sp = readysockets[i];
         if (SOCKET_DEAD(sp) || sp->fd < 0)
-            continue; /* dead socket. */
+            continue; /* closed by an earlier hook. */
 
         if (sp->state & SOCKET_FL_PENDING)
             socket_event(sp);
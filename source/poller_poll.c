@@ -7,46 +7,72 @@
 
 IDSTRING(poller_rcsid, "$Id: poller_poll.c 578 2005-08-21 06:37:53Z wd $");
 
+/* not everybody has this (Linux doesn't) */
+#ifndef INFTIM
+# define INFTIM -1
+#endif
+
 int poll_sockets(time_t timeout) {
     int msec;
-    int ret;
+    int ret, fd, nready, i;
     struct isocket *sp;
 
+    socket_run_deferred();
+
     if (timeout == 0)
         msec = INFTIM;
-    else if ((msec = timeout * 1000) <= 0)
+    else if (timeout > INT_MAX)
         msec = INT_MAX; /* ... fuh */
+    else
+        msec = (int)timeout;
 
-    if ((ret = poll(pollfds, maxsockets, msec)) == -1 && errno != EINTR) {
-        log_error("poll(%p, %d, %d) error: %s", pollfds, maxsockets,
+    /* pollfds is indexed by descriptor, so we only need to hand the kernel
+     * the part of it that might actually be in use. */
+    if ((ret = poll(pollfds, highsocket, msec)) == -1 && errno != EINTR) {
+        log_error("poll(%p, %d, %d) error: %s", pollfds, highsocket,
                 msec, strerror(errno));
         return 0;
     } else if (ret <= 0)
         return 1;
 
+    /* first pick out the sockets with events pending.  we stop looking as
+     * soon as we've seen as many as poll() told us about. */
     me.now = time(NULL);
-    LIST_FOREACH(sp, &allsockets, intlp) {
-        if (SOCKET_DEAD(sp) || sp->fd < 0)
+    nready = 0;
+    for (fd = 0;ret > 0 && fd < highsocket;fd++) {
+        if (!pollfds[fd].revents)
+            continue;
+        ret--;
+        sp = fdsockets[fd];
+        if (sp == NULL || SOCKET_DEAD(sp))
             continue; /* dead socket.  don't touch. */
-        if (pollfds[sp->fd].revents) {
-            if (pollfds[sp->fd].revents & POLLIN)
-                sp->state |= SOCKET_FL_READ_PENDING;
-            if (pollfds[sp->fd].revents & POLLOUT) {
-                sp->state |= SOCKET_FL_WRITE_PENDING;
-                socket_unmonitor(sp, SOCKET_FL_WRITE);
-            }
-            if (pollfds[sp->fd].revents & (POLLERR|POLLHUP|POLLNVAL)) {
-                sp->state |= SOCKET_FL_ERROR_PENDING;
-                /* attempt a bogus write to get errno.  yech */
-                if (write(sp->fd, &sp->state, sizeof(sp->state)) != -1) {
-                    log_error("yipes! poll() lied to me!");
-                    me.shutdown = 1;
-                    return 0;
-                }
-                sp->err = errno;
-            }
 
+        if (pollfds[fd].revents & POLLIN)
+            sp->state |= SOCKET_FL_READ_PENDING;
+        if (pollfds[fd].revents & POLLOUT) {
+            sp->state |= SOCKET_FL_WRITE_PENDING;
+            socket_unmonitor(sp, SOCKET_FL_WRITE);
         }
+        if (pollfds[fd].revents & (POLLERR|POLLHUP|POLLNVAL)) {
+            sp->state |= SOCKET_FL_ERROR_PENDING;
+            /* attempt a bogus write to get errno.  yech */
+            if (write(sp->fd, &sp->state, sizeof(sp->state)) != -1) {
+                log_error("yipes! poll() lied to me!");
+                me.shutdown = 1;
+                return 0;
+            }
+            sp->err = errno;
+        }
+        if (sp->state & SOCKET_FL_PENDING)
+            readysockets[nready++] = sp;
+    }
+
+    /* and now dispatch them.  any of the sockets may have been closed by an
+     * earlier socket's hook, so check again. */
+    for (i = 0;i < nready;i++) {
+        sp = readysockets[i];
+        if (SOCKET_DEAD(sp) || sp->fd < 0)
+            continue;
         if (sp->state & SOCKET_FL_PENDING)
             socket_event(sp);
     }
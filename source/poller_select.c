@@ -9,31 +9,50 @@ IDSTRING(poller_rcsid, "$Id: poller_select.c 578 2005-08-21 06:37:53Z wd $");
 
 int poll_sockets(time_t timeout) {
     fd_set rfds, wfds;
-    struct timeval tv = {timeout, 0}; /* sleep at most 50ms */
+    struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
     struct isocket *sp;
-    int ret;
+    int ret, fd, nready, i;
+
+    socket_run_deferred();
 
     memcpy(&rfds, &select_rfds, sizeof(fd_set));
     memcpy(&wfds, &select_wfds, sizeof(fd_set));
 
-    if ((ret = select(maxsockets, &rfds, &wfds, NULL,
+    if ((ret = select(highsocket, &rfds, &wfds, NULL,
                     (timeout ? &tv : NULL))) == -1 && errno != EINTR) {
-        log_error("select(%d, %p, %p, NULL, %p) error: %s", maxsockets, &rfds,
+        log_error("select(%d, %p, %p, NULL, %p) error: %s", highsocket, &rfds,
                 &wfds, &tv, strerror(errno));
         return 0;
     } else if (ret <= 0)
         return 1; /* nothing to do, but nothing wrong */
 
+    /* pick out the sockets which have something pending first.  select()
+     * counts read and write readiness separately, so ret is an upper bound
+     * on the number of sockets we'll find. */
     me.now = time(NULL);
-    LIST_FOREACH(sp, &allsockets, intlp) {
-        if (SOCKET_DEAD(sp) || sp->fd < 0)
+    nready = 0;
+    for (fd = 0;ret > 0 && fd < highsocket;fd++) {
+        if ((sp = fdsockets[fd]) == NULL || SOCKET_DEAD(sp))
             continue; /* dead socket. */
-        if (FD_ISSET(sp->fd, &rfds))
+        if (FD_ISSET(fd, &rfds)) {
             sp->state |= SOCKET_FL_READ_PENDING;
-        if (FD_ISSET(sp->fd, &wfds)) {
+            ret--;
+        }
+        if (FD_ISSET(fd, &wfds)) {
             sp->state |= SOCKET_FL_WRITE_PENDING;
             socket_unmonitor(sp, SOCKET_FL_WRITE);
+            ret--;
         }
+        if (sp->state & SOCKET_FL_PENDING)
+            readysockets[nready++] = sp;
+    }
+
+    /* now dispatch them, bearing in mind that earlier hooks may have closed
+     * some of the sockets further along in the list. */
+    for (i = 0;i < nready;i++) {
+        sp = readysockets[i];
+        if (SOCKET_DEAD(sp) || sp->fd < 0)
+            continue;
         if (sp->state & SOCKET_FL_PENDING)
             socket_event(sp);
     }
@@ -23,6 +23,11 @@ IDSTRING(rcsid, "$Id: socket.c 779 2006-10-02 00:56:39Z wd $");
 
 static int socket_setflags(int fd);
 static inline void socket_event(isocket_t *);
+static void socket_defer_error(isocket_t *);
+static void socket_run_deferred(void);
+#ifdef POLLER_EPOLL
+static void socket_epoll_update(isocket_t *, uint32_t);
+#endif
 HOOK_FUNCTION(adjust_maxsockets);
 
 unsigned int maxsockets = 1024; /* default is for 1024 sockets maximum */
@@ -33,12 +38,32 @@ struct isocket_list allsockets;
 fd_set select_rfds, select_wfds;
 #elif defined(POLLER_POLL)
 struct pollfd *pollfds = NULL;
+#elif defined(POLLER_EPOLL)
+int epollfd;
+struct epoll_event *epoll_events = NULL;
 #elif defined(POLLER_KQUEUE)
 int kqueuefd;
 struct kevent *kev_list = NULL, *kev_change = NULL;
 int kev_num_changes;
 #endif
 
+#if defined(POLLER_SELECT) || defined(POLLER_POLL)
+/* these map file descriptors back to the sockets using them, so that the
+ * pollers which only hand back descriptors do not need to search the socket
+ * list.  highsocket is one more than the highest descriptor in the map. */
+isocket_t **fdsockets = NULL;
+int highsocket = 0;
+#endif
+#ifndef POLLER_EPOLL
+/* the pollers gather sockets with pending events here before dispatching
+ * them, so only sockets with something to do get looked at. */
+isocket_t **readysockets = NULL;
+#endif
+/* sockets which had an error flagged on them outside of the poller, see
+ * socket_defer_error() below. */
+static isocket_t **defersockets = NULL;
+static int ndefersockets = 0;
+
 /* hints structure.  pretty meager, except that we assume we're going to
  * listen() by default */
 struct addrinfo gai_hint;
@@ -59,6 +84,14 @@ void init_socketsystem(void) {
         printf("error creating kqueue fd: %s\n", strerror(errno));
         exit(1);
     }
+#elif defined(POLLER_EPOLL)
+    /* the size argument is only a hint (and ignored by modern kernels), but
+     * it must be positive. */
+    epollfd = epoll_create(maxsockets);
+    if (epollfd == -1) {
+        printf("error creating epoll fd: %s\n", strerror(errno));
+        exit(1);
+    }
 #endif
 
     gai_hint.ai_flags = AI_PASSIVE;
@@ -74,7 +107,7 @@ void init_socketsystem(void) {
 
 HOOK_FUNCTION(adjust_maxsockets) {
     unsigned long oldmax = maxsockets;
-#if defined(POLLER_POLL)
+#if defined(POLLER_SELECT) || defined(POLLER_POLL)
     int i;
 #endif
     char *s = conf_find_entry("maxsockets", me.confhead, 1);
@@ -120,7 +153,22 @@ HOOK_FUNCTION(adjust_maxsockets) {
 #elif defined(POLLER_KQUEUE)
     kev_list = realloc(kev_list, sizeof(struct kevent) * maxsockets * 2);
     kev_change = realloc(kev_change, sizeof(struct kevent) * maxsockets);
+#elif defined(POLLER_EPOLL)
+    epoll_events = realloc(epoll_events,
+            sizeof(struct epoll_event) * maxsockets);
+#endif
+#if defined(POLLER_SELECT) || defined(POLLER_POLL)
+    fdsockets = realloc(fdsockets, sizeof(isocket_t *) * maxsockets);
+    for (i = oldmax;i < maxsockets;i++)
+        fdsockets[i] = NULL;
 #endif
+#if defined(POLLER_KQUEUE)
+    readysockets = realloc(readysockets,
+            sizeof(isocket_t *) * maxsockets * 2);
+#elif !defined(POLLER_EPOLL)
+    readysockets = realloc(readysockets, sizeof(isocket_t *) * maxsockets);
+#endif
+    defersockets = realloc(defersockets, sizeof(isocket_t *) * maxsockets);
 
     return 0;
 }
@@ -138,6 +186,9 @@ isocket_t *create_socket(void) {
     sock->sockaddr.addr = sock->peeraddr.addr = NULL;
     sock->sockaddr.family = sock->peeraddr.family = PF_UNSPEC;
     sock->fd = -1;
+#ifdef POLLER_EPOLL
+    sock->pollmask = 0;
+#endif
 #ifdef HAVE_OPENSSL
     sock->ssl = NULL;
     sock->ssl_start = 0;
@@ -230,6 +281,12 @@ int close_socket(isocket_t *sock) {
     }
 #endif
 
+#ifdef POLLER_EPOLL
+    /* epoll only forgets a descriptor when the last copy of it is closed,
+     * and a forked child may still hold one, so take it out of the
+     * interest set by hand first. */
+    socket_epoll_update(sock, 0);
+#endif
     if (close(sock->fd)) {
         log_error("close() failed: %s", strerror(errno));
         sock->err = errno;
@@ -241,10 +298,17 @@ int close_socket(isocket_t *sock) {
 
     /* any events associated with this socket will be deleted automagically
      * when it is no longer valid at the next call to kevent, so don't bother
-     * doing it */
-#ifndef POLLER_KQUEUE
+     * doing it.  epoll was dealt with above. */
+#if !defined(POLLER_KQUEUE) && !defined(POLLER_EPOLL)
     socket_unmonitor(sock, SOCKET_FL_PENDING); /* turn it all off */
 #endif
+#if defined(POLLER_SELECT) || defined(POLLER_POLL)
+    if (sock->fd < highsocket && fdsockets[sock->fd] == sock) {
+        fdsockets[sock->fd] = NULL;
+        while (highsocket > 0 && fdsockets[highsocket - 1] == NULL)
+            highsocket--;
+    }
+#endif
 
     sock->fd = -1;
     return 1;
@@ -571,16 +635,16 @@ int socket_write(isocket_t *sock, char *buf, size_t nbytes) {
                 } else
                     log_debug("socket_write(SSL%d, %p, %d): %s", sock->fd, buf,
                             nbytes, ERR_error_string(ERR_get_error(), NULL));
-                sock->state |= SOCKET_FL_ERROR_PENDING;
+                socket_defer_error(sock);
                 return -1;
             case SSL_ERROR_SSL:
                 /* This is a pretty nasty case. */
                 log_error("socket_write(SSL%d, %p, %d): %s", sock->fd, buf,
                         nbytes, ERR_error_string(ERR_get_error(), NULL));
-                sock->state |= SOCKET_FL_ERROR_PENDING;
+                socket_defer_error(sock);
                 return -1;
             default:
-                sock->state |= SOCKET_FL_ERROR_PENDING;
+                socket_defer_error(sock);
                 return -1;
         }
     else
@@ -594,7 +658,7 @@ int socket_write(isocket_t *sock, char *buf, size_t nbytes) {
                     socket_monitor(sock, SOCKET_FL_WRITE);
                 return 0;
             default:
-                sock->state |= SOCKET_FL_ERROR_PENDING;
+                socket_defer_error(sock);
                 sock->err = errno;
                 return -1;
         }
@@ -607,6 +671,64 @@ int socket_write(isocket_t *sock, char *buf, size_t nbytes) {
     return ret;
 }
 
+/* this works like socket_write() above, but gathers the data to write from
+ * 'iovcnt' iovec structures, so that many small buffers can be written with
+ * a single system call.  SSL sockets (and systems without writev()) have
+ * each buffer written in turn until one of them comes up short.  the return
+ * value is the same as for socket_write(). */
+int socket_writev(isocket_t *sock, struct iovec *iov, int iovcnt) {
+    int ret, i;
+    size_t nbytes = 0;
+
+    if (!(sock->state & SOCKET_FL_OPEN))
+        return -1;
+
+    for (i = 0;i < iovcnt;i++)
+        nbytes += iov[i].iov_len;
+    assert(nbytes > 0 && nbytes < INT_MAX);
+
+#ifdef HAVE_WRITEV
+# ifdef HAVE_OPENSSL
+    if (!SOCKET_SSL(sock))
+# endif
+    {
+        errno = 0;
+        if ((ret = writev(sock->fd, iov, iovcnt)) == -1) {
+            switch (errno) {
+                case EAGAIN:
+                case EINTR:
+                    sock->state &= ~SOCKET_FL_WRITE_PENDING;
+                    if (sock->state & SOCKET_FL_WANT_WRITE)
+                        socket_monitor(sock, SOCKET_FL_WRITE);
+                    return 0;
+                default:
+                    socket_defer_error(sock);
+                    sock->err = errno;
+                    return -1;
+            }
+        }
+
+        if ((size_t)ret != nbytes && sock->state & SOCKET_FL_WANT_WRITE) {
+            sock->state &= ~SOCKET_FL_WRITE_PENDING;
+            socket_monitor(sock, SOCKET_FL_WRITE);
+        }
+        return ret;
+    }
+#endif
+
+    nbytes = 0;
+    for (i = 0;i < iovcnt;i++) {
+        if (iov[i].iov_len == 0)
+            continue;
+        if ((ret = socket_write(sock, iov[i].iov_base, iov[i].iov_len)) < 0)
+            return (nbytes > 0 ? (int)nbytes : -1);
+        nbytes += ret;
+        if ((size_t)ret != iov[i].iov_len)
+            break;
+    }
+    return (int)nbytes;
+}
+
 /* a little function which will return the error condition of a socket.  Unless
  * the socket has an internal error (currently just EOF) we simply return
  * strerror on the socket's errno value */
@@ -637,6 +759,11 @@ void socket_monitor(isocket_t *sock, int mask) {
             sock->state |= SOCKET_FL_WANT_WRITE;
     }
 
+#if defined(POLLER_SELECT) || defined(POLLER_POLL)
+    fdsockets[sock->fd] = sock;
+    if (sock->fd >= highsocket)
+        highsocket = sock->fd + 1;
+#endif
 #if defined(POLLER_SELECT)
     if (mask & SOCKET_FL_READ)
         FD_SET(sock->fd, &select_rfds);
@@ -660,6 +787,16 @@ void socket_monitor(isocket_t *sock, int mask) {
                 (void *)sock);
         kev_num_changes++;
     }
+#elif defined(POLLER_EPOLL)
+    {
+        uint32_t events = sock->pollmask;
+
+        if (mask & SOCKET_FL_READ)
+            events |= EPOLLIN;
+        if (mask & SOCKET_FL_WRITE)
+            events |= EPOLLOUT;
+        socket_epoll_update(sock, events);
+    }
 #endif
 }
 void socket_unmonitor(isocket_t *sock, int mask) {
@@ -698,9 +835,51 @@ void socket_unmonitor(isocket_t *sock, int mask) {
         EV_SET(ke, sock->fd, EVFILT_WRITE, EV_DISABLE, 0, 0, (void *)sock);
         kev_num_changes++;
     }
+#elif defined(POLLER_EPOLL)
+    {
+        uint32_t events = sock->pollmask;
+
+        if (mask & SOCKET_FL_READ)
+            events &= ~EPOLLIN;
+        if (mask & SOCKET_FL_WRITE)
+            events &= ~EPOLLOUT;
+        socket_epoll_update(sock, events);
+    }
 #endif
 }
 
+#ifdef POLLER_EPOLL
+/* this brings the kernel's interest set for the socket in line with the given
+ * event mask.  unlike the other pollers epoll keeps its state in the kernel,
+ * so we remember what we last told it in the socket itself and only make a
+ * system call when that changes.  the socket pointer is handed to the kernel
+ * so that poll_sockets() gets it back directly with each event. */
+static void socket_epoll_update(isocket_t *sock, uint32_t events) {
+    struct epoll_event ev;
+    int op;
+
+    if (events == sock->pollmask || sock->fd < 0)
+        return;
+
+    if (sock->pollmask == 0)
+        op = EPOLL_CTL_ADD;
+    else if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = sock;
+    if (epoll_ctl(epollfd, op, sock->fd, &ev) == -1) {
+        log_error("epoll_ctl(%d, %d, %d) error: %s", epollfd, op, sock->fd,
+                strerror(errno));
+        return;
+    }
+    sock->pollmask = events;
+}
+#endif
+
 /* this sets a socket as non-blocking, and possibly sets some other useful
  * options.  currently we only support fcntl() for doing this. */
 static int socket_setflags(int fd) {
@@ -735,8 +914,9 @@ void reap_dead_sockets(void) {
     while (sp != NULL) {
         sp2 = LIST_NEXT(sp, intlp);
 
-        /* if it's dead, clear it away. */
-        if (SOCKET_DEAD(sp)) {
+        /* if it's dead, clear it away.  sockets still waiting on a deferred
+         * event are left for the next go-around. */
+        if (SOCKET_DEAD(sp) && !(sp->state & SOCKET_FL_DEFERRED)) {
             if (sp->sockaddr.addr != NULL)
                 free(sp->sockaddr.addr);
             if (sp->peeraddr.addr != NULL)
@@ -749,10 +929,9 @@ void reap_dead_sockets(void) {
         else if (SOCKET_SSL(sp) && sp->ssl_start != 0 &&
                 SOCKET_SSL_HANDSHAKING(sp) &&
                 sp->ssl_start + me.ssl.hs_timeout < me.now) {
-            sp->state |= SOCKET_FL_ERROR_PENDING; /* flag an error condition on
-                                                     the socket so that it will
-                                                     get hooked where it is
-                                                     necessary. */
+            socket_defer_error(sp); /* flag an error condition on the
+                                       socket so that it will get hooked
+                                       where it is necessary. */
             sp->err = ETIMEDOUT; /* set an appropriate error condition */
         }
 #endif
@@ -775,7 +954,7 @@ static inline void socket_event(isocket_t *isp) {
             /* If we're handshaking see if we can finish that off. */
             if (!socket_ssl_handshake(isp, 0)) {
                 /* some kind of fatal error occured. */
-                isp->state |= SOCKET_FL_ERROR_PENDING;
+                socket_defer_error(isp);
                 return;
             }
 
@@ -809,10 +988,41 @@ static inline void socket_event(isocket_t *isp) {
     isp->state &= ~SOCKET_FL_PENDING;
 }
 
+/* the pollers only dispatch sockets the kernel has told them about, which
+ * isn't going to include sockets where we found an error ourselves (failed
+ * writes from outside of a socket hook, SSL handshake timeouts and the like).
+ * those sockets are queued here and dispatched at the start of the next
+ * polling pass. */
+static void socket_defer_error(isocket_t *sock) {
+
+    sock->state |= SOCKET_FL_ERROR_PENDING;
+    if (!(sock->state & SOCKET_FL_DEFERRED)) {
+        sock->state |= SOCKET_FL_DEFERRED;
+        defersockets[ndefersockets++] = sock;
+    }
+}
+
+static void socket_run_deferred(void) {
+    isocket_t *sp;
+    int i;
+
+    /* hooks called from here may defer more sockets, which is why we don't
+     * cache ndefersockets. */
+    for (i = 0;i < ndefersockets;i++) {
+        sp = defersockets[i];
+        sp->state &= ~SOCKET_FL_DEFERRED;
+        if (!SOCKET_DEAD(sp) && sp->state & SOCKET_FL_PENDING)
+            socket_event(sp);
+    }
+    ndefersockets = 0;
+}
+
 #if defined(POLLER_SELECT)
 # include "poller_select.c"
 #elif defined(POLLER_POLL)
 # include "poller_poll.c"
+#elif defined(POLLER_EPOLL)
+# include "poller_epoll.c"
 #elif defined(POLLER_KQUEUE)
 # include "poller_kqueue.c"
 #elif defined(POLLER_DEVPOLL)
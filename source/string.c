@@ -395,315 +395,561 @@ int ith_vsprintf(char *str, const char *format, va_list ap) {
     return ret;
 }
 
-/* match code! */
-/* instead of setting a maximum call limit, set a maximum depth (12) which
- * should be more than sane for almost any pattern */
-#define MAX_MATCH_DEPTH 12
-#define mreturn matchdepth--;return
-
-int matchdepth;
-
-/* thanks to lucas for the recursion fixes/optimization! */
-static int _match(const char *wild, const char *string) {
-    if (++matchdepth > MAX_MATCH_DEPTH) {
-        mreturn 0;
+/* match code!  patterns are compiled into a 'matcher' (a list of tokens) and
+ * the matcher is then run against strings, instead of the pattern being
+ * re-read on every call.  match(), hostmatch() and ipmatch() keep a small
+ * cache of compiled patterns keyed on the pattern itself, so they are still
+ * fine to use with patterns which come and go.  code which checks the same
+ * pattern against many strings (or which keeps its patterns around anyway)
+ * should make its own matcher with create_matcher() and use matcher_match()
+ * and matcher_ipmatch().
+ *
+ * the tokens are '*' (any run of characters), '?' (any single character),
+ * a run of literal characters, and for hostmatch() patterns a [set] of
+ * characters (or a [:class:]) and a (choice|of|strings).  all comparisons
+ * are case insensitive.  matching does not recurse: each '*' leaves a point
+ * to come back to if the rest of the pattern fails, and unless the pattern
+ * has choices of differing lengths only the last of those is needed. */
+
+#define MTOK_STAR 0
+#define MTOK_ANY 1
+#define MTOK_LIT 2
+#define MTOK_SET 3
+#define MTOK_ALT 4
+
+struct match_token {
+    unsigned char type;
+    int     off;                /* offset of the literal (in lits), the
+                                   first choice (in alts) or the set (in
+                                   sets) */
+    int     len;                /* length of the literal, or the number of
+                                   choices */
+    char    anchor[4];          /* for a literal after a '*', every
+                                   character its first character could be
+                                   (or an empty string if there are too
+                                   many) */
+};
+
+#define MATCH_K_GENERAL 0
+#define MATCH_K_NEVER 1         /* malformed, never matches anything */
+#define MATCH_K_ANY 2           /* '*' */
+#define MATCH_K_EXACT 3         /* 'literal' */
+#define MATCH_K_PREFIX 4        /* 'literal*' */
+#define MATCH_K_SUFFIX 5        /* '*literal' */
+#define MATCH_K_SUBSTR 6        /* '*literal*' */
+
+struct matcher {
+    char    *pattern;           /* the pattern as it was given */
+    int     flags;
+    int     kind;               /* one of the MATCH_K_ kinds above */
+
+    struct match_token *toks;
+    int     ntoks;
+    int     nstars;
+    bool    varlen;             /* set if any token can match strings of
+                                   different lengths */
+    bool    tail;               /* set if the last token is a literal */
+    size_t  minlen;             /* shortest string which could match */
+
+    unsigned char *lits;        /* literals, already case-folded */
+    int     *alts;              /* offset/length pairs for choices */
+    unsigned char *sets;        /* 256 bit maps for sets */
+
+    int     family;             /* for matcher_ipmatch(), the address */
+    int     bits;               /* family (0 if the pattern is not an */
+    unsigned char addr[IPADDR_SIZE]; /* address or mask) and contents */
+};
+
+#define MATCH_SET_SIZE 32
+#define MATCH_SET_HAS(set, c) ((set)[(unsigned char)(c) >> 3] &              \
+        (1 << ((unsigned char)(c) & 7)))
+#define MATCH_SET_ADD(set, c) ((set)[(unsigned char)(c) >> 3] |=             \
+        (1 << ((unsigned char)(c) & 7)))
+
+/* parse the address (and possibly the mask) in 'wild' for ipmatch.  this
+ * understands a regular address (v4/v6) and an address with a number of
+ * significant bits (v4/v6). */
+static void matcher_ip_compile(matcher_t *mp, const char *wild) {
+    char addr[IPADDR_MAXLEN + 1];
+    const char *mask;
+    int alen;
+
+    strlcpy(addr, wild, IPADDR_MAXLEN + 1);
+    /* strip off the mask portion if it is there.  we must make sure to
+     * truncate addr at the point where the mask starts as well, if it starts
+     * before IPADDR_MAXLEN. */
+    if ((mask = strchr(wild, '/')) != NULL) {
+        if (IPADDR_MAXLEN > mask - wild)
+            addr[mask - wild] = '\0';
+        mask++;
     }
 
-    while (1) {
-        /* Logic: Match * in a string, this is confusing, sort of
-         * if * is the last thing in the wildcard, the match is
-         * definite if we've gotten this far.
-         * otherwise we try and find every occurance of the
-         * the next character in the wildcard within the string
-         * and match from there, calling the function recursively
-         * until some level below us returns positive, in which
-         * case we too return positive.  For strings with lots
-         * of wildcards this gets disgustingly recursive.  */
-        if (!*wild) {
-            mreturn ((*string == '\0') ? 1 : 0);
+    mp->family = get_address_type(addr);
+    if (mp->family != PF_INET && mp->family != PF_INET6)
+        mp->family = 0;
+    else if (inet_pton(mp->family, addr, mp->addr) != 1)
+        mp->family = 0;
+    if (mp->family == 0)
+        return;
+
+    alen = (mp->family == PF_INET6 ? 128 : 32);
+    mp->bits = (mask != NULL ? str_conv_int((char *)mask, 0) : alen);
+    if (mp->bits <= 0 || mp->bits > alen)
+        mp->bits = alen;
+}
+
+matcher_t *create_matcher(const char *wild, int flags) {
+    matcher_t *mp = calloc(1, sizeof(matcher_t));
+    struct match_token *tp = NULL;
+    const char *w, *s, *end;
+    char *a;
+    unsigned char *set;
+    int (*class)(int);
+    size_t wlen = strlen(wild);
+    int nsets = 0, nalts = 0, litlen = 0;
+    int i, c;
+
+    mp->pattern = strdup(wild);
+    mp->flags = flags;
+    if (flags & MATCH_FL_IP)
+        matcher_ip_compile(mp, wild);
+
+    /* no pattern can make more tokens/literals/sets/choices than it has
+     * characters, so allocate for that and don't worry about it. */
+    mp->toks = malloc(sizeof(struct match_token) * (wlen + 1));
+    mp->lits = malloc(wlen + 1);
+    for (w = wild;*w != '\0';w++) {
+        if (*w == '[')
+            nsets++;
+        else if (*w == '(' || *w == '|')
+            nalts++;
+    }
+    mp->sets = (nsets ? malloc(MATCH_SET_SIZE * nsets) : NULL);
+    mp->alts = (nalts ? malloc(sizeof(int) * 2 * nalts) : NULL);
+    nsets = nalts = 0;
+
+    w = wild;
+    while (*w != '\0') {
+        if (*w == '*') {
+            while (*w == '*')
+                w++;
+            tp = &mp->toks[mp->ntoks++];
+            tp->type = MTOK_STAR;
+            mp->nstars++;
+            continue;
         }
-        if (*wild == '*') {
-            wild++;
-            /* swallow all extraneous '*'s after.  */
-            while (*wild == '*')
-                wild++;
-            while (*wild == '?' && *string) {
-                wild++;
-                string++;
-            }
-            if (!*wild) {
-                mreturn 1;
+        if (*w == '?') {
+            tp = &mp->toks[mp->ntoks++];
+            tp->type = MTOK_ANY;
+            mp->minlen++;
+            w++;
+            continue;
+        }
+        if ((flags & MATCH_FL_HOST) && *w == '[') {
+            /* collator.  support special [:alpha:], [:number:] and
+             * [:alnum:] semantics, otherwise any of the characters within
+             * will do. */
+            if ((end = strchr(w, ']')) == NULL) {
+                mp->kind = MATCH_K_NEVER;
+                break;
             }
-            if (*wild == '*')
-                continue;
-            while (*string) {
-                if (touppertab[(unsigned char)*string] ==
-                        touppertab[(unsigned char)*wild] &&
-                        _match((wild+1), (string+1))) {
-                    mreturn 1;
+            tp = &mp->toks[mp->ntoks++];
+            tp->type = MTOK_SET;
+            tp->off = MATCH_SET_SIZE * nsets++;
+            set = mp->sets + tp->off;
+            memset(set, 0, MATCH_SET_SIZE);
+            w++;
+            if (!strncasecmp(w, ":alpha:", 7))
+                class = isalpha;
+            else if (!strncasecmp(w, ":number:", 8))
+                class = isdigit;
+            else if (!strncasecmp(w, ":alnum:", 7))
+                class = isalnum;
+            else
+                class = NULL;
+            if (class != NULL) {
+                for (c = 1;c < 256;c++) {
+                    if (class(c))
+                        MATCH_SET_ADD(set, c);
+                }
+            } else {
+                for (s = w;s < end;s++) {
+                    for (c = 1;c < 256;c++) {
+                        if (tolowertab[c] == tolowertab[(unsigned char)*s])
+                            MATCH_SET_ADD(set, c);
+                    }
                 }
-                string++;
             }
+            mp->minlen++;
+            w = end + 1;
+            continue;
         }
-        if (!*string) {
-            mreturn 0;
+        if ((flags & MATCH_FL_HOST) && *w == '(') {
+            /* a choice of literal strings.  the first one which matches is
+             * taken. */
+            if ((end = strchr(w, ')')) == NULL) {
+                mp->kind = MATCH_K_NEVER;
+                break;
+            }
+            tp = &mp->toks[mp->ntoks++];
+            tp->type = MTOK_ALT;
+            tp->off = nalts;
+            tp->len = 0;
+            for (w++;;w = s + 1) {
+                for (s = w;s < end && *s != '|';s++)
+                    ;
+                mp->alts[nalts * 2] = litlen;
+                mp->alts[nalts * 2 + 1] = s - w;
+                while (w < s)
+                    mp->lits[litlen++] = tolowertab[(unsigned char)*w++];
+                if (tp->len && mp->alts[nalts * 2 + 1] !=
+                        mp->alts[tp->off * 2 + 1])
+                    mp->varlen = true;
+                nalts++;
+                tp->len++;
+                if (s == end)
+                    break;
+            }
+            for (i = tp->off, c = -1;i < tp->off + tp->len;i++) {
+                if (c == -1 || mp->alts[i * 2 + 1] < c)
+                    c = mp->alts[i * 2 + 1];
+            }
+            mp->minlen += c;
+            w = end + 1;
+            continue;
+        }
+
+        /* a literal character.  add it on to the last token if that was a
+         * literal too. */
+        if (tp == NULL || tp->type != MTOK_LIT) {
+            tp = &mp->toks[mp->ntoks++];
+            tp->type = MTOK_LIT;
+            tp->off = litlen;
+            tp->len = 0;
         }
-        if (*wild != '?' && touppertab[(unsigned char)*string] !=
-            touppertab[(unsigned char)*wild]) {
-                mreturn 0;
+        mp->lits[litlen++] = tolowertab[(unsigned char)*w++];
+        tp->len++;
+        mp->minlen++;
+    }
+
+    /* find the anchors for literals after '*'s.  these let us skip ahead
+     * to the places the literal might start with strchr(). */
+    for (i = 1;i < mp->ntoks;i++) {
+        tp = &mp->toks[i];
+        memset(tp->anchor, 0, sizeof(tp->anchor));
+        if (tp->type != MTOK_LIT || mp->toks[i - 1].type != MTOK_STAR)
+            continue;
+        for (c = 1, a = tp->anchor;c < 256;c++) {
+            if (tolowertab[c] != mp->lits[tp->off])
+                continue;
+            if (a == tp->anchor + sizeof(tp->anchor) - 1) {
+                *tp->anchor = '\0';
+                break;
+            }
+            *a++ = c;
         }
-        string++;
-        wild++;
     }
-    mreturn 0;
+    if (mp->ntoks)
+        mp->tail = (mp->toks[mp->ntoks - 1].type == MTOK_LIT);
+
+    /* and see if it is one of the simple kinds */
+    tp = mp->toks;
+    if (mp->kind == MATCH_K_NEVER)
+        ;
+    else if (mp->ntoks == 1 && tp[0].type == MTOK_STAR)
+        mp->kind = MATCH_K_ANY;
+    else if (mp->ntoks == 1 && tp[0].type == MTOK_LIT)
+        mp->kind = MATCH_K_EXACT;
+    else if (mp->ntoks == 2 && tp[0].type == MTOK_LIT &&
+            tp[1].type == MTOK_STAR)
+        mp->kind = MATCH_K_PREFIX;
+    else if (mp->ntoks == 2 && tp[0].type == MTOK_STAR &&
+            tp[1].type == MTOK_LIT)
+        mp->kind = MATCH_K_SUFFIX;
+    else if (mp->ntoks == 3 && tp[0].type == MTOK_STAR &&
+            tp[1].type == MTOK_LIT && tp[2].type == MTOK_STAR)
+        mp->kind = MATCH_K_SUBSTR;
+    else
+        mp->kind = MATCH_K_GENERAL;
+
+    return mp;
 }
 
-int match(const char *wild, const char *string)
-{
-    matchdepth = 0;
-    if (!strcmp(wild, "*"))
-        return 1; /* definite match */
+void destroy_matcher(matcher_t *mp) {
+
+    if (mp == NULL)
+        return;
+    free(mp->pattern);
+    free(mp->toks);
+    free(mp->lits);
+    if (mp->alts != NULL)
+        free(mp->alts);
+    if (mp->sets != NULL)
+        free(mp->sets);
+    free(mp);
+}
 
-    return _match(wild, string);
+const char *matcher_pattern(const matcher_t *mp) {
+    return mp->pattern;
 }
 
-#define MAX_HOSTMATCH_DEPTH 32
+/* compare 'len' bytes of a (folded) literal against the string.  the
+ * literal never contains a nul, so this stops at the end of the string. */
+static inline int match_lit(const unsigned char *lit, const char *s,
+        int len) {
 
-/* the below behaves almost exactly like my other match function, with the
-* exception that it supports two additional notations which come from
-* regular expressions.  the [abcdef...] notation, (and also special
-* entries, documented elsehwere), and the (opt1,opt2,opt3,...) notation */
-static int _hostmatch(const char *wild, const char *string) {
-    if (++matchdepth > MAX_HOSTMATCH_DEPTH) {
-        mreturn 0;
+    while (len-- > 0) {
+        if (tolowertab[(unsigned char)*s++] != *lit++)
+            return 0;
     }
+    return 1;
+}
 
-    while (1) {
-        /* Logic: Match * in a string, this is confusing, sort of
-         * if * is the last thing in the wildcard, the match is
-         * definite if we've gotten this far.
-         * otherwise we try and find every occurance of the
-         * the next character in the wildcard within the string
-         * and match from there, calling the function recursively
-         * until some level below us returns positive, in which
-         * case we too return positive.  For strings with lots
-         * of wildcards this gets disgustingly recursive.
-         */
-        if (!*wild) {
-            mreturn ((*string == '\0') ? 1 : 0);
+/* find the next place at or after 's' where the literal in 'tp' might
+ * start, or NULL if there isn't one. */
+static inline const char *match_anchor(const struct match_token *tp,
+        const char *s) {
+
+    if (tp->anchor[1] == '\0')
+        return strchr(s, tp->anchor[0]);
+    return strpbrk(s, tp->anchor);
+}
+
+/* find the literal in 'tp' anywhere in 's' */
+static int match_find(const matcher_t *mp, const struct match_token *tp,
+        const char *s) {
+
+    if (*tp->anchor != '\0') {
+        while ((s = match_anchor(tp, s)) != NULL) {
+            if (match_lit(mp->lits + tp->off, s, tp->len))
+                return 1;
+            s++;
         }
-        if (*wild == '*') {
-            wild++;
-            /* swallow all extraneous '*'s after.  */
-            while (*wild == '*')
-                wild++;
-            while (*wild == '?' && *string) {
-                wild++;
-                string++;
-            }
-            if (!*wild) {
-                mreturn 1;
+        return 0;
+    }
+    for (;*s != '\0';s++) {
+        if (match_lit(mp->lits + tp->off, s, tp->len))
+            return 1;
+    }
+    return 0;
+}
+
+#define MATCH_STACK_SIZE 32
+
+/* the general case.  walk the tokens along the string, and whenever one
+ * fails go back to the last '*' and let it take another character. */
+static int matcher_run(const matcher_t *mp, const char *string) {
+    struct {
+        int     ti;
+        const char *sp;
+    } stack_local[MATCH_STACK_SIZE], *stack = stack_local, *top;
+    const struct match_token *tp;
+    const char *sp = string;
+    int depth = 0, ti = 0, ret = 0;
+    int i, n;
+    bool ok;
+
+    if (mp->varlen && mp->nstars > MATCH_STACK_SIZE)
+        stack = malloc(sizeof(*stack) * mp->nstars);
+
+    while (1) {
+        if (ti == mp->ntoks) {
+            if (*sp == '\0') {
+                ret = 1;
+                break;
             }
-            if (*wild == '*')
-                continue;
-            if (*wild == '(' || *wild == '[') {
-                while (*string) {
-                    if (_hostmatch(wild, string)) {
-                        mreturn 1;
+            ok = false;
+        } else {
+            tp = &mp->toks[ti];
+            ok = true;
+            switch (tp->type) {
+                case MTOK_STAR:
+                    /* if '*' is the last thing in the pattern, the match
+                     * is definite if we've gotten this far.  otherwise
+                     * remember where we are and go on, starting where the
+                     * next literal (if there is one) could start. */
+                    if (++ti == mp->ntoks) {
+                        ret = 1;
+                        goto done;
                     }
-                    string++;
-                }
-            } else {
-                while (*string) {
-                    if (touppertab[(unsigned char)*string] ==
-                            touppertab[(unsigned char)*wild] &&
-                            _hostmatch((wild+1), (string+1))) {
-                        mreturn 1;
+                    if (!mp->varlen)
+                        depth = 0;
+                    if (*mp->toks[ti].anchor != '\0' &&
+                            (sp = match_anchor(&mp->toks[ti], sp)) == NULL) {
+                        ok = false;
+                        break;
                     }
-                    string++;
-                }
-            }
-        }
-        if (!*string) {
-            mreturn 0;
-        }
-        if (*wild == '[') {
-            const char *end = wild++;
-            /* collator.  support special [:alpha:] and [:number:] semantics,
-             * as well as others. */
-            while (*end) {
-                if (*end == ']')
+                    stack[depth].ti = ti;
+                    stack[depth].sp = sp;
+                    depth++;
                     break;
-                end++;
-            }
-            if (!*end) {
-                mreturn 0;
-            }
-            if (!strncasecmp(wild, ":alpha:", 7)) {
-                if (isalpha(*string))
-                    wild = end + 1;
-                else {
-                    mreturn 0;
-                }
-            } else if (!strncasecmp(wild, ":number:", 8)) {
-                if (isdigit(*string))
-                    wild = end + 1;
-                else {
-                    mreturn 0;
-                }
-            }
-            if (!strncasecmp(wild, ":alnum:", 7)) {
-                if (isalpha(*string) || isdigit(*string))
-                    wild = end + 1;
-                else {
-                    mreturn 0;
-                }
-            } else {
-                while (wild != end) {
-                    if (touppertab[(unsigned char)*wild] ==
-                            touppertab[(unsigned char)*string]) {
-                        wild = end + 1;
-                        break;
+                case MTOK_ANY:
+                    if ((ok = (*sp != '\0'))) {
+                        sp++;
+                        ti++;
                     }
-                    wild++;
-                }
-                if (wild == end) {
-                    mreturn 0;
-                }
-            }
-            /* if wild != end, we succeeded */
-            string++;
-            continue;
-        }
-        /* regretably (?) we do only literal matching here.  but I'm not sure
-         * if that's a bad thing.... */
-        if (*wild == '(') {
-            const char *end = wild++;
-            const char *ends = wild;
-            while (*end) {
-                if (*end == ')')
                     break;
-                end++;
-            }
-            if (!*end) {
-                mreturn 0;
-            }
-            /* we have found the end, now find each substring and do compares */
-            while (ends != NULL) {
-                if (*ends == '|' || *ends == ')') {
-                    if (!strncasecmp(wild, string, ends - wild)) {
-                        string += ends - wild;
-                        wild = end + 1;
-                        break;
+                case MTOK_LIT:
+                    if ((ok = match_lit(mp->lits + tp->off, sp, tp->len))) {
+                        sp += tp->len;
+                        ti++;
                     }
-                    wild = ends + 1; 
-                    if (*ends == ')') {
-                        ends = NULL;
-                        break;
+                    break;
+                case MTOK_SET:
+                    if ((ok = (*sp != '\0' &&
+                                MATCH_SET_HAS(mp->sets + tp->off, *sp)))) {
+                        sp++;
+                        ti++;
                     }
-                }
-                ends++;
-            }
-            if (ends == NULL) {
-                mreturn 0;
+                    break;
+                case MTOK_ALT:
+                    /* (an empty choice doesn't match at the end of the
+                     * string, since no token but '*' does) */
+                    ok = false;
+                    for (i = tp->off;*sp != '\0' && i < tp->off + tp->len;
+                            i++) {
+                        n = mp->alts[i * 2 + 1];
+                        if (match_lit(mp->lits + mp->alts[i * 2], sp, n)) {
+                            sp += n;
+                            ti++;
+                            ok = true;
+                            break;
+                        }
+                    }
+                    break;
             }
-            continue;
         }
-        if (*wild != '?' && touppertab[(unsigned char)*string] !=
-                touppertab[(unsigned char)*wild]) {
-            mreturn 0;
+        if (ok)
+            continue;
+
+        /* no luck.  go back to the last '*' with characters left to take
+         * and give it one more. */
+        while (1) {
+            if (depth == 0)
+                goto done;
+            top = &stack[depth - 1];
+            if (*top->sp == '\0') {
+                depth--;
+                continue;
+            }
+            sp = top->sp + 1;
+            if (*mp->toks[top->ti].anchor != '\0' &&
+                    (sp = match_anchor(&mp->toks[top->ti], sp)) == NULL) {
+                depth--;
+                continue;
+            }
+            top->sp = sp;
+            ti = top->ti;
+            break;
         }
-        string++;
-        wild++;
     }
-    mreturn 0;
+
+done:
+    if (stack != stack_local)
+        free(stack);
+    return ret;
 }
 
-int hostmatch(const char *wild, const char *string) {
-    matchdepth = 0;
+int matcher_match(const matcher_t *mp, const char *string) {
+    const struct match_token *tp = mp->toks;
+    size_t len;
 
-    /* in case we get a *, return success immediately */
-    if (!strcmp(string, "*"))
-        return 1;
+    switch (mp->kind) {
+        case MATCH_K_NEVER:
+            return 0;
+        case MATCH_K_ANY:
+            return 1;
+        case MATCH_K_EXACT:
+            return (match_lit(mp->lits, string, tp->len) &&
+                    string[tp->len] == '\0');
+        case MATCH_K_PREFIX:
+            return match_lit(mp->lits, string, tp->len);
+        case MATCH_K_SUBSTR:
+            return match_find(mp, &tp[1], string);
+    }
+
+    /* anything ending in a literal has to end with that literal, which is
+     * a cheap thing to check before doing any real work. */
+    if (mp->tail) {
+        tp = &mp->toks[mp->ntoks - 1];
+        len = strlen(string);
+        if (len < mp->minlen || !match_lit(mp->lits + tp->off,
+                    string + len - tp->len, tp->len))
+            return 0;
+        if (mp->kind == MATCH_K_SUFFIX)
+            return 1;
+    }
 
-    return _hostmatch(wild, string);
+    return matcher_run(mp, string);
 }
 
+int matcher_ipmatch(const matcher_t *mp, const char *str) {
+    unsigned char addr[IPADDR_SIZE];
+    int bytes = mp->bits / 8;
+    int rem = mp->bits % 8;
 
-/* match an IP using one of:
- * regular address (v4/v6)
- * address with significant bits (v4/v6)
- *
- * this is unfortunately not a very cheap call, anymore. */
-int ipmatch(const char *wild, const char *str) {
-    unsigned char bwild[IPADDR_SIZE]; /* these two are the bit-forms of the */
-    unsigned char bstr[IPADDR_SIZE];  /* ... two addresses. */
-    unsigned char bitmask[IPADDR_SIZE]; /* we store our bitmap this way because
-                                           of the length of IPv6 addresses. */
-    int family = PF_INET;
-    int alen = 0;
-    char addr[IPADDR_MAXLEN + 1];
-    int imask = 0;
-    int i;
-    char *mask;
+    if (mp->family == 0 || inet_pton(mp->family, str, addr) != 1)
+        return 0;
+    if (memcmp(addr, mp->addr, bytes))
+        return 0;
+    if (rem && ((addr[bytes] ^ mp->addr[bytes]) & (0xff << (8 - rem))))
+        return 0;
+    return 1;
+}
 
-    memset(bitmask, 0xff, IPADDR_SIZE);
-    strlcpy(addr, wild, IPADDR_MAXLEN + 1);
+/* the cache of compiled patterns for match(), hostmatch() and ipmatch().
+ * it is direct-mapped: each pattern has one slot it can live in, and it
+ * pushes out whatever was there before. */
+#define MATCH_CACHE_SIZE 512
 
-    /* strip off the mask portion if it is there */
-    if ((mask = strchr(wild, '/')) != NULL) {
-        /* mask form.  mask specifies significant bits from left to right.
-         * we must make sure to truncate addr at the point where the mask
-         * starts as well, if it starts before IPADDR_MAXLEN. */
-        if (IPADDR_MAXLEN > mask - wild)
-            addr[mask - wild] = '\0';
-        mask++;
+static matcher_t *match_cache[MATCH_CACHE_SIZE];
+
+static matcher_t *match_cached(const char *wild, int flags) {
+    const unsigned char *s = (const unsigned char *)wild;
+    uint32_t hv = 2166136261U ^ flags; /* FNV-1a */
+    matcher_t **mpp;
+
+    while (*s != '\0') {
+        hv ^= *s++;
+        hv *= 16777619U;
     }
+    mpp = &match_cache[hv % MATCH_CACHE_SIZE];
+    if (*mpp != NULL && (*mpp)->flags == flags &&
+            !strcmp((*mpp)->pattern, wild))
+        return *mpp;
+
+    destroy_matcher(*mpp);
+    *mpp = create_matcher(wild, flags);
+    return *mpp;
+}
 
-    /* now determine the address family */
-    family = get_address_type(addr);
-    if (family != PF_INET && family != PF_INET6)
-        return 0;
+int match(const char *wild, const char *string) {
 
-    /* and handle the bitmasking if need-be */
-    if (mask != NULL) {
-        imask = str_conv_int(mask, 0);
+    if (wild[0] == '*' && wild[1] == '\0')
+        return 1; /* definite match */
 
-        if (family == PF_INET6) {
-            if (imask <= 0)
-                imask = 128;
-            else if (imask > 128)
-                imask = 128;
-        } else {
-            if (imask <= 0)
-                imask = 32;
-            else if (imask > 32)
-                imask = 32;
-        }
-        memset(bitmask, 0, IPADDR_SIZE);
-        /* walk down i, setting bits as necessary. */
-        for (i = imask;i > 0;i -= (i % 8 ? i % 8 : 8))
-            bitmask[(i - 1) / 8] = 0xff << (i % 8 ? (8 - (i % 8)) : 0);
-    }
+    return matcher_match(match_cached(wild, 0), string);
+}
 
-    /* now copy our addresses into bitmasks.  if either pton fails, assume no
-     * match. */
-    if (inet_pton(family, addr, bwild) != 1)
-        return 0;
-    if (inet_pton(family, str, bstr) != 1)
-        return 0;
+/* the below behaves almost exactly like match, with the exception that it
+ * supports two additional notations which come from regular expressions.
+ * the [abcdef...] notation, (and also special entries, documented
+ * elsehwere), and the (opt1|opt2|opt3|...) notation */
+int hostmatch(const char *wild, const char *string) {
 
-    /* now walk along the wild bitstring and the str bitstring and modify them
-     * as per the bitmask string, then do a straight compare. */
-    alen = (family == PF_INET6 ? 16 : 4);
-    for (i = 0;i < alen;i++) {
-        bwild[i] &= bitmask[i];
-        bstr[i] &= bitmask[i];
+    /* in case we get a *, return success immediately */
+    if (!strcmp(string, "*"))
+        return 1;
 
-        if (bwild[i] != bstr[i])
-            return 0;
-    }
-    return 1; /* made it all the way through!  voila. */
+    return matcher_match(match_cached(wild, MATCH_FL_HOST), string);
+}
+
+/* match an IP using one of:
+ * regular address (v4/v6)
+ * address with significant bits (v4/v6) */
+int ipmatch(const char *wild, const char *str) {
+
+    return matcher_ipmatch(match_cached(wild, MATCH_FL_IP), str);
 }
 
 /* these are safe string converters used to, effectively, turn strings into
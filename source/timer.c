@@ -1,172 +1,295 @@
 /*
  * timer.c: the timer system functions
- * 
+ *
  * Copyright 2002 the Ithildin Project.
  * See the COPYING file for more information on licensing and use.
- * 
+ *
  * This file contains the functions necessary to create and manage timers.
- * Currently timers have only second-level resolution (i.e. there are no
- * sub-second timers).  Timers are referred to using a 64-bit reference id.
- * This allows for 2^64 timers to be created before there is any danger of
- * overlap.
+ * Timers have millisecond resolution, although most callers still think in
+ * seconds (see create_timer() vs. create_timer_ms()).  Pending timers are
+ * kept in a binary min-heap ordered by their next execution time, so
+ * inserting, adjusting or removing a timer is O(log n) and finding the next
+ * one to go off is O(1).
+ *
+ * Timers are referred to using a 64-bit reference id.  The low 32 bits of
+ * the id are the timer's slot in the timer table, and the high 32 bits are a
+ * sequence number which is bumped every time a timer is created.  This lets
+ * us find a timer from its reference in constant time, while still noticing
+ * references to timers which have since gone away (and whose slot may have
+ * been re-used).
  */
 
 #include <ithildin/stand.h>
 
 IDSTRING(rcsid, "$Id: timer.c 578 2005-08-21 06:37:53Z wd $");
 
-/* this stores the reference count for timers and whether or not the reference
- * count has rolled over. */
-static timer_ref_t timer_refcnt;
-bool timer_rollover;
-
 #define TIMER_DEAD -1
 #define TIMER_REPEAT -2
 
+#define TIMER_SLOT(ref) ((uint32_t)((ref) & 0xffffffff))
+
+/* the heap of pending timers.  timer_heap[0] is always the next to go off. */
+static timer_event_t **timer_heap = NULL;
+static unsigned int timer_heap_num = 0;
+static unsigned int timer_heap_size = 0;
+
+/* the slot table maps reference ids back to timers.  unused slots are kept on
+ * a stack so they can be handed out again. */
+static timer_event_t **timer_slots = NULL;
+static uint32_t timer_slots_size = 0;
+static uint32_t *timer_freeslots = NULL;
+static uint32_t timer_freeslots_num = 0;
+static uint32_t timer_seq = 0;
+
 static timer_event_t *find_timer(timer_ref_t);
-static inline void insert_timer(timer_event_t *);
+static void free_timer(timer_event_t *);
+static inline void timer_heap_up(unsigned int);
+static inline void timer_heap_down(unsigned int);
+static void insert_timer(timer_event_t *);
+static void remove_timer(timer_event_t *);
+
+/* This returns the current time in milliseconds, and updates me.now while
+ * it's at it. */
+uint64_t timer_now(void) {
+#ifdef HAVE_GETTIMEOFDAY
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    me.now = tv.tv_sec;
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#else
+    me.now = time(NULL);
+    return (uint64_t)me.now * 1000;
+#endif
+}
 
 /* This creates a new timer which repeats for the given count (0 means no
  * repetition, negative values mean infinite repetition) at the given interval
  * calling the given function at each execution of the timer.  It returns the
  * reference id of the timer so that it can be destroyed later if necessary.
  * The reference id is given to avoid passing back a timer_event structure that
- * may disappear and become invalid during execution. */
+ * may disappear and become invalid during execution.  The interval for
+ * create_timer() is in seconds, for create_timer_ms() it is in milliseconds.
+ */
 timer_ref_t create_timer(int rep, time_t interval, hook_function_t callback,
         void *udata) {
+
+    return create_timer_ms(rep, (uint64_t)interval * 1000, callback, udata);
+}
+
+timer_ref_t create_timer_ms(int rep, uint64_t interval,
+        hook_function_t callback, void *udata) {
     timer_event_t *tep = malloc(sizeof(timer_event_t));
+    uint32_t slot;
 
-    if (timer_rollover) {
-        /* if the timer ref count has rolled over we need to make sure we
-         * assign a unique reference id. */
-        tep->ref = timer_refcnt++;
-        while (find_timer(tep->ref) != NULL)
-            tep->ref = timer_refcnt++;
-    } else {
-        tep->ref = timer_refcnt++;
-        if (timer_refcnt == 0)
-            timer_rollover = true;
-        if (tep->ref == TIMER_INVALID) {
-            free(tep);
-            return create_timer(rep, interval, callback, udata);
+    /* find a slot for the timer, growing the table if we're out. */
+    if (timer_freeslots_num == 0) {
+        uint32_t i = timer_slots_size;
+
+        timer_slots_size = (timer_slots_size ? timer_slots_size * 2 : 64);
+        timer_slots = realloc(timer_slots,
+                sizeof(timer_event_t *) * timer_slots_size);
+        timer_freeslots = realloc(timer_freeslots,
+                sizeof(uint32_t) * timer_slots_size);
+        /* push them on in reverse so that low slots get used first */
+        slot = timer_slots_size;
+        while (slot-- > i) {
+            timer_slots[slot] = NULL;
+            timer_freeslots[timer_freeslots_num++] = slot;
         }
     }
+    slot = timer_freeslots[--timer_freeslots_num];
+    timer_slots[slot] = tep;
+
+    /* the sequence number can roll over harmlessly, the slot keeps the ref
+     * unique among live timers.  just never hand out TIMER_INVALID. */
+    if (++timer_seq == 0xffffffff && slot == 0xffffffff)
+        timer_seq = 0;
+    tep->ref = ((timer_ref_t)timer_seq << 32) | slot;
 
     if (rep < 0)
         tep->reps = TIMER_REPEAT;
     else
         tep->reps = rep;
     tep->interval = interval;
-    tep->next = me.now + tep->interval;
+    tep->next = timer_now() + tep->interval;
     tep->callback = callback;
     tep->udata = udata;
+    tep->flags = 0;
 
     insert_timer(tep);
 
     return tep->ref;
 }
 
-/* This function looks for a timer with the given reference id and returns it
- * if it is found. */
+/* This function looks up the timer with the given reference id and returns it
+ * if it still exists. */
 static timer_event_t *find_timer(timer_ref_t ref) {
-    timer_event_t *tep;
+    uint32_t slot = TIMER_SLOT(ref);
 
-    LIST_FOREACH(tep, &me.timers, lp) {
-        if (tep->ref == ref)
-            return tep;
-    }
+    if (ref == TIMER_INVALID || slot >= timer_slots_size ||
+            timer_slots[slot] == NULL || timer_slots[slot]->ref != ref)
+        return NULL;
+
+    return timer_slots[slot];
+}
 
-    return NULL;
+/* release a timer and its slot. */
+static void free_timer(timer_event_t *tep) {
+    uint32_t slot = TIMER_SLOT(tep->ref);
+
+    timer_slots[slot] = NULL;
+    timer_freeslots[timer_freeslots_num++] = slot;
+    free(tep);
 }
 
-/* This destroys the timer with the given reference id.  It is possible (but
- * rather unlikely) that the wrong timer can be destroyed here because of a
- * previously assigned reference id. */
+/* This destroys the timer with the given reference id.  If the timer is
+ * currently executing it is only marked, and exec_timers() will clean it up
+ * when the callback returns. */
 void destroy_timer(timer_ref_t ref) {
     timer_event_t *tep = find_timer(ref);
 
     if (tep == NULL)
         return;
 
-    LIST_REMOVE(tep, lp);
-    free(tep);
+    if (tep->flags & TIMER_FL_RUNNING) {
+        tep->flags |= TIMER_FL_DESTROYED;
+        return;
+    }
+
+    remove_timer(tep);
+    free_timer(tep);
 }
 
 /* this allows the caller to adjust the settings of a timer (specifically the
  * repeat count and the time it goes off).  the third argument is the execution
- * time from 'now' (the current time). */
+ * time from 'now' (the current time), in seconds for adjust_timer() and
+ * milliseconds for adjust_timer_ms(). */
 void adjust_timer(timer_ref_t tref, int reps, time_t interval) {
+
+    adjust_timer_ms(tref, reps, (uint64_t)interval * 1000);
+}
+
+void adjust_timer_ms(timer_ref_t tref, int reps, uint64_t interval) {
     timer_event_t *tep = find_timer(tref);
 
     if (tep == NULL)
         return;
 
-    LIST_REMOVE(tep, lp);
     tep->reps = (reps < 0 ? TIMER_REPEAT : reps);
     tep->interval = interval;
-    tep->next = me.now + interval;
+    tep->next = timer_now() + interval;
+    /* if the timer is running it isn't in the heap right now.  exec_timers()
+     * will put it back with the new settings. */
+    if (tep->flags & TIMER_FL_RUNNING) {
+        tep->flags |= TIMER_FL_ADJUSTED;
+        return;
+    }
+    remove_timer(tep);
     insert_timer(tep);
 }
 
 /* This function executes each timer that needs to be called and re-orders the
- * list as necessary. */
+ * heap as necessary.  It returns the number of milliseconds until the next
+ * timer needs to go off, or 0 if there are no timers. */
 time_t exec_timers(void) {
-    timer_event_t *tep, *tep2;
+    timer_event_t *tep;
+    uint64_t now = timer_now();
 
-    tep = LIST_FIRST(&me.timers);
-    me.now = time(NULL);
-    while (tep != NULL) {
-        tep2 = LIST_NEXT(tep, lp);
-        if (tep->next <= me.now) {
-            tep->callback(NULL, tep->udata);
-            /* now see if the timer needs to be deleted.  if not, then we
-             * re-calculate next and re-position the timer in the list. */
-            if (tep->reps != TIMER_REPEAT && --tep->reps == TIMER_DEAD)
-                destroy_timer(tep->ref);
-            else {
-                if ((tep->next += tep->interval) < me.now)
-                    tep->next = me.now + tep->interval;
-                LIST_REMOVE(tep, lp);
-                insert_timer(tep);
-            }
-        } else
-            /* the list is sorted, so if the condition above is false all the
-             * timers at and beyond this point will not need to go off at this
-             * go-around */
-            break;
-        tep = tep2;
-        me.now = time(NULL);
+    /* we only look at the clock once per call.  anything which becomes due
+     * while the callbacks are running will be caught next time around. */
+    while (timer_heap_num > 0 && (tep = timer_heap[0])->next <= now) {
+        remove_timer(tep);
+        tep->flags |= TIMER_FL_RUNNING;
+        tep->callback(NULL, tep->udata);
+        tep->flags &= ~TIMER_FL_RUNNING;
+
+        /* now see if the timer needs to be deleted.  if not, then we
+         * re-calculate next and put the timer back in the heap.  timers which
+         * were adjusted by their own callback keep the new settings. */
+        if (tep->flags & TIMER_FL_DESTROYED)
+            free_timer(tep);
+        else if (tep->flags & TIMER_FL_ADJUSTED) {
+            tep->flags &= ~TIMER_FL_ADJUSTED;
+            insert_timer(tep);
+        } else if (tep->reps != TIMER_REPEAT && --tep->reps == TIMER_DEAD)
+            free_timer(tep);
+        else {
+            if ((tep->next += tep->interval) <= now)
+                tep->next = now + (tep->interval ? tep->interval : 1);
+            insert_timer(tep);
+        }
     }
 
     /* We've executed all the timers we needed to... see when the next one (if
      * any) will need to go off. */
-    if (LIST_EMPTY(&me.timers))
+    if (timer_heap_num == 0)
         return 0;
     else
-        return ((timer_event_t *)LIST_FIRST(&me.timers))->next - me.now;
+        return (time_t)(timer_heap[0]->next - now);
 }
 
-/* This inserts a timer into the correct position in the timer list.  That is,
- * it sorts the timer list by order of execution. */
-static inline void insert_timer(timer_event_t *timer) {
-    timer_event_t *tep;
+/* these two functions restore the heap property after the entry at the given
+ * position has become smaller or larger (respectively) than it used to be. */
+static inline void timer_heap_up(unsigned int idx) {
+    timer_event_t *tep = timer_heap[idx];
+    unsigned int parent;
 
-    tep = LIST_FIRST(&me.timers);
-    if (tep == NULL) {
-        LIST_INSERT_HEAD(&me.timers, timer, lp);
-        return;
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (timer_heap[parent]->next <= tep->next)
+            break;
+        timer_heap[idx] = timer_heap[parent];
+        timer_heap[idx]->heapidx = idx;
+        idx = parent;
     }
+    timer_heap[idx] = tep;
+    tep->heapidx = idx;
+}
 
-    while (tep != NULL) {
-        if (tep->next > timer->next) {
-            LIST_INSERT_BEFORE(tep, timer, lp);
-            return;
-        }
-        if (LIST_NEXT(tep, lp) == NULL)
+static inline void timer_heap_down(unsigned int idx) {
+    timer_event_t *tep = timer_heap[idx];
+    unsigned int child;
+
+    while ((child = idx * 2 + 1) < timer_heap_num) {
+        if (child + 1 < timer_heap_num &&
+                timer_heap[child + 1]->next < timer_heap[child]->next)
+            child++;
+        if (tep->next <= timer_heap[child]->next)
             break;
-        tep = LIST_NEXT(tep, lp);
+        timer_heap[idx] = timer_heap[child];
+        timer_heap[idx]->heapidx = idx;
+        idx = child;
+    }
+    timer_heap[idx] = tep;
+    tep->heapidx = idx;
+}
+
+/* This adds a timer to the heap. */
+static void insert_timer(timer_event_t *timer) {
+
+    if (timer_heap_num == timer_heap_size) {
+        timer_heap_size = (timer_heap_size ? timer_heap_size * 2 : 64);
+        timer_heap = realloc(timer_heap,
+                sizeof(timer_event_t *) * timer_heap_size);
     }
-    LIST_INSERT_AFTER(tep, timer, lp);
+    timer_heap[timer_heap_num] = timer;
+    timer_heap_up(timer_heap_num++);
+}
+
+/* And this takes it back out, moving the last entry in the heap into its
+ * place. */
+static void remove_timer(timer_event_t *timer) {
+    unsigned int idx = timer->heapidx;
+
+    if (--timer_heap_num == idx)
+        return; /* it was the last one */
+    timer_heap[idx] = timer_heap[timer_heap_num];
+    timer_heap[idx]->heapidx = idx;
+    if (idx > 0 && timer_heap[idx]->next < timer_heap[(idx - 1) / 2]->next)
+        timer_heap_up(idx);
+    else
+        timer_heap_down(idx);
 }
 
 /* vi:set ts=8 sts=4 sw=4 tw=76 et: */